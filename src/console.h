@@ -0,0 +1,20 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <iostream>
+
+// the stream a thread has redirected its own messages to, or nullptr
+inline std::ostream*& threadConsole() {
+    thread_local std::ostream* stream = nullptr;
+    return stream;
+}
+
+// the stream that messages are printed to: std::cout, unless the calling
+//   thread has redirected its own messages, which leaves std::cout alone
+//   for any other thread printing at the same time
+inline std::ostream& console() {
+    std::ostream* const stream = threadConsole();
+    return stream != nullptr ? *stream : std::cout;
+}
+
+#endif
@@ -1,108 +1,339 @@
 #include <iostream>
 #include <fstream>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <iomanip>
+#include <sstream>
+#include <list>
+#include <unordered_map>
+#include <cstdio>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "console.h"
 #include "jpg.h"
+#include "jpgwriter.h"
+#include "simd.h"
+
+// return the position of the first 0xFF byte in data[start, size),
+//   or size if there is none
+SIMD_INLINE std::size_t findMarkerByteKernel(const byte* const data, std::size_t start, const std::size_t size) {
+    // test 32 bytes at a time, which vectorizes, before
+    //   locating the byte within them
+    while (start + 32 <= size) {
+        uint found = 0;
+        for (uint i = 0; i < 32; ++i) {
+            found |= data[start + i] == 0xFF;
+        }
+        if (found) {
+            break;
+        }
+        start += 32;
+    }
+    while (start < size && data[start] != 0xFF) {
+        start += 1;
+    }
+    return start;
+}
+SIMD_KERNEL(std::size_t, findMarkerByte, (const byte* const data, const std::size_t start, const std::size_t size), (data, start, size))
 
-// helper class to read bits from a file
+// helper class to read bits from a file that has been loaded into memory
 class BitReader {
 private:
     byte nextByte = 0;
     byte nextBit = 0;
-    std::ifstream inFile;
+    const byte* data = nullptr;
+    std::size_t size = 0;
+    std::size_t pos = 0;
+    // no 0xFF occurs in the data between pos and cleanEnd
+    std::size_t cleanEnd = 0;
+    bool failed = false;
 
-public:
-    BitReader(const std::string& filename) {
-        inFile.open(filename, std::ios::in | std::ios::binary);
+    // read the next byte, or return -1 once past the end of the data
+    int get() {
+        if (pos >= size) {
+            failed = true;
+            return -1;
+        }
+        return data[pos++];
     }
 
-    ~BitReader() {
-        if (inFile.is_open()) {
-            inFile.close();
-        }
+    // return the next byte without consuming it, or -1 at the end of the data
+    int peek() const {
+        return pos < size ? data[pos] : -1;
     }
 
+public:
+    BitReader(const byte* const d, const std::size_t s, const std::size_t start = 0) :
+    data(d),
+    size(s),
+    pos(start)
+    {}
+
     bool hasBits() {
-        return !!inFile;
+        return !failed;
     }
 
     byte readByte() {
         nextBit = 0;
-        return inFile.get();
+        return get();
     }
 
     uint readWord() {
         nextBit = 0;
-        return (inFile.get() << 8) + inFile.get();
+        const uint high = get() << 8;
+        return high + get();
     }
 
-    // read one bit (0 or 1) or return -1 if all bits have already been read
-    uint readBit() {
-        if (nextBit == 0) {
+    // load the next byte of entropy-coded data into nextByte, skipping
+    //   stuffed zeroes and restart markers
+    // return false if all bits have already been read
+    bool fillByte() {
+        // plain data needs no checks, and is refilled up to the next 0xFF
+        if (pos < cleanEnd) {
+            nextByte = data[pos++];
+            return true;
+        }
+        if (pos < size && data[pos] != 0xFF) {
+            cleanEnd = findMarkerByte(data, pos, size);
+            nextByte = data[pos++];
+            return true;
+        }
+        if (!hasBits()) {
+            return false;
+        }
+        nextByte = get();
+        while (nextByte == 0xFF) {
             if (!hasBits()) {
-                return -1;
+                return false;
             }
-            nextByte = inFile.get();
-            while (nextByte == 0xFF) {
+            byte marker = peek();
+            // ignore multiple 0xFF's in a row
+            while (marker == 0xFF) {
+                get();
                 if (!hasBits()) {
-                    return -1;
-                }
-                byte marker = inFile.peek();
-                // ignore multiple 0xFF's in a row
-                while (marker == 0xFF) {
-                    inFile.get();
-                    if (!hasBits()) {
-                        return -1;
-                    }
-                    marker = inFile.peek();
-                }
-                // literal 0xFF's are encoded in the bitstream as 0xFF00
-                if (marker == 0x00) {
-                    inFile.get();
-                    break;
-                }
-                // restart marker
-                else if (marker >= RST0 && marker <= RST7) {
-                    inFile.get();
-                    nextByte = inFile.get();
-                }
-                else {
-                    std::cout << "Error - Invalid marker: 0x" << std::hex << (uint)marker << std::dec << '\n';
-                    return -1;
+                    return false;
                 }
+                marker = peek();
+            }
+            // literal 0xFF's are encoded in the bitstream as 0xFF00
+            if (marker == 0x00) {
+                get();
+                break;
+            }
+            // restart marker
+            else if (marker >= RST0 && marker <= RST7) {
+                get();
+                nextByte = get();
+            }
+            else {
+                console() << "Error - Invalid marker: 0x" << std::hex << (uint)marker << std::dec << '\n';
+                return false;
             }
         }
+        return true;
+    }
+
+    // read one bit (0 or 1) or return -1 if all bits have already been read
+    uint readBit() {
+        if (nextBit == 0 && !fillByte()) {
+            return -1;
+        }
         uint bit = (nextByte >> (7 - nextBit)) & 1;
         nextBit = (nextBit + 1) % 8;
         return bit;
     }
 
-    // read a variable number of bits
+    // read a variable number of bits, taking as many as possible
+    //   from each byte at once
     // first read bit is most significant bit
     // return -1 if at any point all bits have already been read
     uint readBits(const uint length) {
         uint bits = 0;
-        for (uint i = 0; i < length; ++i) {
-            uint bit = readBit();
-            if (bit == -1) {
-                bits = -1;
-                break;
+        uint remaining = length;
+        while (remaining > 0) {
+            if (nextBit == 0 && !fillByte()) {
+                return -1;
             }
-            bits = (bits << 1) | bit;
+            const uint available = 8 - nextBit;
+            const uint count = remaining < available ? remaining : available;
+            bits = (bits << count) | ((nextByte >> (available - count)) & ((1 << count) - 1));
+            nextBit = (nextBit + count) % 8;
+            remaining -= count;
         }
         return bits;
     }
 
+    // continue reading from a copy of the data that has since grown,
+    //   keeping the position within it
+    void extend(const byte* const d, const std::size_t s) {
+        data = d;
+        size = s;
+    }
+
     // advance to the 0th bit of the next byte
     void align() {
         nextBit = 0;
     }
+
+    // number of bytes read from the file so far
+    std::size_t position() {
+        return pos;
+    }
+
+    // position of the next unread bit; two readers of the same data
+    //   that reach the same position are in the same state
+    std::size_t bitPosition() const {
+        return nextBit == 0 ? pos * 8 : (pos - 1) * 8 + nextBit;
+    }
+
+    // advance to the next byte and consume the restart marker that must
+    //   start there, returning false if it is missing or is not expected
+    bool readRestartMarker(const byte expected) {
+        nextBit = 0;
+        // ignore multiple 0xFF's in a row
+        while (pos + 2 < size && data[pos] == 0xFF && data[pos + 1] == 0xFF) {
+            pos += 1;
+        }
+        if (pos + 1 >= size || data[pos] != 0xFF || data[pos + 1] != expected) {
+            return false;
+        }
+        pos += 2;
+        return true;
+    }
+
+    // skip the rest of the entropy-coded data of the current scan,
+    //   stopping at the 0xFF of the next marker that is not a restart marker
+    void skipToMarker() {
+        nextBit = 0;
+        while (hasBits()) {
+            pos = findMarkerByte(data, pos, size);
+            if (get() != 0xFF) {
+                continue;
+            }
+            // ignore multiple 0xFF's in a row
+            int marker = peek();
+            while (marker == 0xFF) {
+                get();
+                marker = peek();
+            }
+            // literal 0xFF's and restart markers belong to the scan
+            if (marker == 0x00 || (marker >= RST0 && marker <= RST7)) {
+                get();
+                continue;
+            }
+            pos -= 1;
+            return;
+        }
+    }
+};
+
+// fixed set of worker threads that run queued tasks
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable taskAvailable;
+    std::condition_variable allDone;
+    uint activeTasks = 0;
+    bool stopping = false;
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            taskAvailable.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            std::function<void()> task = std::move(tasks.front());
+            tasks.pop();
+            activeTasks += 1;
+            lock.unlock();
+            task();
+            lock.lock();
+            activeTasks -= 1;
+            if (activeTasks == 0 && tasks.empty()) {
+                allDone.notify_all();
+            }
+        }
+    }
+
+public:
+    ThreadPool(const uint numThreads) {
+        for (uint i = 0; i < numThreads; ++i) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        taskAvailable.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // queue a task, which may itself queue more tasks
+    void run(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push(std::move(task));
+        }
+        taskAvailable.notify_one();
+    }
+
+    // block until all queued tasks have finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        allDone.wait(lock, [this] { return activeTasks == 0 && tasks.empty(); });
+    }
 };
 
+// read a whole file, or at most its first maxSize bytes, into data
+bool readFile(const std::string& filename, std::vector<byte>& data, const std::size_t maxSize = -1) {
+    std::ifstream inFile(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open()) {
+        return false;
+    }
+    // reserve the whole file up front, as growing the buffer would
+    //   briefly need twice its size
+    inFile.seekg(0, std::ios::end);
+    const std::streamoff fileSize = inFile.tellg();
+    inFile.seekg(0, std::ios::beg);
+    if (fileSize > 0) {
+        data.reserve((std::size_t)fileSize < maxSize ? fileSize : maxSize);
+    }
+    // pipes cannot seek
+    inFile.clear();
+    char chunk[65536];
+    while (data.size() < maxSize && (inFile.read(chunk, sizeof(chunk)) || inFile.gcount() > 0)) {
+        const std::size_t read = inFile.gcount();
+        const std::size_t count = read < maxSize - data.size() ? read : maxSize - data.size();
+        data.insert(data.end(), chunk, chunk + count);
+    }
+    inFile.close();
+    return true;
+}
+
 // SOF specifies frame type, dimensions, and number of color components
 void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading SOF Marker\n";
+    console() << "Reading SOF Marker\n";
     if (image->numComponents != 0) {
-        std::cout << "Error - Multiple SOFs detected\n";
+        console() << "Error - Multiple SOFs detected\n";
         image->valid = false;
         return;
     }
@@ -111,7 +342,7 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
 
     byte precision = bitReader.readByte();
     if (precision != 8) {
-        std::cout << "Error - Invalid precision: " << (uint)precision << '\n';
+        console() << "Error - Invalid precision: " << (uint)precision << '\n';
         image->valid = false;
         return;
     }
@@ -119,7 +350,7 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
     image->height = bitReader.readWord();
     image->width = bitReader.readWord();
     if (image->height == 0 || image->width == 0) {
-        std::cout << "Error - Invalid dimensions\n";
+        console() << "Error - Invalid dimensions\n";
         image->valid = false;
         return;
     }
@@ -130,12 +361,12 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
 
     image->numComponents = bitReader.readByte();
     if (image->numComponents == 4) {
-        std::cout << "Error - CMYK color mode not supported\n";
+        console() << "Error - CMYK color mode not supported\n";
         image->valid = false;
         return;
     }
     if (image->numComponents != 1 && image->numComponents != 3) {
-        std::cout << "Error - " << (uint)image->numComponents << " color components given (1 or 3 required)\n";
+        console() << "Error - " << (uint)image->numComponents << " color components given (1 or 3 required)\n";
         image->valid = false;
         return;
     }
@@ -150,13 +381,13 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
             componentID += 1;
         }
         if (componentID == 0 || componentID > image->numComponents) {
-            std::cout << "Error - Invalid component ID: " << (uint)componentID << '\n';
+            console() << "Error - Invalid component ID: " << (uint)componentID << '\n';
             image->valid = false;
             return;
         }
         ColorComponent& component = image->colorComponents[componentID - 1];
         if (component.usedInFrame) {
-            std::cout << "Error - Duplicate color component ID: " << (uint)componentID << '\n';
+            console() << "Error - Duplicate color component ID: " << (uint)componentID << '\n';
             image->valid = false;
             return;
         }
@@ -168,7 +399,7 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
         if (componentID == 1) {
             if ((component.horizontalSamplingFactor != 1 && component.horizontalSamplingFactor != 2) ||
                 (component.verticalSamplingFactor != 1 && component.verticalSamplingFactor != 2)) {
-                std::cout << "Error - Sampling factors not supported\n";
+                console() << "Error - Sampling factors not supported\n";
                 image->valid = false;
                 return;
             }
@@ -183,7 +414,7 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
         }
         else {
             if (component.horizontalSamplingFactor != 1 || component.verticalSamplingFactor != 1) {
-                std::cout << "Error - Sampling factors not supported\n";
+                console() << "Error - Sampling factors not supported\n";
                 image->valid = false;
                 return;
             }
@@ -191,14 +422,14 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
 
         component.quantizationTableID = bitReader.readByte();
         if (component.quantizationTableID > 3) {
-            std::cout << "Error - Invalid quantization table ID: " << (uint)component.quantizationTableID << '\n';
+            console() << "Error - Invalid quantization table ID: " << (uint)component.quantizationTableID << '\n';
             image->valid = false;
             return;
         }
     }
 
     if (length - 8 - (3 * image->numComponents) != 0) {
-        std::cout << "Error - SOF invalid\n";
+        console() << "Error - SOF invalid\n";
         image->valid = false;
         return;
     }
@@ -206,7 +437,7 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
 
 // DQT contains one or more quantization tables
 void readQuantizationTable(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading DQT Marker\n";
+    console() << "Reading DQT Marker\n";
     int length = bitReader.readWord();
     length -= 2;
 
@@ -216,7 +447,7 @@ void readQuantizationTable(BitReader& bitReader, JPGImage* const image) {
         byte tableID = tableInfo & 0x0F;
 
         if (tableID > 3) {
-            std::cout << "Error - Invalid quantization table ID: " << (uint)tableID << '\n';
+            console() << "Error - Invalid quantization table ID: " << (uint)tableID << '\n';
             image->valid = false;
             return;
         }
@@ -238,27 +469,15 @@ void readQuantizationTable(BitReader& bitReader, JPGImage* const image) {
     }
 
     if (length != 0) {
-        std::cout << "Error - DQT invalid\n";
+        console() << "Error - DQT invalid\n";
         image->valid = false;
         return;
     }
 }
 
-// generate all Huffman codes based on symbols from a Huffman table
-void generateCodes(HuffmanTable& hTable) {
-    uint code = 0;
-    for (uint i = 0; i < 16; ++i) {
-        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
-            hTable.codes[j] = code;
-            code += 1;
-        }
-        code <<= 1;
-    }
-}
-
 // DHT contains one or more Huffman tables
 void readHuffmanTable(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading DHT Marker\n";
+    console() << "Reading DHT Marker\n";
     int length = bitReader.readWord();
     length -= 2;
 
@@ -268,7 +487,7 @@ void readHuffmanTable(BitReader& bitReader, JPGImage* const image) {
         bool acTable = tableInfo >> 4;
 
         if (tableID > 3) {
-            std::cout << "Error - Invalid Huffman table ID: " << (uint)tableID << '\n';
+            console() << "Error - Invalid Huffman table ID: " << (uint)tableID << '\n';
             image->valid = false;
             return;
         }
@@ -285,7 +504,7 @@ void readHuffmanTable(BitReader& bitReader, JPGImage* const image) {
             hTable.offsets[i] = allSymbols;
         }
         if (allSymbols > 176) {
-            std::cout << "Error - Too many symbols in Huffman table: " << allSymbols << '\n';
+            console() << "Error - Too many symbols in Huffman table: " << allSymbols << '\n';
             image->valid = false;
             return;
         }
@@ -300,7 +519,7 @@ void readHuffmanTable(BitReader& bitReader, JPGImage* const image) {
     }
 
     if (length != 0) {
-        std::cout << "Error - DHT invalid\n";
+        console() << "Error - DHT invalid\n";
         image->valid = false;
         return;
     }
@@ -308,9 +527,9 @@ void readHuffmanTable(BitReader& bitReader, JPGImage* const image) {
 
 // SOS contains color component info for the next scan
 void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading SOS Marker\n";
+    console() << "Reading SOS Marker\n";
     if (image->numComponents == 0) {
-        std::cout << "Error - SOS detected before SOF\n";
+        console() << "Error - SOS detected before SOF\n";
         image->valid = false;
         return;
     }
@@ -325,7 +544,7 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
     //   components in the image
     image->componentsInScan = bitReader.readByte();
     if (image->componentsInScan == 0) {
-        std::cout << "Error - Scan must include at least 1 component\n";
+        console() << "Error - Scan must include at least 1 component\n";
         image->valid = false;
         return;
     }
@@ -336,18 +555,18 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
             componentID += 1;
         }
         if (componentID == 0 || componentID > image->numComponents) {
-            std::cout << "Error - Invalid color component ID: " << (uint)componentID << '\n';
+            console() << "Error - Invalid color component ID: " << (uint)componentID << '\n';
             image->valid = false;
             return;
         }
         ColorComponent& component = image->colorComponents[componentID - 1];
         if (!component.usedInFrame) {
-            std::cout << "Error - Invalid color component ID: " << (uint)componentID << '\n';
+            console() << "Error - Invalid color component ID: " << (uint)componentID << '\n';
             image->valid = false;
             return;
         }
         if (component.usedInScan) {
-            std::cout << "Error - Duplicate color component ID: " << (uint)componentID << '\n';
+            console() << "Error - Duplicate color component ID: " << (uint)componentID << '\n';
             image->valid = false;
             return;
         }
@@ -357,12 +576,12 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
         component.huffmanDCTableID = huffmanTableIDs >> 4;
         component.huffmanACTableID = huffmanTableIDs & 0x0F;
         if (component.huffmanDCTableID > 3) {
-            std::cout << "Error - Invalid Huffman DC table ID: " << (uint)component.huffmanDCTableID << '\n';
+            console() << "Error - Invalid Huffman DC table ID: " << (uint)component.huffmanDCTableID << '\n';
             image->valid = false;
             return;
         }
         if (component.huffmanACTableID > 3) {
-            std::cout << "Error - Invalid Huffman AC table ID: " << (uint)component.huffmanACTableID << '\n';
+            console() << "Error - Invalid Huffman AC table ID: " << (uint)component.huffmanACTableID << '\n';
             image->valid = false;
             return;
         }
@@ -374,43 +593,43 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
     image->successiveApproximationHigh = successiveApproximation >> 4;
     image->successiveApproximationLow = successiveApproximation & 0x0F;
 
-    if (image->frameType == SOF0) {
-        // Baseline JPGs don't use spectral selection or successive approximtion
+    if (image->frameType == SOF0 || image->frameType == SOF1) {
+        // Sequential JPGs don't use spectral selection or successive approximtion
         if (image->startOfSelection != 0 || image->endOfSelection != 63) {
-            std::cout << "Error - Invalid spectral selection\n";
+            console() << "Error - Invalid spectral selection\n";
             image->valid = false;
             return;
         }
         if (image->successiveApproximationHigh != 0 || image->successiveApproximationLow != 0) {
-            std::cout << "Error - Invalid successive approximation\n";
+            console() << "Error - Invalid successive approximation\n";
             image->valid = false;
             return;
         }
     }
     else if (image->frameType == SOF2) {
         if (image->startOfSelection > image->endOfSelection) {
-            std::cout << "Error - Invalid spectral selection (start greater than end)\n";
+            console() << "Error - Invalid spectral selection (start greater than end)\n";
             image->valid = false;
             return;
         }
         if (image->endOfSelection > 63) {
-            std::cout << "Error - Invalid spectral selection (end greater than 63)\n";
+            console() << "Error - Invalid spectral selection (end greater than 63)\n";
             image->valid = false;
             return;
         }
         if (image->startOfSelection == 0 && image->endOfSelection != 0) {
-            std::cout << "Error - Invalid spectral selection (contains DC and AC)\n";
+            console() << "Error - Invalid spectral selection (contains DC and AC)\n";
             image->valid = false;
             return;
         }
         if (image->startOfSelection != 0 && image->componentsInScan != 1) {
-            std::cout << "Error - Invalid spectral selection (AC scan contains multiple components)\n";
+            console() << "Error - Invalid spectral selection (AC scan contains multiple components)\n";
             image->valid = false;
             return;
         }
         if (image->successiveApproximationHigh != 0 &&
             image->successiveApproximationLow != image->successiveApproximationHigh - 1) {
-            std::cout << "Error - Invalid successive approximation\n";
+            console() << "Error - Invalid successive approximation\n";
             image->valid = false;
             return;
         }
@@ -420,20 +639,20 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
         const ColorComponent& component = image->colorComponents[i];
         if (image->colorComponents[i].usedInScan) {
             if (image->quantizationTables[component.quantizationTableID].set == false) {
-                std::cout << "Error - Color component using uninitialized quantization table\n";
+                console() << "Error - Color component using uninitialized quantization table\n";
                 image->valid = false;
                 return;
             }
             if (image->startOfSelection == 0) {
                 if (image->huffmanDCTables[component.huffmanDCTableID].set == false) {
-                    std::cout << "Error - Color component using uninitialized Huffman DC table\n";
+                    console() << "Error - Color component using uninitialized Huffman DC table\n";
                     image->valid = false;
                     return;
                 }
             }
             if (image->endOfSelection > 0) {
                 if (image->huffmanACTables[component.huffmanACTableID].set == false) {
-                    std::cout << "Error - Color component using uninitialized Huffman AC table\n";
+                    console() << "Error - Color component using uninitialized Huffman AC table\n";
                     image->valid = false;
                     return;
                 }
@@ -442,7 +661,7 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
     }
 
     if (length - 6 - (2 * image->componentsInScan) != 0) {
-        std::cout << "Error - SOS invalid\n";
+        console() << "Error - SOS invalid\n";
         image->valid = false;
         return;
     }
@@ -450,12 +669,12 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
 
 // restart interval is needed to stay synchronized during data scans
 void readRestartInterval(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading DRI Marker\n";
+    console() << "Reading DRI Marker\n";
     uint length = bitReader.readWord();
 
     image->restartInterval = bitReader.readWord();
     if (length - 4 != 0) {
-        std::cout << "Error - DRI invalid\n";
+        console() << "Error - DRI invalid\n";
         image->valid = false;
         return;
     }
@@ -463,10 +682,10 @@ void readRestartInterval(BitReader& bitReader, JPGImage* const image) {
 
 // APPNs simply get skipped based on length
 void readAPPN(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading APPN Marker\n";
+    console() << "Reading APPN Marker\n";
     uint length = bitReader.readWord();
     if (length < 2) {
-        std::cout << "Error - APPN invalid\n";
+        console() << "Error - APPN invalid\n";
         image->valid = false;
         return;
     }
@@ -478,10 +697,10 @@ void readAPPN(BitReader& bitReader, JPGImage* const image) {
 
 // comments simply get skipped based on length
 void readComment(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading COM Marker\n";
+    console() << "Reading COM Marker\n";
     uint length = bitReader.readWord();
     if (length < 2) {
-        std::cout << "Error - COM invalid\n";
+        console() << "Error - COM invalid\n";
         image->valid = false;
         return;
     }
@@ -494,31 +713,31 @@ void readComment(BitReader& bitReader, JPGImage* const image) {
 // print all info extracted from the JPG file
 void printFrameInfo(const JPGImage* const image) {
     if (image == nullptr) return;
-    std::cout << "SOF=============\n";
-    std::cout << "Frame Type: 0x" << std::hex << (uint)image->frameType << std::dec << '\n';
-    std::cout << "Height: " << image->height << '\n';
-    std::cout << "Width: " << image->width << '\n';
-    std::cout << "Color Components:\n";
+    console() << "SOF=============\n";
+    console() << "Frame Type: 0x" << std::hex << (uint)image->frameType << std::dec << '\n';
+    console() << "Height: " << image->height << '\n';
+    console() << "Width: " << image->width << '\n';
+    console() << "Color Components:\n";
     for (uint i = 0; i < image->numComponents; ++i) {
         if (image->colorComponents[i].usedInFrame) {
-            std::cout << "Component ID: " << (i + 1) << '\n';
-            std::cout << "Horizontal Sampling Factor: " << (uint)image->colorComponents[i].horizontalSamplingFactor << '\n';
-            std::cout << "Vertical Sampling Factor: " << (uint)image->colorComponents[i].verticalSamplingFactor << '\n';
-            std::cout << "Quantization Table ID: " << (uint)image->colorComponents[i].quantizationTableID << '\n';
+            console() << "Component ID: " << (i + 1) << '\n';
+            console() << "Horizontal Sampling Factor: " << (uint)image->colorComponents[i].horizontalSamplingFactor << '\n';
+            console() << "Vertical Sampling Factor: " << (uint)image->colorComponents[i].verticalSamplingFactor << '\n';
+            console() << "Quantization Table ID: " << (uint)image->colorComponents[i].quantizationTableID << '\n';
         }
     }
-    std::cout << "DQT=============\n";
+    console() << "DQT=============\n";
     for (uint i = 0; i < 4; ++i) {
         if (image->quantizationTables[i].set) {
-            std::cout << "Table ID: " << i << '\n';
-            std::cout << "Table Data:";
+            console() << "Table ID: " << i << '\n';
+            console() << "Table Data:";
             for (uint j = 0; j < 64; ++j) {
                 if (j % 8 == 0) {
-                    std::cout << '\n';
+                    console() << '\n';
                 }
-                std::cout << image->quantizationTables[i].table[j] << ' ';
+                console() << image->quantizationTables[i].table[j] << ' ';
             }
-            std::cout << '\n';
+            console() << '\n';
         }
     }
 }
@@ -526,50 +745,50 @@ void printFrameInfo(const JPGImage* const image) {
 // print info for the next scan
 void printScanInfo(const JPGImage* const image) {
     if (image == nullptr) return;
-    std::cout << "SOS=============\n";
-    std::cout << "Start of Selection: " << (uint)image->startOfSelection << '\n';
-    std::cout << "End of Selection: " << (uint)image->endOfSelection << '\n';
-    std::cout << "Successive Approximation High: " << (uint)image->successiveApproximationHigh << '\n';
-    std::cout << "Successive Approximation Low: " << (uint)image->successiveApproximationLow << '\n';
-    std::cout << "Color Components:\n";
+    console() << "SOS=============\n";
+    console() << "Start of Selection: " << (uint)image->startOfSelection << '\n';
+    console() << "End of Selection: " << (uint)image->endOfSelection << '\n';
+    console() << "Successive Approximation High: " << (uint)image->successiveApproximationHigh << '\n';
+    console() << "Successive Approximation Low: " << (uint)image->successiveApproximationLow << '\n';
+    console() << "Color Components:\n";
     for (uint i = 0; i < image->numComponents; ++i) {
         if (image->colorComponents[i].usedInScan) {
-            std::cout << "Component ID: " << (i + 1) << '\n';
-            std::cout << "Huffman DC Table ID: " << (uint)image->colorComponents[i].huffmanDCTableID << '\n';
-            std::cout << "Huffman AC Table ID: " << (uint)image->colorComponents[i].huffmanACTableID << '\n';
+            console() << "Component ID: " << (i + 1) << '\n';
+            console() << "Huffman DC Table ID: " << (uint)image->colorComponents[i].huffmanDCTableID << '\n';
+            console() << "Huffman AC Table ID: " << (uint)image->colorComponents[i].huffmanACTableID << '\n';
         }
     }
-    std::cout << "DHT=============\n";
-    std::cout << "DC Tables:\n";
+    console() << "DHT=============\n";
+    console() << "DC Tables:\n";
     for (uint i = 0; i < 4; ++i) {
         if (image->huffmanDCTables[i].set) {
-            std::cout << "Table ID: " << i << '\n';
-            std::cout << "Symbols:\n";
+            console() << "Table ID: " << i << '\n';
+            console() << "Symbols:\n";
             for (uint j = 0; j < 16; ++j) {
-                std::cout << (j + 1) << ": ";
+                console() << (j + 1) << ": ";
                 for (uint k = image->huffmanDCTables[i].offsets[j]; k < image->huffmanDCTables[i].offsets[j + 1]; ++k) {
-                    std::cout << std::hex << (uint)image->huffmanDCTables[i].symbols[k] << std::dec << ' ';
+                    console() << std::hex << (uint)image->huffmanDCTables[i].symbols[k] << std::dec << ' ';
                 }
-                std::cout << '\n';
+                console() << '\n';
             }
         }
     }
-    std::cout << "AC Tables:\n";
+    console() << "AC Tables:\n";
     for (uint i = 0; i < 4; ++i) {
         if (image->huffmanACTables[i].set) {
-            std::cout << "Table ID: " << i << '\n';
-            std::cout << "Symbols:\n";
+            console() << "Table ID: " << i << '\n';
+            console() << "Symbols:\n";
             for (uint j = 0; j < 16; ++j) {
-                std::cout << (j + 1) << ": ";
+                console() << (j + 1) << ": ";
                 for (uint k = image->huffmanACTables[i].offsets[j]; k < image->huffmanACTables[i].offsets[j + 1]; ++k) {
-                    std::cout << std::hex << (uint)image->huffmanACTables[i].symbols[k] << std::dec << ' ';
+                    console() << std::hex << (uint)image->huffmanACTables[i].symbols[k] << std::dec << ' ';
                 }
-                std::cout << '\n';
+                console() << '\n';
             }
         }
     }
-    std::cout << "DRI=============\n";
-    std::cout << "Restart Interval: " << image->restartInterval << '\n';
+    console() << "DRI=============\n";
+    console() << "Restart Interval: " << image->restartInterval << '\n';
 }
 
 void readFrameHeader(BitReader& bitReader, JPGImage* const image) {
@@ -577,7 +796,7 @@ void readFrameHeader(BitReader& bitReader, JPGImage* const image) {
     byte last = bitReader.readByte();
     byte current = bitReader.readByte();
     if (last != 0xFF || current != SOI) {
-        std::cout << "Error - SOI invalid\n";
+        console() << "Error - SOI invalid\n";
         image->valid = false;
         return;
     }
@@ -587,18 +806,20 @@ void readFrameHeader(BitReader& bitReader, JPGImage* const image) {
     // read markers until first scan
     while (image->valid) {
         if (!bitReader.hasBits()) {
-            std::cout << "Error - File ended prematurely\n";
+            console() << "Error - File ended prematurely\n";
             image->valid = false;
             return;
         }
         if (last != 0xFF) {
-            std::cout << "Error - Expected a marker\n";
+            console() << "Error - Expected a marker\n";
             image->valid = false;
             return;
         }
 
-        if (current == SOF0) {
-            image->frameType = SOF0;
+        if (current == SOF0 || current == SOF1) {
+            // extended sequential frames with Huffman coding and 8-bit
+            //   samples are decoded the same way as baseline ones
+            image->frameType = current;
             readStartOfFrame(bitReader, image);
         }
         else if (current == SOF2) {
@@ -641,32 +862,32 @@ void readFrameHeader(BitReader& bitReader, JPGImage* const image) {
         }
 
         else if (current == SOI) {
-            std::cout << "Error - Embedded JPGs not supported\n";
+            console() << "Error - Embedded JPGs not supported\n";
             image->valid = false;
             return;
         }
         else if (current == EOI) {
-            std::cout << "Error - EOI detected before SOS\n";
+            console() << "Error - EOI detected before SOS\n";
             image->valid = false;
             return;
         }
         else if (current == DAC) {
-            std::cout << "Error - Arithmetic Coding mode not supported\n";
+            console() << "Error - Arithmetic Coding mode not supported\n";
             image->valid = false;
             return;
         }
         else if (current >= SOF0 && current <= SOF15) {
-            std::cout << "Error - SOF marker not supported: 0x" << std::hex << (uint)current << std::dec << '\n';
+            console() << "Error - SOF marker not supported: 0x" << std::hex << (uint)current << std::dec << '\n';
             image->valid = false;
             return;
         }
         else if (current >= RST0 && current <= RST7) {
-            std::cout << "Error - RSTN detected before SOS\n";
+            console() << "Error - RSTN detected before SOS\n";
             image->valid = false;
             return;
         }
         else {
-            std::cout << "Error - Unknown marker: 0x" << std::hex << (uint)current << std::dec << '\n';
+            console() << "Error - Unknown marker: 0x" << std::hex << (uint)current << std::dec << '\n';
             image->valid = false;
             return;
         }
@@ -675,36 +896,412 @@ void readFrameHeader(BitReader& bitReader, JPGImage* const image) {
     }
 }
 
-void decodeHuffmanData(BitReader& bitReader, JPGImage* const image);
+// capture everything printed to std::cout while in scope, so that the
+//   messages of the marker readers can be inspected instead of printed
+class CapturedOutput {
+private:
+    std::ostringstream messages;
+    std::streambuf* const previous;
+
+public:
+    CapturedOutput() :
+    previous(std::cout.rdbuf(messages.rdbuf()))
+    {}
+
+    ~CapturedOutput() {
+        std::cout.rdbuf(previous);
+    }
+
+    // everything printed so far
+    std::string text() const {
+        return messages.str();
+    }
+
+    // the first error printed, without its "Error - " prefix
+    std::string firstError() const {
+        const std::string log = messages.str();
+        const std::size_t pos = log.find("Error - ");
+        return pos == std::string::npos ? "Invalid JPG" : log.substr(pos + 8, log.find('\n', pos) - pos - 8);
+    }
+};
+
+// discard everything the calling thread prints while in scope, without
+//   touching std::cout, so that threads may each silence themselves
+class SilencedOutput {
+private:
+    // a stream without a buffer fails every output quietly
+    std::ostream discard;
+    std::ostream* const previous;
+
+public:
+    SilencedOutput() :
+    discard(nullptr),
+    previous(threadConsole())
+    {
+        threadConsole() = &discard;
+    }
+
+    ~SilencedOutput() {
+        threadConsole() = previous;
+    }
+};
+
+// estimate the IJG quality that qTable was scaled to from base, as the
+//   quality whose scaled table is closest to it
+// exact is set if that table is identical to qTable
+uint estimateQuality(const QuantizationTable& qTable, const QuantizationTable& base, bool& exact) {
+    uint bestQuality = 0;
+    uint bestDistance = -1;
+    for (uint quality = 1; quality <= 100; ++quality) {
+        const QuantizationTable scaled = scaleQuantizationTable(base, quality);
+        uint distance = 0;
+        for (uint i = 0; i < 64; ++i) {
+            distance += scaled.table[i] > qTable.table[i] ?
+                scaled.table[i] - qTable.table[i] :
+                qTable.table[i] - scaled.table[i];
+        }
+        if (distance < bestDistance) {
+            bestQuality = quality;
+            bestDistance = distance;
+        }
+    }
+    exact = bestDistance == 0;
+    return bestQuality;
+}
+
+// most headers take up a few kilobytes, once APPN and COM segments are
+//   skipped; the probe gives up on files whose other headers exceed this
+const std::size_t maxProbeSize = 4 * 1024 * 1024;
+
+// read the segments of a JPG from its SOI up to the marker of its first
+//   scan into data, stopping early at anything that ends the headers
+// the contents of APPN and COM segments, such as embedded thumbnails or
+//   color profiles, are skipped in the file instead of read, leaving empty
+//   segments; skips records, for positions in data, how many bytes of the
+//   file were skipped before them
+// return false if the headers exceed maxProbeSize
+bool readHeaderSegments(
+    std::ifstream& inFile,
+    std::vector<byte>& data,
+    std::vector<std::pair<std::size_t, std::size_t>>& skips
+) {
+    std::size_t skipped = 0;
+    while (data.size() <= maxProbeSize) {
+        const int last = inFile.get();
+        if (last == EOF) {
+            return true;
+        }
+        data.push_back(last);
+        if (last != 0xFF) {
+            // the marker readers take bytes in pairs before finding that
+            //   they do not start a marker
+            const int next = inFile.get();
+            if (next != EOF) {
+                data.push_back(next);
+            }
+            return true;
+        }
+        // any number of 0xFF in a row is allowed
+        int current = inFile.get();
+        while (current == 0xFF) {
+            data.push_back(current);
+            current = inFile.get();
+        }
+        if (current == EOF) {
+            return true;
+        }
+        data.push_back(current);
+        if ((current == SOI && data.size() == 2) || current == TEM) {
+            continue;
+        }
+        const bool skippable = (current >= APP0 && current <= APP15) || current == COM ||
+            (current >= JPG0 && current <= JPG13) || current == DNL || current == DHP || current == EXP;
+        if (!skippable && current != SOF0 && current != SOF1 && current != SOF2 && current != DQT && current != DHT && current != DRI) {
+            return true;
+        }
+
+        const int high = inFile.get();
+        const int low = inFile.get();
+        if (high == EOF || low == EOF) {
+            return true;
+        }
+        const uint length = (high << 8) | low;
+        if (length < 2) {
+            data.push_back(high);
+            data.push_back(low);
+            return true;
+        }
+        if (skippable) {
+            data.push_back(0);
+            data.push_back(2);
+            inFile.seekg(length - 2, std::ios::cur);
+            skipped += length - 2;
+            skips.emplace_back(data.size(), skipped);
+            continue;
+        }
+        data.push_back(high);
+        data.push_back(low);
+        const std::size_t size = data.size();
+        data.resize(size + length - 2);
+        inFile.read((char*)data.data() + size, length - 2);
+        if ((std::size_t)inFile.gcount() < length - 2) {
+            data.resize(size + inFile.gcount());
+            return true;
+        }
+    }
+    return false;
+}
+
+// read the markers of a JPG up to its first scan, skipping the contents of
+//   APPN and COM segments
+// the messages of the marker readers are captured instead of printed,
+//   keeping the first error
+JPGProbe probeJPG(const std::string& filename) {
+    JPGProbe probe;
+    std::ifstream inFile(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open()) {
+        probe.header.valid = false;
+        probe.error = "Error opening input file";
+        return probe;
+    }
+    inFile.seekg(0, std::ios::end);
+    const std::size_t fileSize = inFile.tellg();
+    inFile.seekg(0, std::ios::beg);
+
+    std::vector<byte> data;
+    std::vector<std::pair<std::size_t, std::size_t>> skips;
+    const bool complete = readHeaderSegments(inFile, data, skips);
+    // the offset in the file of a position in data
+    auto fileOffset = [&](const std::size_t position) {
+        std::size_t offset = position;
+        for (const auto& skip : skips) {
+            if (skip.first <= position) {
+                offset = position + skip.second;
+            }
+        }
+        return offset < fileSize ? offset : fileSize;
+    };
+    if (!complete) {
+        probe.header.valid = false;
+        probe.error = "Headers exceed the probe limit of " + std::to_string(maxProbeSize) + " bytes";
+        probe.errorOffset = fileOffset(data.size());
+        return probe;
+    }
+
+    {
+        CapturedOutput messages;
+        BitReader bitReader(data.data(), data.size());
+        readFrameHeader(bitReader, &probe.header);
+        if (!probe.header.valid) {
+            probe.error = messages.firstError();
+            probe.errorOffset = fileOffset(bitReader.position());
+            return probe;
+        }
+    }
+
+    const JPGImage& header = probe.header;
+    if (header.numComponents == 0) {
+        probe.header.valid = false;
+        probe.error = "SOS detected before SOF";
+        return probe;
+    }
+    const QuantizationTable& yTable = header.quantizationTables[header.colorComponents[0].quantizationTableID];
+    if (yTable.set) {
+        probe.quality = estimateQuality(yTable, qTableY50, probe.exactQuality);
+    }
+    if (header.numComponents == 3) {
+        const QuantizationTable& cbcrTable = header.quantizationTables[header.colorComponents[1].quantizationTableID];
+        bool exact = false;
+        if (cbcrTable.set) {
+            probe.chromaQuality = estimateQuality(cbcrTable, qTableCbCr50, exact);
+        }
+        probe.exactQuality = probe.exactQuality && exact;
+    }
+    return probe;
+}
+
+// quote and escape a string for JSON output
+std::string jsonString(const std::string& value) {
+    std::string quoted = "\"";
+    for (const char c : value) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if ((byte)c < 0x20) {
+            const char* const hex = "0123456789abcdef";
+            quoted += "\\u00";
+            quoted += hex[(byte)c >> 4];
+            quoted += hex[c & 0x0F];
+        }
+        else {
+            quoted += c;
+        }
+    }
+    return quoted + '"';
+}
+
+// print the header information of a JPG as one line of JSON
+void printProbe(const std::string& filename, const JPGProbe& probe) {
+    const JPGImage& header = probe.header;
+    console() << "{\"file\":" << jsonString(filename);
+    if (!header.valid) {
+        console() << ",\"valid\":false,\"error\":" << jsonString(probe.error) << ",\"offset\":" << probe.errorOffset << "}\n";
+        return;
+    }
+    console() << ",\"valid\":true";
+    console() << ",\"width\":" << header.width;
+    console() << ",\"height\":" << header.height;
+    console() << ",\"components\":" << (uint)header.numComponents;
+    console() << ",\"progressive\":" << (header.frameType == SOF2 ? "true" : "false");
+    console() << ",\"sampling\":[";
+    for (uint i = 0; i < header.numComponents; ++i) {
+        const ColorComponent& component = header.colorComponents[i];
+        console() << (i == 0 ? "" : ",") << '[' << (uint)component.horizontalSamplingFactor << ',' << (uint)component.verticalSamplingFactor << ']';
+    }
+    console() << ']';
+    console() << ",\"restartInterval\":" << header.restartInterval;
+    console() << ",\"quality\":" << probe.quality;
+    if (header.numComponents == 3) {
+        console() << ",\"chromaQuality\":" << probe.chromaQuality;
+    }
+    console() << ",\"exactQuality\":" << (probe.exactQuality ? "true" : "false");
+    console() << "}\n";
+}
+
+bool decodeHuffmanData(
+    BitReader& bitReader,
+    JPGImage* const image,
+    const bool validate = false,
+    ScanProgress* const progress = nullptr,
+    const uint endRow = -1
+);
+bool decodeSpeculatively(const std::vector<byte>& data, const ScanRecord& scan, JPGImage* const image, const uint numThreads);
+
+// whether a progressive scan reaches beyond the requested spectral band,
+//   or refines coefficients of a scan that was skipped, since refinements
+//   cannot be decoded without knowing which coefficients are nonzero
+// the coefficients of skipped scans are remembered for later refinements
+bool skipSpectralBand(JPGImage* const image, const DecoderOptions& options) {
+    if (image->frameType != SOF2) {
+        return false;
+    }
+    const std::uint64_t band = (~0ull >> (63 - image->endOfSelection)) & (~0ull << image->startOfSelection);
+    bool skip = image->endOfSelection > options.maxSpectralBand;
+    for (uint i = 0; i < image->numComponents; ++i) {
+        const ColorComponent& component = image->colorComponents[i];
+        if (component.usedInScan && image->successiveApproximationHigh != 0 &&
+            (component.skippedCoefficients & band) != 0) {
+            skip = true;
+        }
+    }
+    if (skip) {
+        for (uint i = 0; i < image->numComponents; ++i) {
+            ColorComponent& component = image->colorComponents[i];
+            if (component.usedInScan) {
+                component.skippedCoefficients |= band;
+            }
+        }
+    }
+    return skip;
+}
 
-void readScans(BitReader& bitReader, JPGImage* const image) {
-    // decode first scan
+// read the SOS header of the next scan and return whether its data is to
+//   be decoded, or skipped because the scan lies beyond the requested
+//   spectral band or holds only chroma that is not stored
+bool startScan(BitReader& bitReader, JPGImage* const image, const DecoderOptions& options) {
     readStartOfScan(bitReader, image);
     if (!image->valid) {
-        return;
+        return false;
     }
     printScanInfo(image);
-    decodeHuffmanData(bitReader, image);
 
+    if (skipSpectralBand(image, options)) {
+        console() << "Skipping scan beyond spectral band " << (uint)options.maxSpectralBand << '\n';
+        return false;
+    }
+    if (image->lumaOnly && !image->colorComponents[0].usedInScan) {
+        console() << "Skipping chroma scan\n";
+        return false;
+    }
+    return true;
+}
+
+// read the SOS header of the next scan and decode its Huffman data,
+//   or skip the data entirely if the scan is not to be decoded
+// if scans is given, the data is only located and recorded so that
+//   it can be decoded later
+void decodeScan(
+    BitReader& bitReader,
+    JPGImage* const image,
+    const DecoderOptions& options,
+    uint& scanNumber,
+    std::vector<ScanRecord>* const scans
+) {
+    if (!startScan(bitReader, image, options)) {
+        if (image->valid) {
+            bitReader.skipToMarker();
+        }
+        return;
+    }
+
+    if (scans != nullptr) {
+        ScanRecord scan;
+        scan.header = *image;
+        scan.start = bitReader.position();
+        bitReader.skipToMarker();
+        scan.end = bitReader.position();
+        scans->push_back(scan);
+        scanNumber += 1;
+        return;
+    }
+
+    if (!decodeHuffmanData(bitReader, image, options.validate) && options.validate) {
+        image->valid = false;
+        return;
+    }
+    scanNumber += 1;
+    if (options.scanCallback && options.previewInterval != 0 && scanNumber % options.previewInterval == 0) {
+        options.scanCallback(image, scanNumber);
+    }
+}
+
+// whether more time than the time limit has passed since the coefficients
+//   of the image were allocated
+bool overTimeLimit(const JPGImage* const image, const DecoderOptions& options) {
+    return options.timeLimit != 0 &&
+        std::chrono::steady_clock::now() - image->decodeStart > std::chrono::duration<double>(options.timeLimit);
+}
+
+// read the markers that follow a scan up to the SOS of the next one,
+//   returning false instead at the EOI, on errors, or once enough scans
+//   have been read
+// numScans counts every scan so far, skipped or decoded, so that the
+//   limits also bound files of scans that are all skipped
+bool readMarkersBetweenScans(
+    BitReader& bitReader,
+    JPGImage* const image,
+    const DecoderOptions& options,
+    const uint numScans
+) {
     byte last = bitReader.readByte();
     byte current = bitReader.readByte();
 
-    // decode additional scans, if any
     while (image->valid) {
         if (!bitReader.hasBits()) {
-            std::cout << "Error - File ended prematurely\n";
+            console() << "Error - File ended prematurely\n";
             image->valid = false;
-            return;
+            return false;
         }
         if (last != 0xFF) {
-            std::cout << "Error - Expected a marker\n";
+            console() << "Error - Expected a marker\n";
             image->valid = false;
-            return;
+            return false;
         }
 
         // end of image
         if (current == EOI) {
-            break;
+            return false;
         }
         // huffman tables (progressive only)
         else if (current == DHT && image->frameType == SOF2) {
@@ -712,12 +1309,24 @@ void readScans(BitReader& bitReader, JPGImage* const image) {
         }
         // additional scans (progressive only)
         else if (current == SOS && image->frameType == SOF2) {
-            readStartOfScan(bitReader, image);
-            if (!image->valid) {
-                return;
+            // once enough scans or bytes have been decoded, stop without
+            //   reading the remaining entropy-coded data at all
+            if ((options.maxScans != 0 && numScans >= options.maxScans) ||
+                (options.maxBytes != 0 && bitReader.position() > options.maxBytes)) {
+                console() << "Stopping after " << numScans << " scans\n";
+                return false;
+            }
+            if (options.scanLimit != 0 && numScans >= options.scanLimit) {
+                console() << "Error - More scans than the scan limit of " << options.scanLimit << '\n';
+                image->valid = false;
+                return false;
+            }
+            if (overTimeLimit(image, options)) {
+                console() << "Error - Decoding exceeded the time limit of " << options.timeLimit << " seconds\n";
+                image->valid = false;
+                return false;
             }
-            printScanInfo(image);
-            decodeHuffmanData(bitReader, image);
+            return true;
         }
         // new restart interval (progressive only)
         else if (current == DRI && image->frameType == SOF2) {
@@ -733,392 +1342,3140 @@ void readScans(BitReader& bitReader, JPGImage* const image) {
             continue;
         }
         else {
-            std::cout << "Error - Invalid marker: 0x" << std::hex << (uint)current << std::dec << '\n';
+            console() << "Error - Invalid marker: 0x" << std::hex << (uint)current << std::dec << '\n';
             image->valid = false;
-            return;
+            return false;
         }
         last = bitReader.readByte();
         current = bitReader.readByte();
     }
+    return false;
 }
 
-JPGImage* readJPG(const std::string& filename) {
-    // open file
-    std::cout << "Reading " << filename << "...\n";
-    BitReader bitReader(filename);
-    if (!bitReader.hasBits()) {
-        std::cout << "Error - Error opening input file\n";
-        return nullptr;
-    }
+void readScans(
+    BitReader& bitReader,
+    JPGImage* const image,
+    const DecoderOptions& options,
+    std::vector<ScanRecord>* const scans = nullptr
+) {
+    // decoded scans, which number the previews, and all scans read
+    uint scanNumber = 0;
+    uint numScans = 0;
+    do {
+        decodeScan(bitReader, image, options, scanNumber, scans);
+        numScans += 1;
+    } while (image->valid && readMarkersBetweenScans(bitReader, image, options, numScans));
+}
 
-    JPGImage* image = new (std::nothrow) JPGImage;
-    if (image == nullptr) {
-        std::cout << "Error - Memory error\n";
-        return nullptr;
+// two scans touch the same coefficients if they share a color component
+//   and their spectral bands overlap
+bool scansOverlap(const JPGImage& a, const JPGImage& b) {
+    if (a.endOfSelection < b.startOfSelection || b.endOfSelection < a.startOfSelection) {
+        return false;
     }
-
-    readFrameHeader(bitReader, image);
-
-    if (!image->valid) {
-        return image;
+    for (uint i = 0; i < a.numComponents; ++i) {
+        if (a.colorComponents[i].usedInScan && b.colorComponents[i].usedInScan) {
+            return true;
+        }
     }
+    return false;
+}
 
-    printFrameInfo(image);
-
-    image->blocks = new (std::nothrow) Block[image->blockHeightReal * image->blockWidthReal];
-    if (image->blocks == nullptr) {
-        std::cout << "Error - Memory error\n";
-        image->valid = false;
-        return image;
+// decode the located scans of a progressive image on worker threads
+// a scan depends on every earlier scan that touches the same coefficients,
+//   e.g. a refinement scan on the first scan of its band and component,
+//   and is decoded once all of those have finished
+// return false if the time limit ran out before all scans were decoded
+bool decodeScansInParallel(const std::vector<byte>& data, std::vector<ScanRecord>& scans, const DecoderOptions& options) {
+    const uint numThreads = options.numThreads;
+    const uint numScans = scans.size();
+    std::vector<std::vector<uint>> dependents(numScans);
+    std::vector<std::atomic<uint>> remaining(numScans);
+    std::vector<uint> independentScans;
+    for (uint j = 0; j < numScans; ++j) {
+        uint dependencies = 0;
+        for (uint i = 0; i < j; ++i) {
+            if (scansOverlap(scans[i].header, scans[j].header)) {
+                dependents[i].push_back(j);
+                dependencies += 1;
+            }
+        }
+        remaining[j].store(dependencies);
+        if (dependencies == 0) {
+            independentScans.push_back(j);
+        }
     }
+    console() << "Decoding " << numScans << " scans (" << independentScans.size() << " independent) on " << numThreads << " threads\n";
 
-    readScans(bitReader, image);
+    ThreadPool pool(numThreads);
+    std::atomic<bool> timedOut(false);
+    std::function<void(uint)> decode = [&](const uint j) {
+        // the remaining scans are still released, but no longer decoded
+        if (timedOut.load(std::memory_order_relaxed) || overTimeLimit(&scans[j].header, options)) {
+            timedOut.store(true, std::memory_order_relaxed);
+        }
+        else {
+            BitReader bitReader(data.data(), data.size(), scans[j].start);
+            decodeHuffmanData(bitReader, &scans[j].header);
+        }
+        for (const uint k : dependents[j]) {
+            if (remaining[k].fetch_sub(1) == 1) {
+                pool.run([&decode, k] { decode(k); });
+            }
+        }
+    };
+    for (const uint j : independentScans) {
+        pool.run([&decode, j] { decode(j); });
+    }
+    pool.wait();
+    if (timedOut.load()) {
+        console() << "Error - Decoding exceeded the time limit of " << options.timeLimit << " seconds\n";
+        return false;
+    }
+    return true;
+}
+
+// memory larger than a huge page is mapped aligned to one, so that the
+//   kernel can back all of it with transparent huge pages
+const std::size_t hugePageSize = 2 * 1024 * 1024;
+
+// map size bytes of memory straight from the kernel, which zeroes each
+//   page on first touch instead of up front
+// return nullptr on failure
+void* mapPages(const std::size_t size) {
+    if (size < hugePageSize) {
+        void* pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return pages == MAP_FAILED ? nullptr : pages;
+    }
+
+    // over-allocate by one huge page and trim both ends to align the mapping
+    const std::size_t mappedSize = size + hugePageSize;
+    void* mapped = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        return nullptr;
+    }
+    const std::uintptr_t start = (std::uintptr_t)mapped;
+    const std::uintptr_t aligned = (start + hugePageSize - 1) & ~(std::uintptr_t)(hugePageSize - 1);
+    const std::size_t pageSize = sysconf(_SC_PAGESIZE);
+    const std::uintptr_t end = (aligned + size + pageSize - 1) & ~(std::uintptr_t)(pageSize - 1);
+    if (aligned > start) {
+        munmap(mapped, aligned - start);
+    }
+    if (start + mappedSize > end) {
+        munmap((void*)end, start + mappedSize - end);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise((void*)aligned, end - aligned, MADV_HUGEPAGE);
+#endif
+    return (void*)aligned;
+}
+
+void unmapPages(void* const pages, const std::size_t size) {
+    if (pages != nullptr) {
+        munmap(pages, size);
+    }
+}
+
+// map size bytes of zeroed memory backed by an unlinked temporary file in
+//   TMPDIR, or /tmp, so that the kernel can write its pages back to disk and
+//   drop them under memory pressure instead of keeping all of them resident
+// return nullptr on failure
+void* mapSpillFile(const std::size_t size) {
+    const char* const directory = std::getenv("TMPDIR");
+    std::string path = std::string(directory != nullptr && directory[0] != '\0' ? directory : "/tmp") + "/jed-XXXXXX";
+    const int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        return nullptr;
+    }
+    unlink(path.c_str());
+    // the file is sparse, so it reads as zeroes until pages are written back
+    void* pages = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return pages == MAP_FAILED ? nullptr : pages;
+}
+
+std::size_t coefficientsSize(const JPGImage* const image) {
+    return image->numBlockComponents() * 64 * sizeof(int);
+}
+
+// allocate zeroed coefficients for every block component of the image,
+//   page-aligned and therefore aligned to a cache line
+// coefficients larger than a nonzero memoryBudget spill to a temporary file
+// return nullptr on failure
+int* allocateCoefficients(const JPGImage* const image, const std::size_t memoryBudget) {
+    const std::size_t size = coefficientsSize(image);
+    if (memoryBudget != 0 && size > memoryBudget) {
+        console() << "Coefficients exceed the memory budget, spilling " << size << " bytes to disk\n";
+        return (int*)mapSpillFile(size);
+    }
+    return (int*)mapPages(size);
+}
+
+void freeCoefficients(const JPGImage* const image, int* const coefficients) {
+    unmapPages(coefficients, coefficientsSize(image));
+}
+
+// release the coefficients and nonzero bitmaps along with the image
+void freeImage(JPGImage* const image) {
+    freeCoefficients(image, image->coefficients);
+    unmapPages(image->nonzero, image->numBlockComponents() * sizeof(std::atomic<std::uint64_t>));
+    delete image;
+}
+
+// decode the located scan of a baseline image speculatively, falling back
+//   to the serial decoder if the chunks cannot be stitched together, and
+//   optionally compare the result with that of the serial decoder
+void decodeBaselineScan(const std::vector<byte>& data, ScanRecord& scan, const DecoderOptions& options) {
+    JPGImage* const image = &scan.header;
+    if (!decodeSpeculatively(data, scan, image, options.numThreads)) {
+        console() << "Speculative decoding failed, decoding serially\n";
+        BitReader bitReader(data.data(), data.size(), scan.start);
+        decodeHuffmanData(bitReader, image);
+        return;
+    }
+    if (!options.verifySpeculative) {
+        return;
+    }
+
+    const std::size_t numBlockComponents = image->numBlockComponents();
+    // the JED_SPECULATIVE_FAULT environment variable alters the DC value of
+    //   the given block component, so that tests can make sure a mismatch
+    //   is caught
+    const char* const fault = std::getenv("JED_SPECULATIVE_FAULT");
+    if (fault != nullptr && (std::size_t)std::atoll(fault) < numBlockComponents) {
+        image->coefficients[std::atoll(fault) * 64] += 1;
+    }
+
+    JPGImage serial = *image;
+    serial.coefficients = allocateCoefficients(image, options.memoryBudget);
+    if (serial.coefficients == nullptr) {
+        console() << "Error - Memory error\n";
+        return;
+    }
+    BitReader bitReader(data.data(), data.size(), scan.start);
+    decodeHuffmanData(bitReader, &serial);
+    for (std::size_t j = 0; j < numBlockComponents; ++j) {
+        if (!std::equal(serial.coefficients + j * 64, serial.coefficients + (j + 1) * 64, image->coefficients + j * 64)) {
+            console() << "Error - Speculative decoding differs from serial decoding at block component " << j << '\n';
+            // the serial result is the one to trust
+            std::copy(serial.coefficients, serial.coefficients + numBlockComponents * 64, image->coefficients);
+            freeCoefficients(image, serial.coefficients);
+            return;
+        }
+    }
+    console() << "Speculative decoding matches serial decoding\n";
+    freeCoefficients(image, serial.coefficients);
+}
+
+// every MCU holds the blocks of each stored component in decode order
+void layoutBlocks(JPGImage* const image) {
+    for (uint i = 0; i < image->storedComponents(); ++i) {
+        const ColorComponent& component = image->colorComponents[i];
+        image->componentOffsets[i] = image->blocksPerMCU;
+        image->blocksPerMCU += component.horizontalSamplingFactor * component.verticalSamplingFactor;
+    }
+}
+
+// lay out and allocate the coefficients of an image whose frame header has
+//   been read, returning false on errors
+bool prepareImage(JPGImage* const image, const DecoderOptions& options) {
+    // the frame header alone tells how large the image is, before anything
+    //   has been allocated
+    const std::uint64_t numPixels = (std::uint64_t)image->width * image->height;
+    if (options.pixelLimit != 0 && numPixels > options.pixelLimit) {
+        console() << "Error - Image of " << numPixels << " pixels exceeds the pixel limit of " << options.pixelLimit << '\n';
+        image->valid = false;
+        return false;
+    }
+    image->lumaOnly = options.lumaOnly;
+    layoutBlocks(image);
+    const std::size_t memorySize = coefficientsSize(image) +
+        (image->frameType == SOF2 ? image->numBlockComponents() * sizeof(std::atomic<std::uint64_t>) : 0);
+    if (options.memoryLimit != 0 && memorySize > options.memoryLimit) {
+        console() << "Error - Coefficients of " << memorySize << " bytes exceed the memory limit of " << options.memoryLimit << " bytes\n";
+        image->valid = false;
+        return false;
+    }
+
+    image->decodeStart = std::chrono::steady_clock::now();
+    image->coefficients = allocateCoefficients(image, options.memoryBudget);
+    if (image->coefficients == nullptr) {
+        console() << "Error - Memory error\n";
+        image->valid = false;
+        return false;
+    }
+    if (image->frameType == SOF2) {
+        // zeroed pages hold atomics with a value of 0
+        image->nonzero = (std::atomic<std::uint64_t>*)mapPages(image->numBlockComponents() * sizeof(std::atomic<std::uint64_t>));
+        if (image->nonzero == nullptr) {
+            console() << "Error - Memory error\n";
+            image->valid = false;
+            return false;
+        }
+    }
+    return true;
+}
+
+// check that a JPG is intact by parsing its markers and decoding all of its
+//   Huffman data without storing any coefficients
+// return the first error and the offset in the file where it was found,
+//   or an empty string if there is none
+std::string validateJPG(const std::string& filename, std::size_t& errorOffset) {
+    errorOffset = 0;
+    std::vector<byte> data;
+    if (!readFile(filename, data)) {
+        return "Error opening input file";
+    }
+    BitReader bitReader(data.data(), data.size());
+
+    CapturedOutput messages;
+    JPGImage* const image = new (std::nothrow) JPGImage;
+    if (image == nullptr) {
+        return "Memory error";
+    }
+    readFrameHeader(bitReader, image);
+    if (image->valid) {
+        layoutBlocks(image);
+        if (image->frameType == SOF2) {
+            image->nonzero = (std::atomic<std::uint64_t>*)mapPages(image->numBlockComponents() * sizeof(std::atomic<std::uint64_t>));
+            if (image->nonzero == nullptr) {
+                console() << "Error - Memory error\n";
+                image->valid = false;
+            }
+        }
+    }
+    if (image->valid) {
+        DecoderOptions options;
+        options.validate = true;
+        readScans(bitReader, image, options);
+    }
+
+    std::string error;
+    if (!image->valid) {
+        error = messages.firstError();
+        errorOffset = bitReader.position();
+    }
+    freeImage(image);
+    return error;
+}
+
+// decode a JPG that has been loaded into memory
+// if header is given, it holds the markers already parsed from the first
+//   headerSize bytes of data, up to the first SOS, which are skipped
+JPGImage* decodeJPG(
+    const std::vector<byte>& data,
+    const DecoderOptions& options,
+    const JPGImage* const header = nullptr,
+    const std::size_t headerSize = 0
+) {
+    BitReader bitReader(data.data(), data.size(), headerSize);
+
+    JPGImage* image = new (std::nothrow) JPGImage;
+    if (image == nullptr) {
+        console() << "Error - Memory error\n";
+        return nullptr;
+    }
+
+    if (header != nullptr) {
+        *image = *header;
+    }
+    else {
+        readFrameHeader(bitReader, image);
+    }
+
+    if (!image->valid) {
+        return image;
+    }
+    printFrameInfo(image);
+    if (!prepareImage(image, options)) {
+        return image;
+    }
+
+    if (image->frameType == SOF2 && options.numThreads > 1 && !options.scanCallback) {
+        // locate every scan up front, then decode independent scans concurrently
+        std::vector<ScanRecord> scans;
+        readScans(bitReader, image, options, &scans);
+        if (image->valid && !decodeScansInParallel(data, scans, options)) {
+            image->valid = false;
+        }
+    }
+    else if ((image->frameType == SOF0 || image->frameType == SOF1) && image->restartInterval == 0 && options.speculative && options.numThreads > 1 && !options.scanCallback) {
+        std::vector<ScanRecord> scans;
+        readScans(bitReader, image, options, &scans);
+        if (image->valid && !scans.empty()) {
+            decodeBaselineScan(data, scans[0], options);
+        }
+    }
+    else {
+        readScans(bitReader, image, options);
+    }
+
+    return image;
+}
+
+const std::uint32_t sha256RoundConstants[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+// apply the SHA-256 compression function to one 64-byte block
+void sha256Block(std::uint32_t* const state, const byte* const block) {
+    auto rotate = [](const std::uint32_t x, const uint n) { return (x >> n) | (x << (32 - n)); };
+    std::uint32_t w[64];
+    for (uint i = 0; i < 16; ++i) {
+        w[i] = (std::uint32_t)block[4 * i] << 24 | (std::uint32_t)block[4 * i + 1] << 16 |
+            (std::uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (uint i = 16; i < 64; ++i) {
+        const std::uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        const std::uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (uint i = 0; i < 64; ++i) {
+        const std::uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) +
+            ((e & f) ^ (~e & g)) + sha256RoundConstants[i] + w[i];
+        const std::uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+// identifies a file in the coefficient cache: the SHA-256 digest of its
+//   contents followed by its size as 8 little-endian bytes
+typedef std::array<byte, 40> CacheKey;
+
+CacheKey cacheKey(const std::vector<byte>& data) {
+    std::uint32_t state[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+    const std::size_t size = data.size();
+    std::size_t pos = 0;
+    for (; pos + 64 <= size; pos += 64) {
+        sha256Block(state, data.data() + pos);
+    }
+    // the remaining bytes, a 1 bit, zeros, and the length in bits, big-endian
+    byte tail[128] = {};
+    std::copy(data.begin() + pos, data.end(), tail);
+    tail[size - pos] = 0x80;
+    const std::size_t tailSize = size - pos < 56 ? 64 : 128;
+    const std::uint64_t numBits = (std::uint64_t)size * 8;
+    for (uint i = 0; i < 8; ++i) {
+        tail[tailSize - 1 - i] = (numBits >> (8 * i)) & 0xFF;
+    }
+    for (std::size_t i = 0; i < tailSize; i += 64) {
+        sha256Block(state, tail + i);
+    }
+
+    CacheKey key;
+    for (uint i = 0; i < 32; ++i) {
+        key[i] = (state[i / 4] >> (24 - 8 * (i % 4))) & 0xFF;
+    }
+    for (uint i = 0; i < 8; ++i) {
+        key[32 + i] = ((std::uint64_t)size >> (8 * i)) & 0xFF;
+    }
+    return key;
+}
+
+struct CacheKeyHash {
+    // the digest is already uniformly distributed
+    std::size_t operator()(const CacheKey& key) const {
+        std::size_t hash = 0;
+        for (uint i = 0; i < sizeof(hash); ++i) {
+            hash = (hash << 8) | key[i];
+        }
+        return hash;
+    }
+};
+
+// serialize the quantized coefficients of a fully decoded image, along with
+//   the frame header fields and quantization tables needed to render them
+// the magic "JEDC", a version byte and the key of the file are followed by
+//   little-endian fields, and each block component is stored in zig-zag
+//   order up to its last nonzero coefficient, as a count byte followed by
+//   16-bit values
+// return an empty vector if a coefficient does not fit in 16 bits, as in
+//   corrupt files whose DC differences add up past the range of a baseline
+//   coefficient, so that such files are never cached
+std::vector<byte> packCoefficients(const JPGImage* const image, const CacheKey& key) {
+    std::vector<byte> packed = { 'J', 'E', 'D', 'C', 2 };
+    packed.insert(packed.end(), key.begin(), key.end());
+    auto put = [&](const uint value, const uint numBytes) {
+        for (uint i = 0; i < numBytes; ++i) {
+            packed.push_back((value >> (8 * i)) & 0xFF);
+        }
+    };
+    put(image->width, 4);
+    put(image->height, 4);
+    put(image->blockWidth, 4);
+    put(image->blockHeight, 4);
+    put(image->blockWidthReal, 4);
+    put(image->blockHeightReal, 4);
+    put(image->horizontalSamplingFactor, 1);
+    put(image->verticalSamplingFactor, 1);
+    put(image->frameType, 1);
+    put(image->numComponents, 1);
+    for (uint i = 0; i < image->numComponents; ++i) {
+        const ColorComponent& component = image->colorComponents[i];
+        put(component.horizontalSamplingFactor, 1);
+        put(component.verticalSamplingFactor, 1);
+        put(component.quantizationTableID, 1);
+    }
+    for (const QuantizationTable& qTable : image->quantizationTables) {
+        put(qTable.set, 1);
+        for (uint i = 0; i < 64; ++i) {
+            put(qTable.table[i], 2);
+        }
+    }
+
+    const std::size_t numBlockComponents = image->numBlockComponents();
+    for (std::size_t j = 0; j < numBlockComponents; ++j) {
+        const int* const component = image->coefficients + j * 64;
+        uint count = 64;
+        while (count > 0 && component[zigZagMap[count - 1]] == 0) {
+            count -= 1;
+        }
+        put(count, 1);
+        for (uint i = 0; i < count; ++i) {
+            const int coefficient = component[zigZagMap[i]];
+            if (coefficient < -32768 || coefficient > 32767) {
+                return std::vector<byte>();
+            }
+            put((std::uint16_t)coefficient, 2);
+        }
+    }
+    return packed;
+}
+
+// rebuild an image from packed coefficients as if it had just been decoded
+//   with options, dropping the chroma when decoding to grayscale
+// return nullptr if the data is not packed coefficients
+JPGImage* unpackCoefficients(const std::vector<byte>& packed, const DecoderOptions& options) {
+    std::size_t pos = 5 + std::tuple_size<CacheKey>::value;
+    bool truncated = false;
+    auto get = [&](const uint numBytes) {
+        uint value = 0;
+        if (pos + numBytes > packed.size()) {
+            truncated = true;
+            return value;
+        }
+        for (uint i = 0; i < numBytes; ++i) {
+            value |= (uint)packed[pos++] << (8 * i);
+        }
+        return value;
+    };
+    if (packed.size() < pos || !std::equal(packed.begin(), packed.begin() + 5, "JEDC\2")) {
+        return nullptr;
+    }
+
+    JPGImage* const image = new (std::nothrow) JPGImage;
+    if (image == nullptr) {
+        return nullptr;
+    }
+    image->width = get(4);
+    image->height = get(4);
+    image->blockWidth = get(4);
+    image->blockHeight = get(4);
+    image->blockWidthReal = get(4);
+    image->blockHeightReal = get(4);
+    image->horizontalSamplingFactor = get(1);
+    image->verticalSamplingFactor = get(1);
+    image->frameType = get(1);
+    image->numComponents = get(1);
+    if (image->numComponents != 1 && image->numComponents != 3) {
+        truncated = true;
+    }
+    for (uint i = 0; i < image->numComponents; ++i) {
+        ColorComponent& component = image->colorComponents[i];
+        component.horizontalSamplingFactor = get(1);
+        component.verticalSamplingFactor = get(1);
+        component.quantizationTableID = get(1) & 3;
+        component.usedInFrame = true;
+    }
+    for (QuantizationTable& qTable : image->quantizationTables) {
+        qTable.set = get(1);
+        for (uint i = 0; i < 64; ++i) {
+            qTable.table[i] = get(2);
+        }
+    }
+    if (truncated || image->horizontalSamplingFactor == 0 || image->verticalSamplingFactor == 0) {
+        delete image;
+        return nullptr;
+    }
+
+    // block components are packed with all color components, of which the
+    //   chroma ones come last in each MCU
+    std::size_t packedBlocksPerMCU = 0;
+    for (uint i = 0; i < image->numComponents; ++i) {
+        const ColorComponent& component = image->colorComponents[i];
+        packedBlocksPerMCU += component.horizontalSamplingFactor * component.verticalSamplingFactor;
+    }
+    if (!prepareImage(image, options)) {
+        freeImage(image);
+        return nullptr;
+    }
+    const std::size_t numMCUs = image->numBlockComponents() / image->blocksPerMCU;
+    int* component = image->coefficients;
+    for (std::size_t mcu = 0; mcu < numMCUs && !truncated; ++mcu) {
+        for (std::size_t j = 0; j < packedBlocksPerMCU; ++j) {
+            const uint count = get(1);
+            if (count > 64) {
+                truncated = true;
+                break;
+            }
+            if (j >= image->blocksPerMCU) {
+                pos += count * 2;
+                continue;
+            }
+            for (uint i = 0; i < count; ++i) {
+                component[zigZagMap[i]] = (std::int16_t)get(2);
+            }
+            component += 64;
+        }
+    }
+    if (truncated || pos > packed.size()) {
+        freeImage(image);
+        return nullptr;
+    }
+    return image;
+}
+
+// entropy-decoded coefficients of recently decoded files, packed and keyed
+//   by the SHA-256 digest and size of each file, so that rendering a file
+//   again skips parsing and Huffman decoding
+// entries are kept in memory up to a capacity in bytes, evicting the least
+//   recently used ones, and, if a directory is given, written to it as
+//   <digest>.jedc files in which later runs find them
+// every entry holds the key it was packed for, which a hit must match
+class CoefficientCache {
+private:
+    struct Entry {
+        CacheKey key;
+        std::vector<byte> packed;
+    };
+
+    const std::string directory;
+    const std::size_t capacity;
+    // most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<CacheKey, std::list<Entry>::iterator, CacheKeyHash> index;
+    std::size_t size = 0;
+
+    std::string path(const CacheKey& key) const {
+        std::ostringstream name;
+        name << directory << '/' << std::hex << std::setfill('0');
+        for (uint i = 0; i < 32; ++i) {
+            name << std::setw(2) << (uint)key[i];
+        }
+        name << ".jedc";
+        return name.str();
+    }
+
+    static bool matches(const std::vector<byte>& packed, const CacheKey& key) {
+        return packed.size() >= 5 + key.size() && std::equal(key.begin(), key.end(), packed.begin() + 5);
+    }
+
+    void remember(const CacheKey& key, const std::vector<byte>& packed) {
+        if (packed.size() > capacity || index.count(key) != 0) {
+            return;
+        }
+        entries.push_front({ key, packed });
+        index[key] = entries.begin();
+        size += packed.size();
+        while (size > capacity) {
+            size -= entries.back().packed.size();
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+    }
+
+public:
+    CoefficientCache(const std::string& d, const std::size_t c) :
+    directory(d),
+    capacity(c)
+    {}
+
+    // copy the packed coefficients of the file with the given key into
+    //   packed, returning false if they are not cached
+    bool find(const CacheKey& key, std::vector<byte>& packed) {
+        const auto entry = index.find(key);
+        if (entry != index.end() && matches(entry->second->packed, key)) {
+            entries.splice(entries.begin(), entries, entry->second);
+            packed = entry->second->packed;
+            return true;
+        }
+        // a file of another size, or written for another file, is not used
+        if (directory.empty() || !readFile(path(key), packed) || !matches(packed, key)) {
+            return false;
+        }
+        remember(key, packed);
+        return true;
+    }
+
+    void insert(const CacheKey& key, const std::vector<byte>& packed) {
+        if (!directory.empty()) {
+            // other processes never see a partially written file
+            const std::string filename = path(key);
+            std::ofstream outFile(filename + ".tmp", std::ios::out | std::ios::binary);
+            outFile.write((const char*)packed.data(), packed.size());
+            outFile.close();
+            if (!outFile || std::rename((filename + ".tmp").c_str(), filename.c_str()) != 0) {
+                console() << "Warning - Could not write " << filename << '\n';
+            }
+        }
+        remember(key, packed);
+    }
+};
+
+JPGImage* readJPG(const std::string& filename, const DecoderOptions& options) {
+    // open file
+    console() << "Reading " << filename << "...\n";
+    std::vector<byte> data;
+    if (!readFile(filename, data, options.inputLimit != 0 ? options.inputLimit + 1 : -1)) {
+        console() << "Error - Error opening input file\n";
+        return nullptr;
+    }
+    if (options.inputLimit != 0 && data.size() > options.inputLimit) {
+        console() << "Error - File larger than the input limit of " << options.inputLimit << " bytes\n";
+        return nullptr;
+    }
+
+    // renders of only some of the scans cannot start from cached
+    //   coefficients, except for those that need only the DC image
+    CoefficientCache* const cache = options.coefficientCache;
+    const bool cached = cache != nullptr &&
+        options.maxScans == 0 && options.maxBytes == 0 && options.previewInterval == 0 &&
+        (options.maxSpectralBand == 63 || options.dcOnly);
+    CacheKey key = {};
+    if (cached) {
+        key = cacheKey(data);
+        std::vector<byte> packed;
+        if (cache->find(key, packed)) {
+            JPGImage* const image = unpackCoefficients(packed, options);
+            if (image != nullptr) {
+                console() << "Using cached coefficients\n";
+                return image;
+            }
+        }
+    }
+
+    JPGImage* const image = decodeJPG(data, options);
+    // only complete coefficients are cached, from which any render can start
+    if (cached && image != nullptr && image->valid && image->coefficients != nullptr &&
+        !image->lumaOnly && options.maxSpectralBand == 63) {
+        const std::vector<byte> packed = packCoefficients(image, key);
+        if (!packed.empty()) {
+            cache->insert(key, packed);
+        }
+    }
+    return image;
+}
+
+// return the position just past the next SOS segment or EOI marker once
+//   all markers from pos up to there are within the first size bytes of
+//   data, or 0 if more data is needed to reach it
+// a byte that does not start a marker ends the search early, leaving the
+//   marker readers to report it
+std::size_t findMarkersEnd(const byte* const data, const std::size_t size, std::size_t pos) {
+    while (pos + 1 < size) {
+        const byte marker = data[pos + 1];
+        if (data[pos] != 0xFF || marker == EOI) {
+            return pos + 2;
+        }
+        if (marker == 0xFF) {
+            pos += 1;
+        }
+        else if (marker == SOI || marker == TEM || (marker >= RST0 && marker <= RST7)) {
+            pos += 2;
+        }
+        else {
+            if (pos + 3 >= size) {
+                return 0;
+            }
+            pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+            if (marker == SOS) {
+                return pos <= size ? pos : 0;
+            }
+        }
+    }
+    return 0;
+}
+
+// decode a JPG that is pushed in chunks of any size as they arrive, e.g.
+//   from a socket or pipe, instead of being loaded into memory first
+// markers are read once they have arrived in full, the MCU rows of baseline
+//   scans are decoded as soon as their data is there, and progressive scans
+//   once they are complete; decoding stops at the end of each chunk and
+//   later resumes from the last complete row or scan
+// options.rowCallback is called with each band of block rows whose
+//   coefficients are final, which for baseline images is every MCU row as
+//   it is decoded, and for progressive images the whole image at the end
+class IncrementalDecoder {
+private:
+    enum State {
+        READING_HEADER,
+        DECODING_SCAN,
+        SKIPPING_SCAN,
+        READING_MARKERS,
+        FINISHED
+    };
+
+    const DecoderOptions& options;
+    std::vector<byte> data;
+    JPGImage* image = nullptr;
+    State state = READING_HEADER;
+    // start of the markers or of the entropy-coded data being waited on
+    std::size_t pos = 0;
+    // how far the data of a scan has been searched for its end
+    std::size_t searched = 0;
+    // the reader and decoder state at the start of the next MCU row
+    BitReader scanReader;
+    ScanProgress progress;
+    uint scanNumber = 0;
+    // every scan whose SOS has been read, whether decoded or skipped
+    uint numScans = 0;
+    uint finalRows = 0;
+
+    // pass the block rows whose coefficients will not change any more
+    //   to the callback
+    void finalizeRows(const uint endRow) {
+        if (options.rowCallback && endRow > finalRows) {
+            options.rowCallback(image, finalRows, endRow);
+        }
+        finalRows = endRow;
+    }
+
+    // read the SOS header at the reader and prepare to decode or skip its data
+    void beginScan(BitReader& bitReader) {
+        numScans += 1;
+        if (startScan(bitReader, image, options)) {
+            state = DECODING_SCAN;
+            scanReader = bitReader;
+            progress = ScanProgress();
+        }
+        else {
+            state = image->valid ? SKIPPING_SCAN : FINISHED;
+        }
+        pos = bitReader.position();
+        searched = pos;
+    }
+
+    // find the marker that ends the data of the current scan, returning
+    //   false if it has not arrived yet
+    bool findScanEnd() {
+        BitReader bitReader(data.data(), data.size(), searched);
+        bitReader.skipToMarker();
+        // the last byte may be the 0xFF of a marker split across chunks
+        if (!bitReader.hasBits() || bitReader.position() + 1 >= data.size()) {
+            searched = data.size() - 1 > pos ? data.size() - 1 : pos;
+            return false;
+        }
+        searched = bitReader.position();
+        return true;
+    }
+
+    // the scan is complete; continue with the markers that follow it
+    void endScan(const std::size_t end) {
+        scanNumber += 1;
+        if (options.scanCallback && options.previewInterval != 0 && scanNumber % options.previewInterval == 0) {
+            options.scanCallback(image, scanNumber);
+        }
+        pos = end;
+        state = READING_MARKERS;
+    }
+
+    // decode as many MCU rows of a baseline scan as the data allows
+    // a row whose data is incomplete is decoded again from its start once
+    //   more data has arrived, which overwrites the same coefficients
+    void decodeRows() {
+        const uint yStep = image->componentsInScan == 1 ? 1 : image->verticalSamplingFactor;
+        while (progress.row < image->blockHeight) {
+            BitReader bitReader = scanReader;
+            bitReader.extend(data.data(), data.size());
+            ScanProgress next = progress;
+            std::string messages;
+            bool decoded;
+            {
+                CapturedOutput captured;
+                decoded = decodeHuffmanData(bitReader, image, false, &next, progress.row + yStep);
+                messages = captured.text();
+            }
+            if (!bitReader.hasBits()) {
+                return;
+            }
+            console() << messages;
+            if (!decoded) {
+                // like readScans, expect the next marker where decoding failed
+                pos = bitReader.position();
+                state = READING_MARKERS;
+                return;
+            }
+            scanReader = bitReader;
+            progress = next;
+            finalizeRows(progress.row < image->blockHeight ? progress.row : image->blockHeight);
+        }
+        endScan(scanReader.position());
+    }
+
+    // decode as far as the data received so far allows
+    void advance() {
+        while (state != FINISHED) {
+            if (state == READING_HEADER) {
+                const std::size_t end = findMarkersEnd(data.data(), data.size(), 0);
+                if (end == 0) {
+                    return;
+                }
+                image = new (std::nothrow) JPGImage;
+                if (image == nullptr) {
+                    console() << "Error - Memory error\n";
+                    state = FINISHED;
+                    return;
+                }
+                BitReader bitReader(data.data(), end);
+                readFrameHeader(bitReader, image);
+                if (image->valid) {
+                    printFrameInfo(image);
+                }
+                if (!image->valid || !prepareImage(image, options)) {
+                    state = FINISHED;
+                    return;
+                }
+                bitReader.extend(data.data(), data.size());
+                beginScan(bitReader);
+            }
+            else if (state == DECODING_SCAN && (image->frameType == SOF0 || image->frameType == SOF1)) {
+                decodeRows();
+                if (state == DECODING_SCAN) {
+                    return;
+                }
+            }
+            else if (state == DECODING_SCAN) {
+                // refinement scans add to the coefficients, so progressive
+                //   scans are only decoded once all of their data is there
+                if (!findScanEnd()) {
+                    return;
+                }
+                scanReader.extend(data.data(), data.size());
+                decodeHuffmanData(scanReader, image);
+                endScan(scanReader.position());
+            }
+            else if (state == SKIPPING_SCAN) {
+                if (!findScanEnd()) {
+                    return;
+                }
+                pos = searched;
+                state = READING_MARKERS;
+            }
+            else if (state == READING_MARKERS) {
+                const std::size_t end = findMarkersEnd(data.data(), data.size(), pos);
+                if (end == 0) {
+                    return;
+                }
+                BitReader bitReader(data.data(), end, pos);
+                if (readMarkersBetweenScans(bitReader, image, options, numScans)) {
+                    bitReader.extend(data.data(), data.size());
+                    beginScan(bitReader);
+                }
+                else {
+                    if (image->valid) {
+                        finalizeRows(image->blockHeight);
+                    }
+                    state = FINISHED;
+                }
+            }
+        }
+    }
+
+public:
+    IncrementalDecoder(const DecoderOptions& o) :
+    options(o),
+    scanReader(nullptr, 0)
+    {}
+
+    ~IncrementalDecoder() {
+        if (image != nullptr) {
+            freeImage(image);
+        }
+    }
+
+    // append the next chunk of the JPG and decode as far as it allows
+    // return false once there is nothing more to decode, at the EOI or
+    //   because the JPG is invalid
+    bool feed(const byte* const bytes, const std::size_t size) {
+        data.insert(data.end(), bytes, bytes + size);
+        advance();
+        return state != FINISHED;
+    }
+
+    // the whole JPG has been fed; return the decoded image, which the
+    //   caller frees, or nullptr on memory errors
+    JPGImage* finish() {
+        if (state != FINISHED) {
+            console() << "Error - File ended prematurely\n";
+            if (image == nullptr) {
+                image = new (std::nothrow) JPGImage;
+            }
+            if (image != nullptr) {
+                image->valid = false;
+            }
+            state = FINISHED;
+        }
+        JPGImage* const decoded = image;
+        image = nullptr;
+        return decoded;
+    }
+};
+
+// decode a JPG through the incremental decoder while reading it in chunks,
+//   so that decoding overlaps with the data arriving, e.g. from a pipe
+// a filename of "-" reads standard input
+JPGImage* streamJPG(const std::string& filename, const DecoderOptions& options) {
+    console() << "Streaming " << filename << "...\n";
+    std::ifstream inFile(filename == "-" ? "/dev/stdin" : filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open()) {
+        console() << "Error - Error opening input file\n";
+        return nullptr;
+    }
+    IncrementalDecoder decoder(options);
+    char chunk[65536];
+    std::size_t size = 0;
+    while (inFile.read(chunk, sizeof(chunk)) || inFile.gcount() > 0) {
+        size += inFile.gcount();
+        if (options.inputLimit != 0 && size > options.inputLimit) {
+            console() << "Error - File larger than the input limit of " << options.inputLimit << " bytes\n";
+            return nullptr;
+        }
+        if (!decoder.feed((const byte*)chunk, inFile.gcount())) {
+            break;
+        }
+    }
+    return decoder.finish();
+}
+
+// return the symbol from the Huffman table that corresponds to
+//   the next Huffman code read from the BitReader
+byte getNextSymbol(BitReader& bitReader, const HuffmanTable& hTable) {
+    uint currentCode = 0;
+    for (uint i = 0; i < 16; ++i) {
+        int bit = bitReader.readBit();
+        if (bit == -1) {
+            return -1;
+        }
+        currentCode = (currentCode << 1) | bit;
+        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
+            if (currentCode == hTable.codes[j]) {
+                return hTable.symbols[j];
+            }
+        }
+    }
+    return -1;
+}
+
+// bitmap selecting zig-zag indices start through end
+std::uint64_t bandMask(const uint start, const uint end) {
+    const std::uint64_t upToEnd = end >= 63 ? ~0ull : (1ull << (end + 1)) - 1;
+    return upToEnd & ~((1ull << start) - 1);
+}
+
+// read the correction bits of an AC refinement scan for every nonzero
+//   coefficient of a block component selected by bits (zig-zag order)
+// the bits are read in batches instead of one coefficient at a time
+bool refineNonzeroCoefficients(
+    BitReader& bitReader,
+    int* const component,
+    std::uint64_t bits,
+    const int positive,
+    const int negative
+) {
+    while (bits != 0) {
+        const uint available = __builtin_popcountll(bits);
+        const uint count = available < 16 ? available : 16;
+        const uint corrections = bitReader.readBits(count);
+        if (corrections == (uint)-1) {
+            console() << "Error - Invalid AC value\n";
+            return false;
+        }
+        for (uint j = count; j > 0; --j) {
+            int& coeff = component[zigZagMap[__builtin_ctzll(bits)]];
+            bits &= bits - 1;
+            if (((corrections >> (j - 1)) & 1) && (coeff & positive) == 0) {
+                coeff += (coeff >= 0) ? positive : negative;
+            }
+        }
+    }
+    return true;
+}
+
+// decode the coefficients of one baseline block component, returning
+//   a description of the first error or nullptr on success
+// nothing is printed so that speculative decoding may fail quietly
+const char* decodeBaselineBlockComponent(
+    BitReader& bitReader,
+    int* const component,
+    int& previousDC,
+    const HuffmanTable& dcTable,
+    const HuffmanTable& acTable
+) {
+    // get the DC value for this block component
+    byte length = getNextSymbol(bitReader, dcTable);
+    if (length == (byte)-1) {
+        return "Invalid DC value";
+    }
+    if (length > 11) {
+        return "DC coefficient length greater than 11";
+    }
+
+    int coeff = bitReader.readBits(length);
+    if (coeff == -1) {
+        return "Invalid DC value";
+    }
+    if (length != 0 && coeff < (1 << (length - 1))) {
+        coeff -= (1 << length) - 1;
+    }
+    component[0] = coeff + previousDC;
+    previousDC = component[0];
+
+    // get the AC values for this block component
+    for (uint i = 1; i < 64; ++i) {
+        byte symbol = getNextSymbol(bitReader, acTable);
+        if (symbol == (byte)-1) {
+            return "Invalid AC value";
+        }
+
+        // symbol 0x00 means fill remainder of component with 0
+        if (symbol == 0x00) {
+            return nullptr;
+        }
+
+        // otherwise, read next component coefficient
+        byte numZeroes = symbol >> 4;
+        byte coeffLength = symbol & 0x0F;
+        coeff = 0;
+
+        if (i + numZeroes >= 64) {
+            return "Zero run-length exceeded block component";
+        }
+        i += numZeroes;
+
+        if (coeffLength > 10) {
+            return "AC coefficient length greater than 10";
+        }
+        coeff = bitReader.readBits(coeffLength);
+        if (coeff == -1) {
+            return "Invalid AC value";
+        }
+        if (coeff < (1 << (coeffLength - 1))) {
+            coeff -= (1 << coeffLength) - 1;
+        }
+        component[zigZagMap[i]] = coeff;
+    }
+    return nullptr;
+}
+
+// fill the coefficients of a block component based on Huffman codes
+//   read from the BitReader
+bool decodeBlockComponent(
+    const JPGImage* const image,
+    BitReader& bitReader,
+    int* const component,
+    std::atomic<std::uint64_t>* const nonzero,
+    int& previousDC,
+    uint& skips,
+    const HuffmanTable& dcTable,
+    const HuffmanTable& acTable
+) {
+    if (image->frameType == SOF0 || image->frameType == SOF1) {
+        const char* const error = decodeBaselineBlockComponent(bitReader, component, previousDC, dcTable, acTable);
+        if (error != nullptr) {
+            console() << "Error - " << error << '\n';
+            return false;
+        }
+        return true;
+    }
+    else { // image->frameType == SOF2
+        if (image->startOfSelection == 0 && image->successiveApproximationHigh == 0) {
+            // DC first visit
+            byte length = getNextSymbol(bitReader, dcTable);
+            if (length == (byte)-1) {
+                console() << "Error - Invalid DC value\n";
+                return false;
+            }
+            if (length > 11) {
+                console() << "Error - DC coefficient length greater than 11\n";
+                return false;
+            }
+
+            int coeff = bitReader.readBits(length);
+            if (coeff == -1) {
+                console() << "Error - Invalid DC value\n";
+                return false;
+            }
+            if (length != 0 && coeff < (1 << (length - 1))) {
+                coeff -= (1 << length) - 1;
+            }
+            coeff += previousDC;
+            previousDC = coeff;
+            component[0] = coeff << image->successiveApproximationLow;
+            return true;
+        }
+        else if (image->startOfSelection == 0 && image->successiveApproximationHigh != 0) {
+            // DC refinement
+            int bit = bitReader.readBit();
+            if (bit == -1) {
+                console() << "Error - Invalid DC value\n";
+                return false;
+            }
+            component[0] |= bit << image->successiveApproximationLow;
+            return true;
+        }
+        else if (image->startOfSelection != 0 && image->successiveApproximationHigh == 0) {
+            // AC first visit
+            if (skips > 0) {
+                skips -= 1;
+                return true;
+            }
+            std::uint64_t setBits = 0;
+            std::uint64_t clearBits = 0;
+            for (uint i = image->startOfSelection; i <= image->endOfSelection; ++i) {
+                byte symbol = getNextSymbol(bitReader, acTable);
+                if (symbol == (byte)-1) {
+                    console() << "Error - Invalid AC value\n";
+                    return false;
+                }
+
+                byte numZeroes = symbol >> 4;
+                byte coeffLength = symbol & 0x0F;
+
+                if (coeffLength != 0) {
+                    if (i + numZeroes > image->endOfSelection) {
+                        console() << "Error - Zero run-length exceeded spectral selection\n";
+                        return false;
+                    }
+                    for (uint j = 0; j < numZeroes; ++j, ++i) {
+                        component[zigZagMap[i]] = 0;
+                        clearBits |= 1ull << i;
+                    }
+                    if (coeffLength > 10) {
+                        console() << "Error - AC coefficient length greater than 10\n";
+                        return false;
+                    }
+
+                    int coeff = bitReader.readBits(coeffLength);
+                    if (coeff == -1) {
+                        console() << "Error - Invalid AC value\n";
+                        return false;
+                    }
+                    if (coeff < (1 << (coeffLength - 1))) {
+                        coeff -= (1 << coeffLength) - 1;
+                    }
+                    component[zigZagMap[i]] = coeff << image->successiveApproximationLow;
+                    setBits |= 1ull << i;
+                }
+                else {
+                    if (numZeroes == 15) {
+                        if (i + numZeroes > image->endOfSelection) {
+                            console() << "Error - Zero run-length exceeded spectral selection\n";
+                            return false;
+                        }
+                        for (uint j = 0; j < numZeroes; ++j, ++i) {
+                            component[zigZagMap[i]] = 0;
+                            clearBits |= 1ull << i;
+                        }
+                        clearBits |= 1ull << i;
+                    }
+                    else {
+                        skips = (1 << numZeroes) - 1;
+                        uint extraSkips = bitReader.readBits(numZeroes);
+                        if (extraSkips == (uint)-1) {
+                            console() << "Error - Invalid AC value\n";
+                            return false;
+                        }
+                        skips += extraSkips;
+                        break;
+                    }
+                }
+            }
+            if (clearBits != 0) {
+                nonzero->fetch_and(~clearBits, std::memory_order_relaxed);
+            }
+            if (setBits != 0) {
+                nonzero->fetch_or(setBits, std::memory_order_relaxed);
+            }
+            return true;
+        }
+        else { // image->startOfSelection != 0 && image->successiveApproximationHigh != 0
+            // AC refinement
+            int positive = 1 << image->successiveApproximationLow;
+            int negative = ((unsigned)-1) << image->successiveApproximationLow;
+            std::uint64_t nonzeroBits = nonzero->load(std::memory_order_relaxed);
+            std::uint64_t setBits = 0;
+            int i = image->startOfSelection;
+            if (skips == 0) {
+                for (; i <= image->endOfSelection; ++i) {
+                    byte symbol = getNextSymbol(bitReader, acTable);
+                    if (symbol == (byte)-1) {
+                        console() << "Error - Invalid AC value\n";
+                        return false;
+                    }
+
+                    byte numZeroes = symbol >> 4;
+                    byte coeffLength = symbol & 0x0F;
+                    int coeff = 0;
+
+                    if (coeffLength != 0) {
+                        if (coeffLength != 1) {
+                            console() << "Error - Invalid AC value\n";
+                            return false;
+                        }
+                        switch (bitReader.readBit()) {
+                        case 1:
+                            coeff = positive;
+                            break;
+                        case 0:
+                            coeff = negative;
+                            break;
+                        default: // -1, data stream is empty
+                            console() << "Error - Invalid AC value\n";
+                            return false;
+                        }
+                    }
+                    else {
+                        if (numZeroes != 15) {
+                            skips = 1 << numZeroes;
+                            uint extraSkips = bitReader.readBits(numZeroes);
+                            if (extraSkips == (uint)-1) {
+                                console() << "Error - Invalid AC value\n";
+                                return false;
+                            }
+                            skips += extraSkips;
+                            break;
+                        }
+                    }
+
+                    do {
+                        if ((nonzeroBits >> i) & 1) {
+                            switch (bitReader.readBit()) {
+                            case 1:
+                                if ((component[zigZagMap[i]] & positive) == 0) {
+                                    if (component[zigZagMap[i]] >= 0) {
+                                        component[zigZagMap[i]] += positive;
+                                    }
+                                    else {
+                                        component[zigZagMap[i]] += negative;
+                                    }
+                                }
+                                break;
+                            case 0:
+                                // do nothing
+                                break;
+                            default: // -1, data stream is empty
+                                console() << "Error - Invalid AC value\n";
+                                return false;
+                            }
+                        }
+                        else {
+                            if (numZeroes == 0) {
+                                break;
+                            }
+                            numZeroes -= 1;
+                        }
+
+                        i += 1;
+                    } while (i <= image->endOfSelection);
+
+                    if (coeff != 0 && i <= image->endOfSelection) {
+                        component[zigZagMap[i]] = coeff;
+                        nonzeroBits |= 1ull << i;
+                        setBits |= 1ull << i;
+                    }
+                }
+            }
+
+            if (setBits != 0) {
+                nonzero->fetch_or(setBits, std::memory_order_relaxed);
+            }
+
+            if (skips > 0) {
+                // the rest of the band only refines coefficients that are already nonzero
+                if (i <= image->endOfSelection &&
+                    !refineNonzeroCoefficients(bitReader, component,
+                        nonzeroBits & bandMask(i, image->endOfSelection), positive, negative)) {
+                    return false;
+                }
+                skips -= 1;
+            }
+            return true;
+        }
+    }
+}
+
+// largest magnitudes of quantized coefficients of 8-bit samples
+const int maxDCMagnitude = 2047;
+const int maxACMagnitude = 1023;
+
+// return false if a freshly decoded block component holds a coefficient
+//   outside the range of 8-bit samples
+bool coefficientsInRange(const int* const component) {
+    if (component[0] < -maxDCMagnitude || component[0] > maxDCMagnitude) {
+        console() << "Error - DC coefficient out of range\n";
+        return false;
+    }
+    for (uint i = 1; i < 64; ++i) {
+        if (component[i] < -maxACMagnitude || component[i] > maxACMagnitude) {
+            console() << "Error - AC coefficient out of range\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// decode the Huffman data of the current scan into the MCUs, starting from
+//   progress if given and stopping before block row endRow, where progress
+//   is left
+// when validating, and for components that are not stored, blocks go to a
+//   scratch block instead; validating also checks the restart markers and
+//   coefficient ranges
+// return false on the first error
+bool decodeHuffmanData(
+    BitReader& bitReader,
+    JPGImage* const image,
+    const bool validate,
+    ScanProgress* const progress,
+    const uint endRow
+) {
+    int scratch[64];
+    // refinement scans only add bits below those already checked
+    const bool checkRanges = validate && image->successiveApproximationHigh == 0;
+    // the scratch block is zeroed for every block decoded into it, since
+    //   refinements read the coefficients they refine
+    auto blockComponentAt = [&](const std::size_t blockIndex, const uint i) {
+        if (validate || i >= image->storedComponents()) {
+            std::fill(scratch, scratch + 64, 0);
+            return scratch;
+        }
+        return image->coefficients + blockIndex * 64;
+    };
+
+    ScanProgress state;
+    if (progress != nullptr) {
+        state = *progress;
+    }
+    int previousDCs[3] = { state.previousDCs[0], state.previousDCs[1], state.previousDCs[2] };
+    uint skips = state.skips;
+
+    const bool luminanceOnly = image->componentsInScan == 1 && image->colorComponents[0].usedInScan;
+    const uint yStep = luminanceOnly ? 1 : image->verticalSamplingFactor;
+    const uint xStep = luminanceOnly ? 1 : image->horizontalSamplingFactor;
+    const uint restartInterval = image->restartInterval;
+
+    // progressive AC scans contain a single component, and their EOB runs
+    //   span whole blocks, which are consumed in bulk below
+    const bool progressiveAC = image->frameType == SOF2 && image->startOfSelection != 0;
+    uint scanComponent = 0;
+    while (scanComponent < image->numComponents && !image->colorComponents[scanComponent].usedInScan) {
+        scanComponent += 1;
+    }
+    const std::uint64_t band = bandMask(image->startOfSelection, image->endOfSelection);
+    const int positive = 1 << image->successiveApproximationLow;
+    const int negative = ((unsigned)-1) << image->successiveApproximationLow;
+
+    // each iteration decodes one MCU, or one block of a non-interleaved scan
+    uint mcu = state.mcu;
+    const uint rowEnd = endRow < image->blockHeight ? endRow : image->blockHeight;
+    uint y = state.row;
+    for (; y < rowEnd; y += yStep) {
+        for (uint x = 0; x < image->blockWidth; x += xStep, ++mcu) {
+            if (restartInterval != 0 && mcu % restartInterval == 0) {
+                previousDCs[0] = 0;
+                previousDCs[1] = 0;
+                previousDCs[2] = 0;
+                skips = 0;
+                if (validate && mcu != 0 && !bitReader.readRestartMarker(RST0 + (mcu / restartInterval - 1) % 8)) {
+                    console() << "Error - Missing or out of order restart marker\n";
+                    return false;
+                }
+                bitReader.align();
+            }
+
+            if (progressiveAC && skips > 0) {
+                // jump over the rest of the EOB run in this row and restart interval;
+                //   first scans leave the blocks untouched, refinement scans only
+                //   read correction bits for their nonzero coefficients
+                uint run = (image->blockWidth - x + xStep - 1) / xStep;
+                if (skips < run) {
+                    run = skips;
+                }
+                if (restartInterval != 0 && restartInterval - mcu % restartInterval < run) {
+                    run = restartInterval - mcu % restartInterval;
+                }
+                if (image->successiveApproximationHigh != 0) {
+                    for (uint k = 0; k < run; ++k) {
+                        const std::size_t blockIndex = image->blockIndex(y, x + k * xStep, scanComponent);
+                        if (!refineNonzeroCoefficients(
+                                bitReader,
+                                blockComponentAt(blockIndex, scanComponent),
+                                image->nonzero[blockIndex].load(std::memory_order_relaxed) & band,
+                                positive,
+                                negative)) {
+                            return false;
+                        }
+                    }
+                }
+                skips -= run;
+                x += (run - 1) * xStep;
+                mcu += run - 1;
+                continue;
+            }
+
+            for (uint i = 0; i < image->numComponents; ++i) {
+                const ColorComponent& component = image->colorComponents[i];
+                if (component.usedInScan) {
+                    const uint vMax = luminanceOnly ? 1 : component.verticalSamplingFactor;
+                    const uint hMax = luminanceOnly ? 1 : component.horizontalSamplingFactor;
+                    for (uint v = 0; v < vMax; ++v) {
+                        for (uint h = 0; h < hMax; ++h) {
+                            const std::size_t blockIndex = image->blockIndex(y + v, x + h, i);
+                            if (!decodeBlockComponent(
+                                    image,
+                                    bitReader,
+                                    blockComponentAt(blockIndex, i),
+                                    image->nonzero + blockIndex,
+                                    previousDCs[i],
+                                    skips,
+                                    image->huffmanDCTables[component.huffmanDCTableID],
+                                    image->huffmanACTables[component.huffmanACTableID])) {
+                                return false;
+                            }
+                            if (checkRanges && !coefficientsInRange(scratch)) {
+                                return false;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (progress != nullptr) {
+        progress->row = y;
+        progress->mcu = mcu;
+        std::copy(previousDCs, previousDCs + 3, progress->previousDCs);
+        progress->skips = skips;
+    }
+    return true;
+}
+
+// coefficients of consecutive MCUs of a baseline scan, along with the
+//   bit position and DC predictors at the start of each MCU
+struct MCURecords {
+    std::vector<std::size_t> positions;
+    std::vector<int> predictors;
+    std::vector<int> coefficients;
+};
+
+// part of the entropy-coded data of a baseline scan that is decoded
+//   speculatively, without knowing the bit position or the DC predictors
+//   at which an MCU starts within it
+struct SpeculativeChunk {
+    BitReader bitReader;
+    std::size_t end;
+    int previousDCs[3] = { 0 };
+    bool failed = false;
+
+    // MCUs decoded within the chunk
+    MCURecords records;
+    // MCUs decoded past the end of the chunk until the decoder reaches an
+    //   MCU start that a later chunk also decoded, at syncMCU of its records
+    MCURecords continuation;
+    bool synchronized = false;
+    std::size_t syncChunk = 0;
+    std::size_t syncMCU = 0;
+
+    // first valid MCU of the records, the MCU index of the image at which
+    //   it belongs and the correction of the DC predictors from there on
+    std::size_t firstMCU = 0;
+    uint imageMCU = 0;
+    int dcDeltas[3] = { 0 };
+
+    SpeculativeChunk(const byte* const data, const std::size_t size, const std::size_t start, const std::size_t e) :
+    bitReader(data, size, start),
+    end(e)
+    {}
+};
+
+// decode the next MCU of a baseline scan and append it to the records
+bool decodeSpeculativeMCU(
+    const JPGImage* const image,
+    BitReader& bitReader,
+    int* const previousDCs,
+    MCURecords& records,
+    const uint blocksPerMCU
+) {
+    const std::size_t size = records.coefficients.size();
+    records.positions.push_back(bitReader.bitPosition());
+    records.predictors.insert(records.predictors.end(), previousDCs, previousDCs + 3);
+    records.coefficients.resize(size + blocksPerMCU * 64, 0);
+
+    const bool luminanceOnly = image->numComponents == 1;
+    int* component = records.coefficients.data() + size;
+    for (uint i = 0; i < image->numComponents; ++i) {
+        const ColorComponent& c = image->colorComponents[i];
+        const uint numBlocks = luminanceOnly ? 1 : c.verticalSamplingFactor * c.horizontalSamplingFactor;
+        for (uint j = 0; j < numBlocks; ++j, component += 64) {
+            if (decodeBaselineBlockComponent(
+                    bitReader,
+                    component,
+                    previousDCs[i],
+                    image->huffmanDCTables[c.huffmanDCTableID],
+                    image->huffmanACTables[c.huffmanACTableID]) != nullptr) {
+                records.positions.pop_back();
+                records.predictors.resize(records.predictors.size() - 3);
+                records.coefficients.resize(size);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// decode the MCUs that start within a chunk; the first chunk starts at
+//   the first MCU of the scan, any other chunk is decoded from its first
+//   byte and, should it run into invalid codes, retried one bit later
+void decodeSpeculativeChunk(
+    const JPGImage* const image,
+    SpeculativeChunk& chunk,
+    const bool first,
+    const uint blocksPerMCU,
+    const uint numMCUs
+) {
+    const BitReader start = chunk.bitReader;
+    for (uint offset = 0; offset < (first ? 1 : 32); ++offset) {
+        chunk.bitReader = start;
+        chunk.bitReader.readBits(offset);
+        chunk.records = MCURecords();
+        chunk.previousDCs[0] = chunk.previousDCs[1] = chunk.previousDCs[2] = 0;
+        chunk.failed = false;
+        while (chunk.bitReader.position() < chunk.end && chunk.records.positions.size() < numMCUs) {
+            if (!decodeSpeculativeMCU(image, chunk.bitReader, chunk.previousDCs, chunk.records, blocksPerMCU)) {
+                chunk.failed = true;
+                break;
+            }
+        }
+        if (!chunk.failed) {
+            return;
+        }
+    }
+}
+
+// keep decoding past the end of a chunk until an MCU starts at a bit
+//   position from which a later chunk has decoded an MCU as well; from
+//   there on that chunk's MCUs are the same as the real ones, except for
+//   a constant offset of the DC values of each component
+// a chunk that never falls into step with the real MCUs, e.g. because it
+//   keeps decoding chroma blocks as luma blocks, is decoded by its
+//   predecessor instead, down to the end of the scan if need be
+void synchronizeSpeculativeChunk(
+    const JPGImage* const image,
+    const std::vector<SpeculativeChunk>& chunks,
+    SpeculativeChunk& chunk,
+    std::size_t next,
+    const std::size_t scanEnd,
+    const uint blocksPerMCU,
+    const uint numMCUs
+) {
+    while (!chunk.failed &&
+           chunk.bitReader.position() < scanEnd &&
+           chunk.records.positions.size() + chunk.continuation.positions.size() < numMCUs) {
+        if (next < chunks.size()) {
+            const std::vector<std::size_t>& targets = chunks[next].records.positions;
+            const std::size_t position = chunk.bitReader.bitPosition();
+            const auto match = std::lower_bound(targets.begin(), targets.end(), position);
+            if (match == targets.end()) {
+                next += 1;
+                continue;
+            }
+            if (*match == position) {
+                chunk.synchronized = true;
+                chunk.syncChunk = next;
+                chunk.syncMCU = match - targets.begin();
+                return;
+            }
+        }
+        if (!decodeSpeculativeMCU(image, chunk.bitReader, chunk.previousDCs, chunk.continuation, blocksPerMCU)) {
+            return;
+        }
+    }
+}
+
+// copy the valid MCUs of a chunk into the image, correcting their DC values
+void storeSpeculativeChunk(JPGImage* const image, const SpeculativeChunk& chunk, const uint blocksPerMCU, const uint numMCUs) {
+    const bool luminanceOnly = image->numComponents == 1;
+    const uint yStep = luminanceOnly ? 1 : image->verticalSamplingFactor;
+    const uint xStep = luminanceOnly ? 1 : image->horizontalSamplingFactor;
+    const uint mcusPerRow = (image->blockWidth + xStep - 1) / xStep;
+
+    uint mcu = chunk.imageMCU;
+    for (const MCURecords* records : { &chunk.records, &chunk.continuation }) {
+        const int* component = records->coefficients.data();
+        const std::size_t first = records == &chunk.records ? chunk.firstMCU : 0;
+        component += first * blocksPerMCU * 64;
+        for (std::size_t j = first; j < records->positions.size() && mcu < numMCUs; ++j, ++mcu) {
+            const uint y = mcu / mcusPerRow * yStep;
+            const uint x = mcu % mcusPerRow * xStep;
+            for (uint i = 0; i < image->numComponents; ++i) {
+                const ColorComponent& c = image->colorComponents[i];
+                const uint vMax = luminanceOnly ? 1 : c.verticalSamplingFactor;
+                const uint hMax = luminanceOnly ? 1 : c.horizontalSamplingFactor;
+                if (i >= image->storedComponents()) {
+                    component += vMax * hMax * 64;
+                    continue;
+                }
+                for (uint v = 0; v < vMax; ++v) {
+                    for (uint h = 0; h < hMax; ++h, component += 64) {
+                        int* const block = image->blockComponent(y + v, x + h, i);
+                        std::copy(component, component + 64, block);
+                        block[0] += chunk.dcDeltas[i];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// decode the single scan of a baseline image without restart markers by
+//   splitting its entropy-coded data into chunks that are decoded in
+//   parallel from guessed starting positions, then stitched together
+// return false if the chunks could not be stitched, leaving the image
+//   to be decoded serially
+bool decodeSpeculatively(const std::vector<byte>& data, const ScanRecord& scan, JPGImage* const image, const uint numThreads) {
+    if (image->componentsInScan != image->numComponents) {
+        return false;
+    }
+    const std::size_t minChunkSize = 4096;
+    std::size_t numChunks = (scan.end - scan.start) / minChunkSize;
+    if (numChunks > numThreads) {
+        numChunks = numThreads;
+    }
+    if (numChunks < 2) {
+        return false;
+    }
+
+    const bool luminanceOnly = image->numComponents == 1;
+    const uint yStep = luminanceOnly ? 1 : image->verticalSamplingFactor;
+    const uint xStep = luminanceOnly ? 1 : image->horizontalSamplingFactor;
+    const uint numMCUs = ((image->blockHeight + yStep - 1) / yStep) * ((image->blockWidth + xStep - 1) / xStep);
+    uint blocksPerMCU = 0;
+    for (uint i = 0; i < image->numComponents; ++i) {
+        const ColorComponent& c = image->colorComponents[i];
+        blocksPerMCU += luminanceOnly ? 1 : c.verticalSamplingFactor * c.horizontalSamplingFactor;
+    }
+
+    // never start a chunk on the zero of a stuffed 0xFF00
+    // the chunks read no further than the scan, so that guesses decoding
+    //   garbage run out of data quietly instead of reporting its marker
+    std::vector<SpeculativeChunk> chunks;
+    std::size_t start = scan.start;
+    for (std::size_t k = 0; k < numChunks; ++k) {
+        std::size_t end = k + 1 == numChunks ? scan.end : scan.start + (scan.end - scan.start) * (k + 1) / numChunks;
+        if (data[end - 1] == 0xFF) {
+            end += 1;
+        }
+        chunks.emplace_back(data.data(), scan.end, start, end);
+        start = end;
+    }
+    console() << "Decoding " << numChunks << " chunks speculatively\n";
+
+    ThreadPool pool(numThreads);
+    for (std::size_t k = 0; k < numChunks; ++k) {
+        pool.run([&, k] { decodeSpeculativeChunk(image, chunks[k], k == 0, blocksPerMCU, numMCUs); });
+    }
+    pool.wait();
+    for (std::size_t k = 0; k < numChunks; ++k) {
+        pool.run([&, k] { synchronizeSpeculativeChunk(image, chunks, chunks[k], k + 1, scan.end, blocksPerMCU, numMCUs); });
+    }
+    pool.wait();
+
+    // chain the chunks together from the first one, which started at
+    //   the real first MCU with the real DC predictors
+    std::vector<std::size_t> chain;
+    uint mcu = 0;
+    for (std::size_t k = 0; ; k = chunks[k].syncChunk) {
+        SpeculativeChunk& chunk = chunks[k];
+        chain.push_back(k);
+        chunk.imageMCU = mcu;
+        mcu += chunk.records.positions.size() - chunk.firstMCU + chunk.continuation.positions.size();
+        if (!chunk.synchronized) {
+            break;
+        }
+        SpeculativeChunk& next = chunks[chunk.syncChunk];
+        next.firstMCU = chunk.syncMCU;
+        for (uint i = 0; i < 3; ++i) {
+            next.dcDeltas[i] = chunk.previousDCs[i] + chunk.dcDeltas[i] - next.records.predictors[chunk.syncMCU * 3 + i];
+        }
+    }
+    if (mcu < numMCUs) {
+        return false;
+    }
+    console() << "Stitched " << chain.size() << " of " << numChunks << " chunks\n";
+
+    for (const std::size_t k : chain) {
+        pool.run([&, k] { storeSpeculativeChunk(image, chunks[k], blocksPerMCU, numMCUs); });
+    }
+    pool.wait();
+    return true;
+}
+
+// dequantize a block component based on a quantization table
+SIMD_INLINE void dequantizeBlockComponentKernel(const QuantizationTable& qTable, int* const component) {
+    for (uint i = 0; i < 64; ++i) {
+        component[i] *= qTable.table[i];
+    }
+}
+SIMD_KERNEL(void, dequantizeBlockComponent, (const QuantizationTable& qTable, int* const component), (qTable, component))
+
+// dequantize all MCUs in block rows startRow through endRow - 1,
+//   streaming through their block components in memory order
+void dequantize(const JPGImage* const image, const uint startRow, const uint endRow) {
+    const uint mcuRows = (endRow - startRow + image->verticalSamplingFactor - 1) / image->verticalSamplingFactor;
+    const uint numMCUs = mcuRows * (image->blockWidthReal / image->horizontalSamplingFactor);
+    int* component = image->blockComponent(startRow, 0, 0);
+    for (uint mcu = 0; mcu < numMCUs; ++mcu) {
+        for (uint i = 0; i < image->storedComponents(); ++i) {
+            const ColorComponent& c = image->colorComponents[i];
+            const QuantizationTable& qTable = image->quantizationTables[c.quantizationTableID];
+            for (uint j = 0; j < c.verticalSamplingFactor * c.horizontalSamplingFactor; ++j, component += 64) {
+                dequantizeBlockComponent(qTable, component);
+            }
+        }
+    }
+}
+
+// perform 1-D IDCT on all columns and rows of a block component
+//   resulting in 2-D IDCT
+SIMD_INLINE void inverseDCTBlockComponentKernel(int* const component) {
+
+    float intermediate[64];
+
+    for (uint i = 0; i < 8; ++i) {
+        const float g0 = component[0 * 8 + i] * s0;
+        const float g1 = component[4 * 8 + i] * s4;
+        const float g2 = component[2 * 8 + i] * s2;
+        const float g3 = component[6 * 8 + i] * s6;
+        const float g4 = component[5 * 8 + i] * s5;
+        const float g5 = component[1 * 8 + i] * s1;
+        const float g6 = component[7 * 8 + i] * s7;
+        const float g7 = component[3 * 8 + i] * s3;
+
+        const float f0 = g0;
+        const float f1 = g1;
+        const float f2 = g2;
+        const float f3 = g3;
+        const float f4 = g4 - g7;
+        const float f5 = g5 + g6;
+        const float f6 = g5 - g6;
+        const float f7 = g4 + g7;
+
+        const float e0 = f0;
+        const float e1 = f1;
+        const float e2 = f2 - f3;
+        const float e3 = f2 + f3;
+        const float e4 = f4;
+        const float e5 = f5 - f7;
+        const float e6 = f6;
+        const float e7 = f5 + f7;
+        const float e8 = f4 + f6;
+
+        const float d0 = e0;
+        const float d1 = e1;
+        const float d2 = e2 * m1;
+        const float d3 = e3;
+        const float d4 = e4 * m2;
+        const float d5 = e5 * m3;
+        const float d6 = e6 * m4;
+        const float d7 = e7;
+        const float d8 = e8 * m5;
+
+        const float c0 = d0 + d1;
+        const float c1 = d0 - d1;
+        const float c2 = d2 - d3;
+        const float c3 = d3;
+        const float c4 = d4 + d8;
+        const float c5 = d5 + d7;
+        const float c6 = d6 - d8;
+        const float c7 = d7;
+        const float c8 = c5 - c6;
+
+        const float b0 = c0 + c3;
+        const float b1 = c1 + c2;
+        const float b2 = c1 - c2;
+        const float b3 = c0 - c3;
+        const float b4 = c4 - c8;
+        const float b5 = c8;
+        const float b6 = c6 - c7;
+        const float b7 = c7;
+
+        intermediate[0 * 8 + i] = b0 + b7;
+        intermediate[1 * 8 + i] = b1 + b6;
+        intermediate[2 * 8 + i] = b2 + b5;
+        intermediate[3 * 8 + i] = b3 + b4;
+        intermediate[4 * 8 + i] = b3 - b4;
+        intermediate[5 * 8 + i] = b2 - b5;
+        intermediate[6 * 8 + i] = b1 - b6;
+        intermediate[7 * 8 + i] = b0 - b7;
+    }
+    for (uint i = 0; i < 8; ++i) {
+        const float g0 = intermediate[i * 8 + 0] * s0;
+        const float g1 = intermediate[i * 8 + 4] * s4;
+        const float g2 = intermediate[i * 8 + 2] * s2;
+        const float g3 = intermediate[i * 8 + 6] * s6;
+        const float g4 = intermediate[i * 8 + 5] * s5;
+        const float g5 = intermediate[i * 8 + 1] * s1;
+        const float g6 = intermediate[i * 8 + 7] * s7;
+        const float g7 = intermediate[i * 8 + 3] * s3;
+
+        const float f0 = g0;
+        const float f1 = g1;
+        const float f2 = g2;
+        const float f3 = g3;
+        const float f4 = g4 - g7;
+        const float f5 = g5 + g6;
+        const float f6 = g5 - g6;
+        const float f7 = g4 + g7;
+
+        const float e0 = f0;
+        const float e1 = f1;
+        const float e2 = f2 - f3;
+        const float e3 = f2 + f3;
+        const float e4 = f4;
+        const float e5 = f5 - f7;
+        const float e6 = f6;
+        const float e7 = f5 + f7;
+        const float e8 = f4 + f6;
+
+        const float d0 = e0;
+        const float d1 = e1;
+        const float d2 = e2 * m1;
+        const float d3 = e3;
+        const float d4 = e4 * m2;
+        const float d5 = e5 * m3;
+        const float d6 = e6 * m4;
+        const float d7 = e7;
+        const float d8 = e8 * m5;
+
+        const float c0 = d0 + d1;
+        const float c1 = d0 - d1;
+        const float c2 = d2 - d3;
+        const float c3 = d3;
+        const float c4 = d4 + d8;
+        const float c5 = d5 + d7;
+        const float c6 = d6 - d8;
+        const float c7 = d7;
+        const float c8 = c5 - c6;
+
+        const float b0 = c0 + c3;
+        const float b1 = c1 + c2;
+        const float b2 = c1 - c2;
+        const float b3 = c0 - c3;
+        const float b4 = c4 - c8;
+        const float b5 = c8;
+        const float b6 = c6 - c7;
+        const float b7 = c7;
+
+        component[i * 8 + 0] = b0 + b7 + 0.5f;
+        component[i * 8 + 1] = b1 + b6 + 0.5f;
+        component[i * 8 + 2] = b2 + b5 + 0.5f;
+        component[i * 8 + 3] = b3 + b4 + 0.5f;
+        component[i * 8 + 4] = b3 - b4 + 0.5f;
+        component[i * 8 + 5] = b2 - b5 + 0.5f;
+        component[i * 8 + 6] = b1 - b6 + 0.5f;
+        component[i * 8 + 7] = b0 - b7 + 0.5f;
+    }
+}
+SIMD_KERNEL(void, inverseDCTBlockComponent, (int* const component), (component))
+
+// perform IDCT on all MCUs in block rows startRow through endRow - 1,
+//   streaming through their block components in memory order
+void inverseDCT(const JPGImage* const image, const uint startRow, const uint endRow) {
+    const uint mcuRows = (endRow - startRow + image->verticalSamplingFactor - 1) / image->verticalSamplingFactor;
+    const uint numBlockComponents = mcuRows * (image->blockWidthReal / image->horizontalSamplingFactor) * image->blocksPerMCU;
+    int* const component = image->blockComponent(startRow, 0, 0);
+    for (uint j = 0; j < numBlockComponents; ++j) {
+        inverseDCTBlockComponent(component + j * 64);
+    }
+}
+
+// number of bytes used by one pixel of the given format
+uint bytesPerPixel(const PixelFormat format) {
+    switch (format) {
+        case PIXEL_FORMAT_RGBA:
+        case PIXEL_FORMAT_BGRA:
+            return 4;
+        case PIXEL_FORMAT_GRAY:
+            return 1;
+        default:
+            return 3;
+    }
+}
+
+// convert one row of 8 pixels from YCbCr to RGB, clamped to 0-255
+SIMD_INLINE void YCbCrToRGBRowKernel(
+    const int* __restrict const y,
+    const int* __restrict const cb,
+    const int* __restrict const cr,
+    int* __restrict const r,
+    int* __restrict const g,
+    int* __restrict const b
+) {
+    for (uint x = 0; x < 8; ++x) {
+        const float luminance = y[x];
+        const float blueDifference = cb[x];
+        const float redDifference = cr[x];
+        const int red   = luminance                           + 1.402f * redDifference + 128;
+        const int green = luminance - 0.344f * blueDifference - 0.714f * redDifference + 128;
+        const int blue  = luminance + 1.772f * blueDifference                          + 128;
+        r[x] = red   < 0 ? 0 : red   > 255 ? 255 : red;
+        g[x] = green < 0 ? 0 : green > 255 ? 255 : green;
+        b[x] = blue  < 0 ? 0 : blue  > 255 ? 255 : blue;
+    }
+}
+SIMD_KERNEL(void, YCbCrToRGBRow,
+    (const int* __restrict const y, const int* __restrict const cb, const int* __restrict const cr,
+     int* __restrict const r, int* __restrict const g, int* __restrict const b),
+    (y, cb, cr, r, g, b))
+
+// convert all pixels in block rows startRow through endRow - 1 from YCbCr
+//   color space to the given pixel format, writing them straight into a
+//   caller-provided buffer with one row every stride bytes, starting with
+//   the top row of the image
+// a negative stride writes the rows bottom-up
+void YCbCrToPixels(
+    const JPGImage* const image,
+    byte* const buffer,
+    const long stride,
+    const PixelFormat format,
+    const uint startRow,
+    const uint endRow
+) {
+    const uint vSamp = image->verticalSamplingFactor;
+    const uint hSamp = image->horizontalSamplingFactor;
+    const uint pixelSize = bytesPerPixel(format);
+    const uint red = (format == PIXEL_FORMAT_BGR || format == PIXEL_FORMAT_BGRA) ? 2 : 0;
+    const uint blue = 2 - red;
+    const uint endPixelRow = endRow * 8 < image->height ? endRow * 8 : image->height;
+    // grayscale images, and those decoded to grayscale, have no chroma
+    static const int noChroma[8] = { 0 };
+    for (uint y = startRow * 8; y < endPixelRow; ++y) {
+        const uint blockRow = y / 8;
+        const uint pixelRow = y % 8;
+        // one chroma block covers each MCU
+        const uint cbcrPixelRow = pixelRow / vSamp + 4 * (blockRow % vSamp);
+        byte* bufferPos = buffer + y * stride;
+        for (uint blockColumn = 0; blockColumn < image->blockWidth; ++blockColumn) {
+            const int* const yRow = image->blockComponent(blockRow, blockColumn, 0) + pixelRow * 8;
+            const uint cbcrOffset = cbcrPixelRow * 8 + 4 * (blockColumn % hSamp);
+            const int* const cbRow = image->storedComponents() == 3 ? image->blockComponent(blockRow, blockColumn, 1) + cbcrOffset : noChroma;
+            const int* const crRow = image->storedComponents() == 3 ? image->blockComponent(blockRow, blockColumn, 2) + cbcrOffset : noChroma;
+            const uint endColumn = image->width - blockColumn * 8 < 8 ? image->width - blockColumn * 8 : 8;
+            if (format == PIXEL_FORMAT_GRAY) {
+                for (uint pixelColumn = 0; pixelColumn < endColumn; ++pixelColumn) {
+                    int gray = yRow[pixelColumn] + 128;
+                    if (gray < 0)   gray = 0;
+                    if (gray > 255) gray = 255;
+                    *bufferPos++ = gray;
+                }
+                continue;
+            }
+            int cb[8], cr[8], r[8], g[8], b[8];
+            for (uint pixelColumn = 0; pixelColumn < 8; ++pixelColumn) {
+                cb[pixelColumn] = cbRow[pixelColumn / hSamp];
+                cr[pixelColumn] = crRow[pixelColumn / hSamp];
+            }
+            YCbCrToRGBRow(yRow, cb, cr, r, g, b);
+            for (uint pixelColumn = 0; pixelColumn < endColumn; ++pixelColumn) {
+                bufferPos[red] = r[pixelColumn];
+                bufferPos[1] = g[pixelColumn];
+                bufferPos[blue] = b[pixelColumn];
+                if (pixelSize == 4) {
+                    bufferPos[3] = 255;
+                }
+                bufferPos += pixelSize;
+            }
+        }
+    }
+}
+
+// dequantize, IDCT and color convert all MCUs straight into a caller-provided buffer
+// the image is processed in bands of one MCU row that pass through all three
+//   stages while still in cache, with the bands spread across numThreads
+void renderImage(const JPGImage* const image, byte* const buffer, const long stride, const PixelFormat format, const uint numThreads) {
+    const uint bandHeight = image->verticalSamplingFactor;
+    auto renderBand = [=](const uint startRow) {
+        const uint endRow = startRow + bandHeight < image->blockHeight ? startRow + bandHeight : image->blockHeight;
+        dequantize(image, startRow, endRow);
+        inverseDCT(image, startRow, endRow);
+        YCbCrToPixels(image, buffer, stride, format, startRow, endRow);
+    };
+
+    if (numThreads <= 1) {
+        for (uint y = 0; y < image->blockHeight; y += bandHeight) {
+            renderBand(y);
+        }
+        return;
+    }
+
+    ThreadPool pool(numThreads);
+    for (uint y = 0; y < image->blockHeight; y += bandHeight) {
+        pool.run([=] { renderBand(y); });
+    }
+    pool.wait();
+}
+
+// convert the quantized DC coefficient of every block to one pixel
+//   of the given format, producing an image at 1/8 scale without an IDCT
+// the DC coefficient is 8 times the average of the samples in its block
+void DCToPixels(const JPGImage* const image, byte* const buffer, const long stride, const PixelFormat format) {
+    const uint pixelSize = bytesPerPixel(format);
+    const uint red = (format == PIXEL_FORMAT_BGR || format == PIXEL_FORMAT_BGRA) ? 2 : 0;
+    const uint blue = 2 - red;
+    const float yScale = image->quantizationTables[image->colorComponents[0].quantizationTableID].table[0] / 8.0f;
+    const float cbScale = image->quantizationTables[image->colorComponents[1].quantizationTableID].table[0] / 8.0f;
+    const float crScale = image->quantizationTables[image->colorComponents[2].quantizationTableID].table[0] / 8.0f;
+    for (uint y = 0; y < image->blockHeight; ++y) {
+        byte* bufferPos = buffer + y * stride;
+        for (uint x = 0; x < image->blockWidth; ++x) {
+            const float luminance = image->blockComponent(y, x, 0)[0] * yScale + 128;
+            const float cb = image->storedComponents() == 3 ? image->blockComponent(y, x, 1)[0] * cbScale : 0;
+            const float cr = image->storedComponents() == 3 ? image->blockComponent(y, x, 2)[0] * crScale : 0;
+            if (format == PIXEL_FORMAT_GRAY) {
+                int gray = luminance + 0.5f;
+                if (gray < 0)   gray = 0;
+                if (gray > 255) gray = 255;
+                *bufferPos++ = gray;
+                continue;
+            }
+            int r = luminance                + 1.402f * cr + 0.5f;
+            int g = luminance - 0.344f * cb - 0.714f * cr + 0.5f;
+            int b = luminance + 1.772f * cb               + 0.5f;
+            if (r < 0)   r = 0;
+            if (r > 255) r = 255;
+            if (g < 0)   g = 0;
+            if (g > 255) g = 255;
+            if (b < 0)   b = 0;
+            if (b > 255) b = 255;
+            bufferPos[red] = r;
+            bufferPos[1] = g;
+            bufferPos[blue] = b;
+            if (pixelSize == 4) {
+                bufferPos[3] = 255;
+            }
+            bufferPos += pixelSize;
+        }
+    }
+}
+
+// compute the average color, color histogram and perceptual hash of the
+//   image built from the DC coefficients, without any IDCT
+// the hash follows the common pHash construction: the 8x8 lowest
+//   frequencies of the DCT of a 32x32 grayscale reduction, each compared
+//   with their median
+DCAnalysis analyzeDCImage(const JPGImage* const image) {
+    DCAnalysis analysis;
+    const uint width = image->blockWidth;
+    const uint height = image->blockHeight;
+    analysis.width = width;
+    analysis.height = height;
+    std::vector<byte> rgb((std::size_t)width * height * 3);
+    std::vector<byte> gray((std::size_t)width * height);
+    DCToPixels(image, rgb.data(), width * 3, PIXEL_FORMAT_RGB);
+    DCToPixels(image, gray.data(), width, PIXEL_FORMAT_GRAY);
+
+    double sums[3] = { 0 };
+    for (std::size_t i = 0; i < gray.size(); ++i) {
+        const byte* const pixel = rgb.data() + i * 3;
+        sums[0] += pixel[0];
+        sums[1] += pixel[1];
+        sums[2] += pixel[2];
+        analysis.histogram[pixel[0] / 64 * 16 + pixel[1] / 64 * 4 + pixel[2] / 64] += 1;
+    }
+    for (uint i = 0; i < 3; ++i) {
+        analysis.averageColor[i] = sums[i] / gray.size();
+    }
+    for (uint i = 0; i < 64; ++i) {
+        analysis.histogram[i] /= gray.size();
+    }
+
+    // reduce to 32x32 by averaging the pixels that fall into each cell,
+    //   or by repeating pixels of DC images smaller than that
+    float reduced[32][32];
+    for (uint y = 0; y < 32; ++y) {
+        const uint startY = y * height / 32;
+        const uint endY = std::max((y + 1) * height / 32, startY + 1);
+        for (uint x = 0; x < 32; ++x) {
+            const uint startX = x * width / 32;
+            const uint endX = std::max((x + 1) * width / 32, startX + 1);
+            float sum = 0;
+            for (uint j = startY; j < endY; ++j) {
+                for (uint i = startX; i < endX; ++i) {
+                    sum += gray[(std::size_t)j * width + i];
+                }
+            }
+            reduced[y][x] = sum / ((endY - startY) * (endX - startX));
+        }
+    }
+
+    // only the lowest 8 frequencies of the 32-point DCT are needed
+    float cosines[8][32];
+    for (uint u = 0; u < 8; ++u) {
+        for (uint x = 0; x < 32; ++x) {
+            cosines[u][x] = std::cos((2 * x + 1) * u * M_PI / 64);
+        }
+    }
+    float rows[32][8];
+    for (uint y = 0; y < 32; ++y) {
+        for (uint u = 0; u < 8; ++u) {
+            float sum = 0;
+            for (uint x = 0; x < 32; ++x) {
+                sum += reduced[y][x] * cosines[u][x];
+            }
+            rows[y][u] = sum;
+        }
+    }
+    float frequencies[64];
+    for (uint v = 0; v < 8; ++v) {
+        for (uint u = 0; u < 8; ++u) {
+            float sum = 0;
+            for (uint y = 0; y < 32; ++y) {
+                sum += rows[y][u] * cosines[v][y];
+            }
+            frequencies[v * 8 + u] = sum;
+        }
+    }
+    float sorted[64];
+    std::copy(frequencies, frequencies + 64, sorted);
+    std::sort(sorted, sorted + 64);
+    const float median = (sorted[31] + sorted[32]) / 2;
+    for (uint i = 0; i < 64; ++i) {
+        analysis.perceptualHash = (analysis.perceptualHash << 1) | (frequencies[i] > median);
+    }
+    return analysis;
+}
+
+// decode the DC coefficients of a JPG and print the analysis of its
+//   DC image as one line of JSON
+void printAnalysis(const std::string& filename, const DecoderOptions& options) {
+    console() << "{\"file\":" << jsonString(filename);
+    JPGImage* image = nullptr;
+    std::string error;
+    {
+        CapturedOutput messages;
+        image = readJPG(filename, options);
+        if (image == nullptr || image->coefficients == nullptr || !image->valid) {
+            error = messages.firstError();
+        }
+    }
+    if (!error.empty()) {
+        console() << ",\"valid\":false,\"error\":" << jsonString(error) << "}\n";
+        if (image != nullptr) {
+            freeImage(image);
+        }
+        return;
+    }
+
+    const DCAnalysis analysis = analyzeDCImage(image);
+    freeImage(image);
+    console() << ",\"valid\":true";
+    console() << ",\"width\":" << analysis.width << ",\"height\":" << analysis.height;
+    console() << std::fixed << std::setprecision(1);
+    console() << ",\"averageColor\":[" << analysis.averageColor[0] << ',' << analysis.averageColor[1] << ',' << analysis.averageColor[2] << ']';
+    console() << std::setprecision(4);
+    console() << ",\"histogram\":[";
+    for (uint i = 0; i < 64; ++i) {
+        console() << (i == 0 ? "" : ",") << analysis.histogram[i];
+    }
+    console() << ']';
+    console() << ",\"phash\":\"" << std::hex << std::setw(16) << std::setfill('0') << analysis.perceptualHash << std::dec << std::setfill(' ') << '"';
+    console() << "}\n";
+    console().unsetf(std::ios::fixed);
+    console() << std::setprecision(6);
+}
+
+// print whether a JPG is intact as one line of JSON
+void printValidation(const std::string& filename) {
+    std::size_t errorOffset = 0;
+    const std::string error = validateJPG(filename, errorOffset);
+    console() << "{\"file\":" << jsonString(filename);
+    if (error.empty()) {
+        console() << ",\"valid\":true}\n";
+    }
+    else {
+        console() << ",\"valid\":false,\"error\":" << jsonString(error) << ",\"offset\":" << errorOffset << "}\n";
+    }
+}
+
+// helper function to write a 4-byte integer in little-endian
+void putInt(byte*& bufferPos, const uint v) {
+    *bufferPos++ = v >>  0;
+    *bufferPos++ = v >>  8;
+    *bufferPos++ = v >> 16;
+    *bufferPos++ = v >> 24;
+}
+
+// helper function to write a 2-byte short integer in little-endian
+void putShort(byte*& bufferPos, const uint v) {
+    *bufferPos++ = v >> 0;
+    *bufferPos++ = v >> 8;
+}
+
+// create a BMP file and map it into memory with its headers written,
+//   returning the mapping of the given size, or nullptr on errors
+// pixels is set to the top row of the image, from which rows of stride
+//   bytes lead down the image
+byte* mapBMP(
+    const std::string& filename,
+    const uint width,
+    const uint height,
+    const bool gray,
+    std::size_t& size,
+    byte*& pixels,
+    long& stride
+) {
+    // open file
+    console() << "Writing " << filename << "...\n";
+    const int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        console() << "Error - Error opening output file\n";
+        return nullptr;
+    }
+
+    // rows are padded to a multiple of 4 bytes, and grayscale pixels
+    //   index a palette of 256 shades of gray
+    const std::size_t rowSize = ((std::size_t)width * (gray ? 1 : 3) + 3) / 4 * 4;
+    const std::size_t imageSize = height * rowSize;
+    const uint paletteSize = gray ? 256 * 4 : 0;
+    size = 14 + 40 + paletteSize + imageSize;
+
+    void* region = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (region == MAP_FAILED) {
+        console() << "Error - Error mapping output file\n";
+        return nullptr;
+    }
+    byte* bufferPos = (byte*)region;
+
+    // the BITMAPINFOHEADER holds 32-bit dimensions, while the 32-bit sizes
+    //   are 0 for images too large for them, which readers ignore
+    *bufferPos++ = 'B';
+    *bufferPos++ = 'M';
+    putInt(bufferPos, size <= 0xFFFFFFFF ? size : 0);
+    putInt(bufferPos, 0);
+    putInt(bufferPos, 14 + 40 + paletteSize);
+    putInt(bufferPos, 40);
+    putInt(bufferPos, width);
+    putInt(bufferPos, height);
+    putShort(bufferPos, 1);
+    putShort(bufferPos, gray ? 8 : 24);
+    putInt(bufferPos, 0); // uncompressed
+    putInt(bufferPos, imageSize <= 0xFFFFFFFF ? imageSize : 0);
+    putInt(bufferPos, 0); // horizontal resolution
+    putInt(bufferPos, 0); // vertical resolution
+    putInt(bufferPos, gray ? 256 : 0); // colors in palette
+    putInt(bufferPos, 0); // important colors
+    for (uint i = 0; i < paletteSize / 4; ++i) {
+        *bufferPos++ = i;
+        *bufferPos++ = i;
+        *bufferPos++ = i;
+        *bufferPos++ = 0;
+    }
 
-    return image;
+    // BMP rows are stored bottom-up
+    // the row padding is left as the zeroes of the newly sized file
+    pixels = bufferPos + (height - 1) * rowSize;
+    stride = -(long)rowSize;
+    return (byte*)region;
 }
 
-// return the symbol from the Huffman table that corresponds to
-//   the next Huffman code read from the BitReader
-byte getNextSymbol(BitReader& bitReader, const HuffmanTable& hTable) {
-    uint currentCode = 0;
-    for (uint i = 0; i < 16; ++i) {
-        int bit = bitReader.readBit();
-        if (bit == -1) {
-            return -1;
+// write a 24-bit BMP file of the given dimensions, or an 8-bit grayscale
+//   one, whose pixels are written by render in BGR or gray order, starting
+//   with the top row, one row every stride bytes
+// the file is mapped and the pixels are written straight into it, so that
+//   no copy of the whole image is held in memory
+void writeBMP(
+    const std::string& filename,
+    const uint width,
+    const uint height,
+    const bool gray,
+    const std::function<void(byte* const, const long)>& render
+) {
+    std::size_t size;
+    byte* pixels;
+    long stride;
+    byte* const region = mapBMP(filename, width, height, gray, size, pixels, stride);
+    if (region == nullptr) {
+        return;
+    }
+    render(pixels, stride);
+    munmap(region, size);
+}
+
+// decode all the pixels in the MCUs and write them to a BMP file
+// if dcOnly is set, the quantized DC coefficients are written
+//   as a 1/8 scale image instead
+void writeBMP(const JPGImage* const image, const std::string& filename, const bool dcOnly, const uint numThreads) {
+    const uint width = dcOnly ? image->blockWidth : image->width;
+    const uint height = dcOnly ? image->blockHeight : image->height;
+    const PixelFormat format = image->lumaOnly ? PIXEL_FORMAT_GRAY : PIXEL_FORMAT_BGR;
+    writeBMP(filename, width, height, image->lumaOnly, [=](byte* const buffer, const long stride) {
+        // color conversion
+        if (dcOnly) {
+            DCToPixels(image, buffer, stride, format);
         }
-        currentCode = (currentCode << 1) | bit;
-        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
-            if (currentCode == hTable.codes[j]) {
-                return hTable.symbols[j];
-            }
+        else {
+            renderImage(image, buffer, stride, format, numThreads);
         }
-    }
-    return -1;
+    });
 }
 
-// fill the coefficients of a block component based on Huffman codes
-//   read from the BitReader
-bool decodeBlockComponent(
-    const JPGImage* const image,
-    BitReader& bitReader,
-    int* const component,
-    int& previousDC,
-    uint& skips,
-    const HuffmanTable& dcTable,
-    const HuffmanTable& acTable
-) {
-    if (image->frameType == SOF0) {
-        // get the DC value for this block component
-        byte length = getNextSymbol(bitReader, dcTable);
-        if (length == (byte)-1) {
-            std::cout << "Error - Invalid DC value\n";
-            return false;
+// write all the pixels in the MCUs directly into a shared memory region
+//   so that the consumer can map them without another copy
+// the region is grown if it is too small to hold height rows of stride bytes
+void writeSharedMemory(const JPGImage* const image, const DecoderOptions& options) {
+    const uint width = options.dcOnly ? image->blockWidth : image->width;
+    const uint height = options.dcOnly ? image->blockHeight : image->height;
+    const uint rowSize = width * bytesPerPixel(options.pixelFormat);
+    const uint stride = options.rowStride != 0 ? options.rowStride : rowSize;
+    if (stride < rowSize) {
+        console() << "Error - Row stride smaller than image row: " << stride << '\n';
+        return;
+    }
+
+    int fd = options.sharedMemoryFD;
+    if (fd < 0) {
+        console() << "Writing shared memory " << options.sharedMemoryName << "...\n";
+        fd = shm_open(options.sharedMemoryName.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            console() << "Error - Error opening shared memory\n";
+            return;
         }
-        if (length > 11) {
-            std::cout << "Error - DC coefficient length greater than 11\n";
-            return false;
+    }
+    else {
+        console() << "Writing file descriptor " << fd << "...\n";
+    }
+
+    const std::size_t size = (std::size_t)stride * height;
+    struct stat info;
+    if (fstat(fd, &info) != 0 ||
+        ((std::size_t)info.st_size < size && ftruncate(fd, size) != 0)) {
+        console() << "Error - Error resizing shared memory\n";
+        if (fd != options.sharedMemoryFD) {
+            close(fd);
         }
+        return;
+    }
 
-        int coeff = bitReader.readBits(length);
-        if (coeff == -1) {
-            std::cout << "Error - Invalid DC value\n";
-            return false;
+    void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        console() << "Error - Error mapping shared memory\n";
+    }
+    else {
+        // color conversion
+        if (options.dcOnly) {
+            DCToPixels(image, (byte*)region, stride, options.pixelFormat);
         }
-        if (length != 0 && coeff < (1 << (length - 1))) {
-            coeff -= (1 << length) - 1;
+        else {
+            renderImage(image, (byte*)region, stride, options.pixelFormat, options.numThreads);
         }
-        component[0] = coeff + previousDC;
-        previousDC = component[0];
+        munmap(region, size);
+        console() << "Wrote " << width << 'x' << height << " pixels with stride " << stride << '\n';
+    }
 
-        // get the AC values for this block component
-        for (uint i = 1; i < 64; ++i) {
-            byte symbol = getNextSymbol(bitReader, acTable);
-            if (symbol == (byte)-1) {
-                std::cout << "Error - Invalid AC value\n";
-                return false;
-            }
+    if (fd != options.sharedMemoryFD) {
+        close(fd);
+    }
+}
 
-            // symbol 0x00 means fill remainder of component with 0
-            if (symbol == 0x00) {
-                return true;
-            }
+// replace the extension of filename with the given suffix
+std::string outputFilename(const std::string& filename, const std::string& suffix) {
+    const std::size_t pos = filename.find_last_of('.');
+    return (pos == std::string::npos) ?
+        (filename + suffix) :
+        (filename.substr(0, pos) + suffix);
+}
 
-            // otherwise, read next component coefficient
-            byte numZeroes = symbol >> 4;
-            byte coeffLength = symbol & 0x0F;
-            coeff = 0;
+// decode a JPG through the incremental decoder, writing each band of its
+//   BMP as soon as the coefficients of the band are final
+void streamBMP(const std::string& filename, DecoderOptions options) {
+    const std::string outFilename = outputFilename(filename == "-" ? "stdin" : filename, ".bmp");
+    byte* region = nullptr;
+    std::size_t size = 0;
+    byte* pixels = nullptr;
+    long stride = 0;
+    bool opened = false;
+    options.rowCallback = [&](const JPGImage* const image, const uint startRow, const uint endRow) {
+        if (!opened) {
+            region = mapBMP(outFilename, image->width, image->height, image->lumaOnly, size, pixels, stride);
+            opened = true;
+        }
+        if (region == nullptr) {
+            return;
+        }
+        const PixelFormat format = image->lumaOnly ? PIXEL_FORMAT_GRAY : PIXEL_FORMAT_BGR;
+        dequantize(image, startRow, endRow);
+        inverseDCT(image, startRow, endRow);
+        YCbCrToPixels(image, pixels, stride, format, startRow, endRow);
+    };
 
-            if (i + numZeroes >= 64) {
-                std::cout << "Error - Zero run-length exceeded block component\n";
-                return false;
-            }
-            i += numZeroes;
+    JPGImage* const image = streamJPG(filename, options);
+    if (region != nullptr) {
+        munmap(region, size);
+    }
+    if (image != nullptr) {
+        freeImage(image);
+    }
+}
 
-            if (coeffLength > 10) {
-                std::cout << "Error - AC coefficient length greater than 10\n";
-                return false;
-            }
-            coeff = bitReader.readBits(coeffLength);
-            if (coeff == -1) {
-                std::cout << "Error - Invalid AC value\n";
-                return false;
-            }
-            if (coeff < (1 << (coeffLength - 1))) {
-                coeff -= (1 << coeffLength) - 1;
-            }
-            component[zigZagMap[i]] = coeff;
+// write the coefficients decoded so far to a BMP file, leaving
+//   the partially decoded image untouched so decoding can continue
+void writePreview(const JPGImage* const image, const std::string& filename, const uint scanNumber, const DecoderOptions& options) {
+    const std::string outFilename = outputFilename(filename, ".scan" + std::to_string(scanNumber) + ".bmp");
+    if (options.previewDCOnly) {
+        writeBMP(image, outFilename, true, options.numThreads);
+        return;
+    }
+
+    JPGImage preview = *image;
+    preview.coefficients = allocateCoefficients(image, options.memoryBudget);
+    if (preview.coefficients == nullptr) {
+        console() << "Error - Memory error\n";
+        return;
+    }
+    std::copy(image->coefficients, image->coefficients + image->numBlockComponents() * 64, preview.coefficients);
+
+    writeBMP(&preview, outFilename, false, options.numThreads);
+
+    freeCoefficients(image, preview.coefficients);
+}
+
+// thumbnail embedded in the APP segments of a JPG, either as a JPG of its
+//   own or as uncompressed RGB pixels
+struct Thumbnail {
+    bool found = false;
+    bool compressed = false;
+    std::vector<byte> data;
+    uint width = 0;
+    uint height = 0;
+};
+
+// helper functions to read TIFF integers in the byte order of an EXIF segment
+uint getTIFFShort(const byte* const p, const bool bigEndian) {
+    return bigEndian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+uint getTIFFInt(const byte* const p, const bool bigEndian) {
+    return bigEndian ?
+        ((uint)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3] :
+        p[0] | (p[1] << 8) | (p[2] << 16) | ((uint)p[3] << 24);
+}
+
+// find the JPG thumbnail of an EXIF segment, which IFD1, the second image
+//   directory of its TIFF structure, locates within the segment
+void readEXIFThumbnail(const byte* const tiff, const std::size_t size, Thumbnail& thumbnail) {
+    if (size < 8 || !((tiff[0] == 'I' && tiff[1] == 'I') || (tiff[0] == 'M' && tiff[1] == 'M'))) {
+        return;
+    }
+    const bool bigEndian = tiff[0] == 'M';
+    // skip IFD0 to reach IFD1
+    std::size_t ifd = getTIFFInt(tiff + 4, bigEndian);
+    if (ifd + 2 > size) {
+        return;
+    }
+    ifd += 2 + getTIFFShort(tiff + ifd, bigEndian) * 12;
+    if (ifd + 4 > size) {
+        return;
+    }
+    ifd = getTIFFInt(tiff + ifd, bigEndian);
+    if (ifd == 0 || ifd + 2 > size) {
+        return;
+    }
+
+    const uint numEntries = getTIFFShort(tiff + ifd, bigEndian);
+    std::size_t offset = 0;
+    std::size_t length = 0;
+    for (uint i = 0; i < numEntries && ifd + 2 + (i + 1) * 12 <= size; ++i) {
+        const byte* const entry = tiff + ifd + 2 + i * 12;
+        const uint tag = getTIFFShort(entry, bigEndian);
+        if (tag == 0x0201) { // JPEGInterchangeFormat
+            offset = getTIFFInt(entry + 8, bigEndian);
+        }
+        else if (tag == 0x0202) { // JPEGInterchangeFormatLength
+            length = getTIFFInt(entry + 8, bigEndian);
         }
-        return true;
     }
-    else { // image->frameType == SOF2
-        if (image->startOfSelection == 0 && image->successiveApproximationHigh == 0) {
-            // DC first visit
-            byte length = getNextSymbol(bitReader, dcTable);
-            if (length == (byte)-1) {
-                std::cout << "Error - Invalid DC value\n";
-                return false;
+    if (offset == 0 || length == 0 || offset + length > size) {
+        return;
+    }
+    thumbnail.found = true;
+    thumbnail.compressed = true;
+    thumbnail.data.assign(tiff + offset, tiff + offset + length);
+}
+
+// find the thumbnail of a JFIF segment, or of a JFXX extension segment,
+//   which holds a JPG, palette indices or RGB pixels
+void readJFIFThumbnail(const byte* const segment, const std::size_t size, Thumbnail& thumbnail) {
+    if (size >= 14 && std::equal(segment, segment + 5, "JFIF")) {
+        const uint width = segment[12];
+        const uint height = segment[13];
+        if (width != 0 && height != 0 && 14 + width * height * 3 <= size) {
+            thumbnail.found = true;
+            thumbnail.width = width;
+            thumbnail.height = height;
+            thumbnail.data.assign(segment + 14, segment + 14 + width * height * 3);
+        }
+    }
+    else if (size >= 6 && std::equal(segment, segment + 5, "JFXX")) {
+        const byte extension = segment[5];
+        if (extension == 0x10) {
+            thumbnail.found = true;
+            thumbnail.compressed = true;
+            thumbnail.data.assign(segment + 6, segment + size);
+        }
+        else if (extension == 0x11 && size >= 8 + 768) {
+            const uint width = segment[6];
+            const uint height = segment[7];
+            const byte* const palette = segment + 8;
+            const byte* const indices = palette + 768;
+            if (width != 0 && height != 0 && 8 + 768 + width * height <= size) {
+                thumbnail.found = true;
+                thumbnail.width = width;
+                thumbnail.height = height;
+                for (uint i = 0; i < width * height; ++i) {
+                    thumbnail.data.insert(thumbnail.data.end(), palette + indices[i] * 3, palette + indices[i] * 3 + 3);
+                }
             }
-            if (length > 11) {
-                std::cout << "Error - DC coefficient length greater than 11\n";
-                return false;
+        }
+        else if (extension == 0x13 && size >= 8) {
+            const uint width = segment[6];
+            const uint height = segment[7];
+            if (width != 0 && height != 0 && 8 + width * height * 3 <= size) {
+                thumbnail.found = true;
+                thumbnail.width = width;
+                thumbnail.height = height;
+                thumbnail.data.assign(segment + 8, segment + 8 + width * height * 3);
             }
+        }
+    }
+}
 
-            int coeff = bitReader.readBits(length);
-            if (coeff == -1) {
-                std::cout << "Error - Invalid DC value\n";
-                return false;
+// find the thumbnail embedded in the APP segments at the start of a JPG,
+//   without reading any further into the file
+// the segments are read one at a time, and only APP0 and APP1 segments
+//   are read at all, any other being skipped by its length
+// an EXIF thumbnail is preferred, as it is usually the largest
+Thumbnail findThumbnail(const std::string& filename) {
+    Thumbnail thumbnail;
+    std::ifstream inFile(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open()) {
+        console() << "Error - Error opening input file\n";
+        return thumbnail;
+    }
+    if (inFile.get() != 0xFF || inFile.get() != SOI) {
+        console() << "Error - SOI invalid\n";
+        return thumbnail;
+    }
+
+    Thumbnail exif;
+    Thumbnail jfif;
+    std::vector<byte> segment;
+    while (inFile.get() == 0xFF) {
+        // any number of 0xFF in a row is allowed and should be ignored
+        int marker = inFile.get();
+        while (marker == 0xFF) {
+            marker = inFile.get();
+        }
+        // thumbnails only ever precede the frame
+        if (!(marker >= APP0 && marker <= APP15) && marker != COM) {
+            break;
+        }
+        const int high = inFile.get();
+        const int low = inFile.get();
+        if (low == EOF || high == EOF) {
+            break;
+        }
+        const std::size_t length = (high << 8) | low;
+        if (length < 2) {
+            break;
+        }
+        const std::size_t segmentSize = length - 2;
+        if ((marker == APP1 && !exif.found) || (marker == APP0 && !jfif.found)) {
+            segment.resize(segmentSize);
+            inFile.read((char*)segment.data(), segmentSize);
+            if ((std::size_t)inFile.gcount() < segmentSize) {
+                break;
             }
-            if (length != 0 && coeff < (1 << (length - 1))) {
-                coeff -= (1 << length) - 1;
+            if (marker == APP1 && segmentSize >= 6 && std::equal(segment.data(), segment.data() + 6, "Exif\0")) {
+                readEXIFThumbnail(segment.data() + 6, segmentSize - 6, exif);
+            }
+            else if (marker == APP0) {
+                readJFIFThumbnail(segment.data(), segmentSize, jfif);
             }
-            coeff += previousDC;
-            previousDC = coeff;
-            component[0] = coeff << image->successiveApproximationLow;
-            return true;
         }
-        else if (image->startOfSelection == 0 && image->successiveApproximationHigh != 0) {
-            // DC refinement
-            int bit = bitReader.readBit();
-            if (bit == -1) {
-                std::cout << "Error - Invalid DC value\n";
-                return false;
+        else {
+            inFile.seekg(segmentSize, std::ios::cur);
+        }
+    }
+    return exif.found ? exif : jfif;
+}
+
+// decode the thumbnail embedded in a JPG and write it to a BMP file
+void writeThumbnail(const std::string& filename, const DecoderOptions& options) {
+    console() << "Reading thumbnail of " << filename << "...\n";
+    Thumbnail thumbnail = findThumbnail(filename);
+    if (!thumbnail.found) {
+        console() << "No thumbnail found\n";
+        return;
+    }
+    const std::string outFilename = outputFilename(filename, ".thumb.bmp");
+
+    if (!thumbnail.compressed) {
+        console() << "Thumbnail: " << thumbnail.width << 'x' << thumbnail.height << " RGB\n";
+        writeBMP(outFilename, thumbnail.width, thumbnail.height, false, [&](byte* const buffer, const long stride) {
+            for (uint y = 0; y < thumbnail.height; ++y) {
+                const byte* const rgb = thumbnail.data.data() + y * thumbnail.width * 3;
+                byte* const bgr = buffer + y * stride;
+                for (uint x = 0; x < thumbnail.width; ++x) {
+                    bgr[x * 3 + 0] = rgb[x * 3 + 2];
+                    bgr[x * 3 + 1] = rgb[x * 3 + 1];
+                    bgr[x * 3 + 2] = rgb[x * 3 + 0];
+                }
             }
-            component[0] |= bit << image->successiveApproximationLow;
-            return true;
+        });
+        return;
+    }
+
+    JPGImage* image = decodeJPG(thumbnail.data, options);
+    if (image == nullptr) {
+        return;
+    }
+    if (image->valid) {
+        console() << "Thumbnail: " << image->width << 'x' << image->height << " JPG\n";
+        writeBMP(image, outFilename, false, options.numThreads);
+    }
+    freeImage(image);
+}
+
+// MJPEG frames often leave out their DHT and rely on the standard tables
+void useStandardHuffmanTables(JPGImage* const image) {
+    image->huffmanDCTables[0] = hDCTableY;
+    image->huffmanDCTables[1] = hDCTableCbCr;
+    image->huffmanACTables[0] = hACTableY;
+    image->huffmanACTables[1] = hACTableCbCr;
+}
+
+// return the position just past the EOI of the JPG whose SOI is at start,
+//   following marker lengths and skipping entropy-coded data, or 0 if the
+//   data ends first
+// an SOI within the frame ends it early, leaving it to fail to decode
+std::size_t findFrameEnd(const byte* const data, const std::size_t size, std::size_t pos) {
+    pos += 2;
+    bool inScan = false;
+    while (true) {
+        if (inScan || (pos < size && data[pos] != 0xFF)) {
+            pos = findMarkerByte(data, pos, size);
         }
-        else if (image->startOfSelection != 0 && image->successiveApproximationHigh == 0) {
-            // AC first visit
-            if (skips > 0) {
-                skips -= 1;
-                return true;
+        if (pos + 1 >= size) {
+            return 0;
+        }
+        const byte marker = data[pos + 1];
+        if (marker == 0xFF) {
+            pos += 1;
+        }
+        else if (marker == EOI) {
+            return pos + 2;
+        }
+        else if (marker == SOI) {
+            return pos;
+        }
+        else if (marker == 0x00 || marker == TEM || (marker >= RST0 && marker <= RST7)) {
+            pos += 2;
+        }
+        else {
+            if (pos + 3 >= size) {
+                return 0;
             }
-            for (uint i = image->startOfSelection; i <= image->endOfSelection; ++i) {
-                byte symbol = getNextSymbol(bitReader, acTable);
-                if (symbol == (byte)-1) {
-                    std::cout << "Error - Invalid AC value\n";
-                    return false;
-                }
+            pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+            inScan = marker == SOS;
+        }
+    }
+}
 
-                byte numZeroes = symbol >> 4;
-                byte coeffLength = symbol & 0x0F;
+// vertical subsampling of the chroma planes of a Y4M frame, which is that
+//   of the image except for 4:4:0, which common Y4M consumers do not
+//   accept, and whose chroma is therefore upsampled to 4:4:4
+uint y4mVerticalSampling(const JPGImage* const image) {
+    return image->horizontalSamplingFactor == 2 ? image->verticalSamplingFactor : 1;
+}
 
-                if (coeffLength != 0) {
-                    if (i + numZeroes > image->endOfSelection) {
-                        std::cout << "Error - Zero run-length exceeded spectral selection\n";
-                        return false;
-                    }
-                    for (uint j = 0; j < numZeroes; ++j, ++i) {
-                        component[zigZagMap[i]] = 0;
-                    }
-                    if (coeffLength > 10) {
-                        std::cout << "Error - AC coefficient length greater than 10\n";
-                        return false;
-                    }
+// chroma subsampling of the planes of a Y4M frame in the naming of Y4M
+//   streams
+std::string y4mChroma(const JPGImage* const image) {
+    if (image->storedComponents() == 1) {
+        return "mono";
+    }
+    if (image->horizontalSamplingFactor == 2) {
+        return image->verticalSamplingFactor == 2 ? "420jpeg" : "422";
+    }
+    return "444";
+}
 
-                    int coeff = bitReader.readBits(coeffLength);
-                    if (coeff == -1) {
-                        std::cout << "Error - Invalid AC value\n";
-                        return false;
-                    }
-                    if (coeff < (1 << (coeffLength - 1))) {
-                        coeff -= (1 << coeffLength) - 1;
-                    }
-                    component[zigZagMap[i]] = coeff << image->successiveApproximationLow;
-                }
-                else {
-                    if (numZeroes == 15) {
-                        if (i + numZeroes > image->endOfSelection) {
-                            std::cout << "Error - Zero run-length exceeded spectral selection\n";
-                            return false;
-                        }
-                        for (uint j = 0; j < numZeroes; ++j, ++i) {
-                            component[zigZagMap[i]] = 0;
-                        }
-                    }
-                    else {
-                        skips = (1 << numZeroes) - 1;
-                        uint extraSkips = bitReader.readBits(numZeroes);
-                        if (extraSkips == (uint)-1) {
-                            std::cout << "Error - Invalid AC value\n";
-                            return false;
-                        }
-                        skips += extraSkips;
-                        break;
-                    }
-                }
+// dequantize and IDCT all MCUs and write their samples into the planar
+//   YCbCr layout of a Y4M frame, one plane after the other, with chroma
+//   planes subsampled as y4mChroma names them
+void renderPlanes(const JPGImage* const image, byte* const buffer) {
+    const uint hSamp = image->horizontalSamplingFactor;
+    const uint vSamp = image->verticalSamplingFactor;
+    const uint planeVSamp = y4mVerticalSampling(image);
+    const uint chromaWidth = (image->width + hSamp - 1) / hSamp;
+    const uint chromaHeight = (image->height + planeVSamp - 1) / planeVSamp;
+    byte* const cbPlane = buffer + (std::size_t)image->width * image->height;
+    byte* const crPlane = cbPlane + (std::size_t)chromaWidth * chromaHeight;
+    auto sample = [](const int value) {
+        const int level = value + 128;
+        return (byte)(level < 0 ? 0 : level > 255 ? 255 : level);
+    };
+
+    for (uint startRow = 0; startRow < image->blockHeight; startRow += vSamp) {
+        const uint endRow = startRow + vSamp < image->blockHeight ? startRow + vSamp : image->blockHeight;
+        dequantize(image, startRow, endRow);
+        inverseDCT(image, startRow, endRow);
+
+        const uint endPixelRow = endRow * 8 < image->height ? endRow * 8 : image->height;
+        for (uint y = startRow * 8; y < endPixelRow; ++y) {
+            byte* const row = buffer + (std::size_t)y * image->width;
+            for (uint x = 0; x < image->width; ++x) {
+                row[x] = sample(image->blockComponent(y / 8, x / 8, 0)[y % 8 * 8 + x % 8]);
             }
-            return true;
         }
-        else { // image->startOfSelection != 0 && image->successiveApproximationHigh != 0
-            // AC refinement
-            int positive = 1 << image->successiveApproximationLow;
-            int negative = ((unsigned)-1) << image->successiveApproximationLow;
-            int i = image->startOfSelection;
-            if (skips == 0) {
-                for (; i <= image->endOfSelection; ++i) {
-                    byte symbol = getNextSymbol(bitReader, acTable);
-                    if (symbol == (byte)-1) {
-                        std::cout << "Error - Invalid AC value\n";
-                        return false;
-                    }
+        if (image->storedComponents() == 1) {
+            continue;
+        }
+        // each chroma block covers one MCU, and upsampled chroma rows
+        //   repeat the row of the block that covers them
+        const uint endChromaRow = endPixelRow / planeVSamp + (endPixelRow % planeVSamp != 0);
+        for (uint y = startRow * 8 / planeVSamp; y < endChromaRow; ++y) {
+            const uint blockY = y * planeVSamp / vSamp;
+            for (uint x = 0; x < chromaWidth; ++x) {
+                const uint blockRow = blockY / 8 * vSamp;
+                const uint blockColumn = x / 8 * hSamp;
+                const uint pixel = blockY % 8 * 8 + x % 8;
+                cbPlane[(std::size_t)y * chromaWidth + x] = sample(image->blockComponent(blockRow, blockColumn, 1)[pixel]);
+                crPlane[(std::size_t)y * chromaWidth + x] = sample(image->blockComponent(blockRow, blockColumn, 2)[pixel]);
+            }
+        }
+    }
+}
+
+// one JPG of an MJPEG stream, along with its parsed header and its
+//   decoded pixels once it has been decoded
+struct MJPEGFrame {
+    std::vector<byte> data;
+    JPGImage header;
+    std::size_t headerSize = 0;
+    std::string error;
+    std::vector<byte> pixels;
+    uint width = 0;
+    uint height = 0;
+    std::string chroma;
+};
+
+// decode a stream of concatenated JPGs, such as MJPEG from a camera, into
+//   raw frames of the requested pixel format or into a Y4M stream
+// the stream is read as it arrives and split on SOI/EOI, and frames are
+//   decoded in parallel, several per thread at a time, then written in order
+// frames whose markers are identical to those of the previous frame reuse
+//   its parsed header and tables
+void decodeMJPEG(const std::string& filename, const DecoderOptions& options) {
+    console() << "Reading MJPEG stream " << filename << "...\n";
+    std::ifstream inFile(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open()) {
+        console() << "Error - Error opening input file\n";
+        return;
+    }
+    const std::string outFilename = !options.outputFilename.empty() ?
+        options.outputFilename :
+        outputFilename(filename, options.y4m ? ".y4m" : ".raw");
+    std::ofstream outFile(outFilename, std::ios::out | std::ios::binary);
+    if (!outFile.is_open()) {
+        console() << "Error - Error opening output file\n";
+        return;
+    }
+    console() << "Writing " << outFilename << "...\n";
 
-                    byte numZeroes = symbol >> 4;
-                    byte coeffLength = symbol & 0x0F;
-                    int coeff = 0;
+    // every frame is decoded on a single thread
+    DecoderOptions frameOptions = options;
+    frameOptions.numThreads = 1;
+    frameOptions.speculative = false;
+    frameOptions.scanCallback = nullptr;
 
-                    if (coeffLength != 0) {
-                        if (coeffLength != 1) {
-                            std::cout << "Error - Invalid AC value\n";
-                            return false;
-                        }
-                        switch (bitReader.readBit()) {
-                        case 1:
-                            coeff = positive;
-                            break;
-                        case 0:
-                            coeff = negative;
-                            break;
-                        default: // -1, data stream is empty
-                            std::cout << "Error - Invalid AC value\n";
-                            return false;
-                        }
-                    }
-                    else {
-                        if (numZeroes != 15) {
-                            skips = 1 << numZeroes;
-                            uint extraSkips = bitReader.readBits(numZeroes);
-                            if (extraSkips == (uint)-1) {
-                                std::cout << "Error - Invalid AC value\n";
-                                return false;
-                            }
-                            skips += extraSkips;
-                            break;
-                        }
-                    }
+    std::vector<byte> cachedHeaderData;
+    JPGImage cachedHeader;
+    uint numFrames = 0;
+    uint numReusedHeaders = 0;
+    std::string streamChroma;
+    uint streamWidth = 0;
+    uint streamHeight = 0;
 
-                    do {
-                        if (component[zigZagMap[i]] != 0) {
-                            switch (bitReader.readBit()) {
-                            case 1:
-                                if ((component[zigZagMap[i]] & positive) == 0) {
-                                    if (component[zigZagMap[i]] >= 0) {
-                                        component[zigZagMap[i]] += positive;
-                                    }
-                                    else {
-                                        component[zigZagMap[i]] += negative;
-                                    }
-                                }
-                                break;
-                            case 0:
-                                // do nothing
-                                break;
-                            default: // -1, data stream is empty
-                                std::cout << "Error - Invalid AC value\n";
-                                return false;
-                            }
-                        }
-                        else {
-                            if (numZeroes == 0) {
-                                break;
-                            }
-                            numZeroes -= 1;
-                        }
+    ThreadPool pool(options.numThreads);
+    std::vector<MJPEGFrame> batch;
+    const std::size_t batchSize = options.numThreads * 2;
 
-                        i += 1;
-                    } while (i <= image->endOfSelection);
+    // the workers print nothing, as their messages would interleave
+    auto decodeFrame = [&](MJPEGFrame& frame) {
+        SilencedOutput silenced;
+        JPGImage* image = decodeJPG(frame.data, frameOptions, &frame.header, frame.headerSize);
+        if (image == nullptr) {
+            frame.error = "Memory error";
+            return;
+        }
+        if (!image->valid || image->coefficients == nullptr) {
+            frame.error = "Invalid frame";
+            freeImage(image);
+            return;
+        }
+        frame.width = image->width;
+        frame.height = image->height;
+        if (options.y4m) {
+            frame.chroma = y4mChroma(image);
+            const uint chromaWidth = (image->width + image->horizontalSamplingFactor - 1) / image->horizontalSamplingFactor;
+            const uint chromaHeight = (image->height + y4mVerticalSampling(image) - 1) / y4mVerticalSampling(image);
+            const std::size_t chromaSize = image->storedComponents() == 1 ? 0 : (std::size_t)chromaWidth * chromaHeight * 2;
+            frame.pixels.resize((std::size_t)image->width * image->height + chromaSize);
+            renderPlanes(image, frame.pixels.data());
+        }
+        else {
+            const std::size_t rowSize = (std::size_t)image->width * bytesPerPixel(options.pixelFormat);
+            frame.pixels.resize(rowSize * image->height);
+            renderImage(image, frame.pixels.data(), rowSize, options.pixelFormat, 1);
+        }
+        freeImage(image);
+    };
 
-                    if (coeff != 0 && i <= image->endOfSelection) {
-                        component[zigZagMap[i]] = coeff;
-                    }
-                }
+    auto decodeBatch = [&]() {
+        for (MJPEGFrame& frame : batch) {
+            if (frame.error.empty()) {
+                pool.run([&] { decodeFrame(frame); });
             }
+        }
+        pool.wait();
 
-            if (skips > 0) {
-                for (; i <= image->endOfSelection; ++i) {
-                    if (component[zigZagMap[i]] != 0) {
-                        switch (bitReader.readBit()) {
-                        case 1:
-                            if ((component[zigZagMap[i]] & positive) == 0) {
-                                if (component[zigZagMap[i]] >= 0) {
-                                    component[zigZagMap[i]] += positive;
-                                }
-                                else {
-                                    component[zigZagMap[i]] += negative;
-                                }
-                            }
-                            break;
-                        case 0:
-                            // do nothing
-                            break;
-                        default: // -1, data stream is empty
-                            std::cout << "Error - Invalid AC value\n";
-                            return false;
-                        }
-                    }
+        for (MJPEGFrame& frame : batch) {
+            numFrames += 1;
+            if (frame.error.empty() && options.y4m) {
+                if (streamChroma.empty()) {
+                    streamChroma = frame.chroma;
+                    streamWidth = frame.width;
+                    streamHeight = frame.height;
+                    outFile << "YUV4MPEG2 W" << streamWidth << " H" << streamHeight << " F30:1 Ip A1:1 C" << streamChroma << '\n';
+                }
+                else if (frame.chroma != streamChroma || frame.width != streamWidth || frame.height != streamHeight) {
+                    frame.error = "Frame size or subsampling differs from the stream";
                 }
-                skips -= 1;
             }
-            return true;
+            if (!frame.error.empty()) {
+                console() << "Frame " << numFrames << ": Error - " << frame.error << '\n';
+                continue;
+            }
+            console() << "Frame " << numFrames << ": " << frame.width << 'x' << frame.height << '\n';
+            if (options.y4m) {
+                outFile << "FRAME\n";
+            }
+            outFile.write((const char*)frame.pixels.data(), frame.pixels.size());
+        }
+        batch.clear();
+    };
+
+    // parse the markers of a new frame, unless they match the previous ones
+    auto addFrame = [&](const byte* const data, const std::size_t size) {
+        batch.emplace_back();
+        MJPEGFrame& frame = batch.back();
+        frame.data.assign(data, data + size);
+        if (!cachedHeaderData.empty() && size >= cachedHeaderData.size() &&
+            std::equal(cachedHeaderData.begin(), cachedHeaderData.end(), data)) {
+            frame.header = cachedHeader;
+            frame.headerSize = cachedHeaderData.size();
+            numReusedHeaders += 1;
+            return;
         }
+        CapturedOutput messages;
+        useStandardHuffmanTables(&frame.header);
+        BitReader bitReader(frame.data.data(), frame.data.size());
+        readFrameHeader(bitReader, &frame.header);
+        if (!frame.header.valid) {
+            frame.error = messages.firstError();
+            return;
+        }
+        frame.headerSize = bitReader.position();
+        cachedHeaderData.assign(data, data + frame.headerSize);
+        cachedHeader = frame.header;
+    };
+
+    std::vector<byte> buffer;
+    bool endOfStream = false;
+    while (!endOfStream) {
+        char chunk[65536];
+        inFile.read(chunk, sizeof(chunk));
+        buffer.insert(buffer.end(), chunk, chunk + inFile.gcount());
+        endOfStream = inFile.gcount() == 0;
+
+        // split off every complete frame, discarding anything between frames
+        std::size_t consumed = 0;
+        while (true) {
+            std::size_t start = consumed;
+            while (start + 1 < buffer.size() && !(buffer[start] == 0xFF && buffer[start + 1] == SOI)) {
+                start += 1;
+            }
+            if (start + 1 >= buffer.size()) {
+                consumed = start;
+                break;
+            }
+            const std::size_t end = findFrameEnd(buffer.data(), buffer.size(), start);
+            if (end == 0) {
+                consumed = start;
+                break;
+            }
+            addFrame(buffer.data() + start, end - start);
+            consumed = end;
+            if (batch.size() >= batchSize) {
+                decodeBatch();
+            }
+        }
+        buffer.erase(buffer.begin(), buffer.begin() + consumed);
+    }
+    decodeBatch();
+    if (buffer.size() > 1) {
+        console() << "Frame " << numFrames + 1 << ": Error - Stream ended within frame\n";
     }
+
+    console() << "Decoded " << numFrames << " frames, reusing the headers of " << numReusedHeaders << '\n';
 }
 
-// decode all the Huffman data and fill all MCUs
-void decodeHuffmanData(BitReader& bitReader, JPGImage* const image) {
-    int previousDCs[3] = { 0 };
-    uint skips = 0;
+// source of the quantized coefficients of the image being written, given
+//   the same block row, block column and component as
+//   JPGImage::blockComponent, which may compute them into a scratch block
+typedef std::function<const int*(const uint, const uint, const uint, int* const)> BlockSource;
 
-    const bool luminanceOnly = image->componentsInScan == 1 && image->colorComponents[0].usedInScan;
-    const uint yStep = luminanceOnly ? 1 : image->verticalSamplingFactor;
-    const uint xStep = luminanceOnly ? 1 : image->horizontalSamplingFactor;
-    const uint restartInterval = image->restartInterval * xStep * yStep;
+// one scan of a JPG, coding the DC coefficients of all components or a band
+//   of the AC coefficients of a single component, along with the bit
+//   positions of successive approximation
+struct ScanScript {
+    int component; // -1 for all components
+    byte startOfSelection;
+    byte endOfSelection;
+    byte successiveApproximationHigh;
+    byte successiveApproximationLow;
+};
 
-    for (uint y = 0; y < image->blockHeight; y += yStep) {
-        for (uint x = 0; x < image->blockWidth; x += xStep) {
-            if (restartInterval != 0 && (y * image->blockWidthReal + x) % restartInterval == 0) {
-                previousDCs[0] = 0;
-                previousDCs[1] = 0;
-                previousDCs[2] = 0;
-                skips = 0;
-                bitReader.align();
+const ScanScript baselineScanScript[] = {
+    { -1, 0, 63, 0, 0 }
+};
+
+// the standard progressive scan scripts, those of the IJG library, which
+//   send the DC and the low AC coefficients first and refine them last
+const ScanScript colorScanScript[] = {
+    { -1, 0,  0, 0, 1 },
+    {  0, 1,  5, 0, 2 },
+    {  2, 1, 63, 0, 1 },
+    {  1, 1, 63, 0, 1 },
+    {  0, 6, 63, 0, 2 },
+    {  0, 1, 63, 2, 1 },
+    { -1, 0,  0, 1, 0 },
+    {  2, 1, 63, 1, 0 },
+    {  1, 1, 63, 1, 0 },
+    {  0, 1, 63, 1, 0 }
+};
+
+const ScanScript grayScanScript[] = {
+    { -1, 0,  0, 0, 1 },
+    {  0, 1,  5, 0, 2 },
+    {  0, 6, 63, 0, 2 },
+    {  0, 1, 63, 2, 1 },
+    { -1, 0,  0, 1, 0 },
+    {  0, 1, 63, 1, 0 }
+};
+
+// encode one scan of the frame of an image, whose luminance uses the
+//   Huffman tables with ID 0 and whose chrominance uses those with ID 1,
+//   or only count its symbols if the coders are counting
+// return false on the first error
+bool encodeScan(
+    const JPGImage* const image,
+    const ScanScript& scan,
+    const bool progressive,
+    const BlockSource& blockComponent,
+    BitWriter& bitWriter,
+    HuffmanCoder* const dcCoders,
+    HuffmanCoder* const acCoders
+) {
+    int scratch[64];
+    int previousDCs[3] = { 0 };
+    EOBRun eobRun;
+    const byte low = scan.successiveApproximationLow;
+    auto encode = [&](const uint y, const uint x, const uint i) {
+        const int* const component = blockComponent(y, x, i, scratch);
+        HuffmanCoder& dcCoder = dcCoders[i == 0 ? 0 : 1];
+        HuffmanCoder& acCoder = acCoders[i == 0 ? 0 : 1];
+        if (!progressive) {
+            return encodeBlockComponent(bitWriter, component, previousDCs[i], dcCoder, acCoder);
+        }
+        if (scan.startOfSelection == 0) {
+            if (scan.successiveApproximationHigh == 0) {
+                // the arithmetic shift rounds toward negative infinity, so
+                //   that refinement only adds bits
+                return encodeDC(bitWriter, component[0] >> low, previousDCs[i], dcCoder);
             }
+            bitWriter.writeBit(component[0] >> low);
+            return true;
+        }
+        if (scan.successiveApproximationHigh == 0) {
+            return encodeACFirst(bitWriter, component, scan.startOfSelection, scan.endOfSelection, low, acCoder, eobRun);
+        }
+        return encodeACRefinement(bitWriter, component, scan.startOfSelection, scan.endOfSelection, low, acCoder, eobRun);
+    };
 
-            for (uint i = 0; i < image->numComponents; ++i) {
-                const ColorComponent& component = image->colorComponents[i];
-                if (component.usedInScan) {
-                    const uint vMax = luminanceOnly ? 1 : component.verticalSamplingFactor;
-                    const uint hMax = luminanceOnly ? 1 : component.horizontalSamplingFactor;
-                    for (uint v = 0; v < vMax; ++v) {
-                        for (uint h = 0; h < hMax; ++h) {
-                            if (!decodeBlockComponent(
-                                    image,
-                                    bitReader,
-                                    image->blocks[(y + v) * image->blockWidthReal + (x + h)][i],
-                                    previousDCs[i],
-                                    skips,
-                                    image->huffmanDCTables[component.huffmanDCTableID],
-                                    image->huffmanACTables[component.huffmanACTableID])) {
-                                return;
+    if (scan.component < 0 && image->numComponents > 1) {
+        // each MCU holds the blocks of every component
+        for (uint y = 0; y < image->blockHeight; y += image->verticalSamplingFactor) {
+            for (uint x = 0; x < image->blockWidth; x += image->horizontalSamplingFactor) {
+                for (uint i = 0; i < image->numComponents; ++i) {
+                    const ColorComponent& component = image->colorComponents[i];
+                    for (uint v = 0; v < component.verticalSamplingFactor; ++v) {
+                        for (uint h = 0; h < component.horizontalSamplingFactor; ++h) {
+                            if (!encode(y + v, x + h, i)) {
+                                return false;
                             }
                         }
                     }
@@ -1126,343 +4483,798 @@ void decodeHuffmanData(BitReader& bitReader, JPGImage* const image) {
             }
         }
     }
-}
-
-// dequantize a block component based on a quantization table
-void dequantizeBlockComponent(const QuantizationTable& qTable, int* const component) {
-    for (uint i = 0; i < 64; ++i) {
-        component[i] *= qTable.table[i];
-    }
-}
-
-// dequantize all MCUs
-void dequantize(const JPGImage* const image) {
-    for (uint y = 0; y < image->blockHeight; y += image->verticalSamplingFactor) {
-        for (uint x = 0; x < image->blockWidth; x += image->horizontalSamplingFactor) {
-            for (uint i = 0; i < image->numComponents; ++i) {
-                const ColorComponent& component = image->colorComponents[i];
-                for (uint v = 0; v < component.verticalSamplingFactor; ++v) {
-                    for (uint h = 0; h < component.horizontalSamplingFactor; ++h) {
-                        dequantizeBlockComponent(image->quantizationTables[component.quantizationTableID],
-                            image->blocks[(y + v) * image->blockWidthReal + (x + h)][i]);
-                    }
+    else {
+        // a single component is coded block by block, covering only the
+        //   blocks of the component that hold part of the image
+        const uint i = scan.component < 0 ? 0 : scan.component;
+        const ColorComponent& component = image->colorComponents[i];
+        const uint v = component.verticalSamplingFactor;
+        const uint h = component.horizontalSamplingFactor;
+        const uint V = image->verticalSamplingFactor;
+        const uint H = image->horizontalSamplingFactor;
+        const uint rows = (image->height * v + 8 * V - 1) / (8 * V);
+        const uint columns = (image->width * h + 8 * H - 1) / (8 * H);
+        for (uint y = 0; y < rows; ++y) {
+            for (uint x = 0; x < columns; ++x) {
+                if (!encode(y / v * V + y % v, x / h * H + x % h, i)) {
+                    return false;
                 }
             }
         }
     }
+    if (progressive && scan.startOfSelection != 0) {
+        return encodeEOBRun(bitWriter, acCoders[scan.component == 0 ? 0 : 1], eobRun);
+    }
+    return true;
 }
 
-// perform 1-D IDCT on all columns and rows of a block component
-//   resulting in 2-D IDCT
-void inverseDCTBlockComponent(int* const component) {
-
-    float intermediate[64];
-
-    for (uint i = 0; i < 8; ++i) {
-        const float g0 = component[0 * 8 + i] * s0;
-        const float g1 = component[4 * 8 + i] * s4;
-        const float g2 = component[2 * 8 + i] * s2;
-        const float g3 = component[6 * 8 + i] * s6;
-        const float g4 = component[5 * 8 + i] * s5;
-        const float g5 = component[1 * 8 + i] * s1;
-        const float g6 = component[7 * 8 + i] * s7;
-        const float g7 = component[3 * 8 + i] * s3;
-
-        const float f0 = g0;
-        const float f1 = g1;
-        const float f2 = g2;
-        const float f3 = g3;
-        const float f4 = g4 - g7;
-        const float f5 = g5 + g6;
-        const float f6 = g5 - g6;
-        const float f7 = g4 + g7;
+// write a baseline or progressive JPG of the frame of an image, whose
+//   quantized coefficients come from blockComponent
+// coefficients are never touched by an IDCT or FDCT, so nothing is lost
+// every scan is coded with optimal Huffman tables built from the symbols
+//   it contains, and progressive JPGs follow the standard scan script
+void writeJPG(const JPGImage* const image, const std::string& filename, const bool progressive, const BlockSource& blockComponent) {
+    // the file is built in memory, so that nothing is written on errors
+    std::ostringstream out(std::ios::out | std::ios::binary);
 
-        const float e0 = f0;
-        const float e1 = f1;
-        const float e2 = f2 - f3;
-        const float e3 = f2 + f3;
-        const float e4 = f4;
-        const float e5 = f5 - f7;
-        const float e6 = f6;
-        const float e7 = f5 + f7;
-        const float e8 = f4 + f6;
+    // SOI
+    out.put(0xFF);
+    out.put(SOI);
 
-        const float d0 = e0;
-        const float d1 = e1;
-        const float d2 = e2 * m1;
-        const float d3 = e3;
-        const float d4 = e4 * m2;
-        const float d5 = e5 * m3;
-        const float d6 = e6 * m4;
-        const float d7 = e7;
-        const float d8 = e8 * m5;
+    // APP0
+    writeAPP0(out);
 
-        const float c0 = d0 + d1;
-        const float c1 = d0 - d1;
-        const float c2 = d2 - d3;
-        const float c3 = d3;
-        const float c4 = d4 + d8;
-        const float c5 = d5 + d7;
-        const float c6 = d6 - d8;
-        const float c7 = d7;
-        const float c8 = c5 - c6;
+    // DQT
+    bool tableWritten[4] = { false };
+    bool precision16 = false;
+    for (uint i = 0; i < image->numComponents; ++i) {
+        const byte tableID = image->colorComponents[i].quantizationTableID;
+        if (!tableWritten[tableID]) {
+            writeQuantizationTable(out, tableID, image->quantizationTables[tableID]);
+            tableWritten[tableID] = true;
+            precision16 |= needsPrecision16(image->quantizationTables[tableID]);
+        }
+    }
 
-        const float b0 = c0 + c3;
-        const float b1 = c1 + c2;
-        const float b2 = c1 - c2;
-        const float b3 = c0 - c3;
-        const float b4 = c4 - c8;
-        const float b5 = c8;
-        const float b6 = c6 - c7;
-        const float b7 = c7;
+    // SOF
+    // baseline frames only allow 8-bit quantization tables, so sequential
+    //   frames with a 16-bit one are extended, as libjpeg writes them
+    out.put(0xFF);
+    out.put(progressive ? SOF2 : precision16 ? SOF1 : SOF0);
+    putShort(out, 8 + 3 * image->numComponents);
+    out.put(8);
+    putShort(out, image->height);
+    putShort(out, image->width);
+    out.put(image->numComponents);
+    for (uint i = 0; i < image->numComponents; ++i) {
+        const ColorComponent& component = image->colorComponents[i];
+        out.put(i + 1);
+        out.put(component.horizontalSamplingFactor << 4 | component.verticalSamplingFactor);
+        out.put(component.quantizationTableID);
+    }
 
-        intermediate[0 * 8 + i] = b0 + b7;
-        intermediate[1 * 8 + i] = b1 + b6;
-        intermediate[2 * 8 + i] = b2 + b5;
-        intermediate[3 * 8 + i] = b3 + b4;
-        intermediate[4 * 8 + i] = b3 - b4;
-        intermediate[5 * 8 + i] = b2 - b5;
-        intermediate[6 * 8 + i] = b1 - b6;
-        intermediate[7 * 8 + i] = b0 - b7;
+    const ScanScript* scans = baselineScanScript;
+    uint numScans = 1;
+    if (progressive) {
+        scans = image->numComponents == 1 ? grayScanScript : colorScanScript;
+        numScans = image->numComponents == 1 ?
+            sizeof(grayScanScript) / sizeof(ScanScript) :
+            sizeof(colorScanScript) / sizeof(ScanScript);
     }
-    for (uint i = 0; i < 8; ++i) {
-        const float g0 = intermediate[i * 8 + 0] * s0;
-        const float g1 = intermediate[i * 8 + 4] * s4;
-        const float g2 = intermediate[i * 8 + 2] * s2;
-        const float g3 = intermediate[i * 8 + 6] * s6;
-        const float g4 = intermediate[i * 8 + 5] * s5;
-        const float g5 = intermediate[i * 8 + 1] * s1;
-        const float g6 = intermediate[i * 8 + 7] * s7;
-        const float g7 = intermediate[i * 8 + 3] * s3;
+    for (uint s = 0; s < numScans; ++s) {
+        const ScanScript& scan = scans[s];
+        const uint firstComponent = scan.component < 0 ? 0 : scan.component;
+        const uint endComponent = scan.component < 0 ? image->numComponents : scan.component + 1;
 
-        const float f0 = g0;
-        const float f1 = g1;
-        const float f2 = g2;
-        const float f3 = g3;
-        const float f4 = g4 - g7;
-        const float f5 = g5 + g6;
-        const float f6 = g5 - g6;
-        const float f7 = g4 + g7;
+        // count the symbols of the scan and build its tables, except for
+        //   DC refinement scans, which only hold raw bits
+        HuffmanCoder dcCoders[2];
+        HuffmanCoder acCoders[2];
+        std::vector<byte> huffmanData;
+        BitWriter bitWriter(huffmanData);
+        const bool codesDC = scan.startOfSelection == 0 && scan.successiveApproximationHigh == 0;
+        const bool codesAC = scan.endOfSelection != 0;
+        if (codesDC || codesAC) {
+            for (uint t = 0; t < 2; ++t) {
+                dcCoders[t].counting = true;
+                acCoders[t].counting = true;
+            }
+            if (!encodeScan(image, scan, progressive, blockComponent, bitWriter, dcCoders, acCoders)) {
+                return;
+            }
+            // DHT
+            const bool usesTable[2] = { firstComponent == 0, endComponent > 1 };
+            for (uint t = 0; t < 2; ++t) {
+                if (!usesTable[t]) {
+                    continue;
+                }
+                if (codesDC) {
+                    const HuffmanTable hTable = optimalHuffmanTable(dcCoders[t].frequencies);
+                    writeHuffmanTable(out, 0, t, hTable);
+                    dcCoders[t].encoding = huffmanEncoding(hTable);
+                }
+                if (codesAC) {
+                    const HuffmanTable hTable = optimalHuffmanTable(acCoders[t].frequencies);
+                    writeHuffmanTable(out, 1, t, hTable);
+                    acCoders[t].encoding = huffmanEncoding(hTable);
+                }
+            }
+            for (uint t = 0; t < 2; ++t) {
+                dcCoders[t].counting = false;
+                acCoders[t].counting = false;
+            }
+        }
 
-        const float e0 = f0;
-        const float e1 = f1;
-        const float e2 = f2 - f3;
-        const float e3 = f2 + f3;
-        const float e4 = f4;
-        const float e5 = f5 - f7;
-        const float e6 = f6;
-        const float e7 = f5 + f7;
-        const float e8 = f4 + f6;
+        // SOS
+        out.put(0xFF);
+        out.put(SOS);
+        putShort(out, 6 + 2 * (endComponent - firstComponent));
+        out.put(endComponent - firstComponent);
+        for (uint i = firstComponent; i < endComponent; ++i) {
+            out.put(i + 1);
+            out.put(i == 0 ? 0x00 : 0x11);
+        }
+        out.put(scan.startOfSelection);
+        out.put(scan.endOfSelection);
+        out.put(scan.successiveApproximationHigh << 4 | scan.successiveApproximationLow);
 
-        const float d0 = e0;
-        const float d1 = e1;
-        const float d2 = e2 * m1;
-        const float d3 = e3;
-        const float d4 = e4 * m2;
-        const float d5 = e5 * m3;
-        const float d6 = e6 * m4;
-        const float d7 = e7;
-        const float d8 = e8 * m5;
+        // ECS
+        if (!encodeScan(image, scan, progressive, blockComponent, bitWriter, dcCoders, acCoders)) {
+            return;
+        }
+        bitWriter.flush();
+        out.write((char*)huffmanData.data(), huffmanData.size());
+    }
 
-        const float c0 = d0 + d1;
-        const float c1 = d0 - d1;
-        const float c2 = d2 - d3;
-        const float c3 = d3;
-        const float c4 = d4 + d8;
-        const float c5 = d5 + d7;
-        const float c6 = d6 - d8;
-        const float c7 = d7;
-        const float c8 = c5 - c6;
+    // EOI
+    out.put(0xFF);
+    out.put(EOI);
 
-        const float b0 = c0 + c3;
-        const float b1 = c1 + c2;
-        const float b2 = c1 - c2;
-        const float b3 = c0 - c3;
-        const float b4 = c4 - c8;
-        const float b5 = c8;
-        const float b6 = c6 - c7;
-        const float b7 = c7;
+    console() << "Writing " << filename << "...\n";
+    std::ofstream outFile(filename, std::ios::out | std::ios::binary);
+    if (!outFile.is_open()) {
+        console() << "Error - Error opening output file\n";
+        return;
+    }
+    const std::string contents = out.str();
+    outFile.write(contents.data(), contents.size());
+}
 
-        component[i * 8 + 0] = b0 + b7 + 0.5f;
-        component[i * 8 + 1] = b1 + b6 + 0.5f;
-        component[i * 8 + 2] = b2 + b5 + 0.5f;
-        component[i * 8 + 3] = b3 + b4 + 0.5f;
-        component[i * 8 + 4] = b3 - b4 + 0.5f;
-        component[i * 8 + 5] = b2 - b5 + 0.5f;
-        component[i * 8 + 6] = b1 - b6 + 0.5f;
-        component[i * 8 + 7] = b0 - b7 + 0.5f;
+// lossless transform of the coefficients, made of mirrors of the input
+//   followed by a transpose, as every rotation and flip can be
+struct Transform {
+    bool mirrorX = false;
+    bool mirrorY = false;
+    bool transpose = false;
+};
+
+// return whether name is a known transform, filling in its steps
+bool parseTransform(const std::string& name, Transform& transform) {
+    transform = Transform();
+    if (name == "none") {
+    }
+    else if (name == "flip-h") {
+        transform.mirrorX = true;
+    }
+    else if (name == "flip-v") {
+        transform.mirrorY = true;
+    }
+    else if (name == "rotate-180") {
+        transform.mirrorX = true;
+        transform.mirrorY = true;
+    }
+    else if (name == "transpose") {
+        transform.transpose = true;
+    }
+    else if (name == "rotate-90") {
+        transform.mirrorY = true;
+        transform.transpose = true;
+    }
+    else if (name == "rotate-270") {
+        transform.mirrorX = true;
+        transform.transpose = true;
+    }
+    else if (name == "transverse") {
+        transform.mirrorX = true;
+        transform.mirrorY = true;
+        transform.transpose = true;
     }
+    else {
+        return false;
+    }
+    return true;
 }
 
-// perform IDCT on all MCUs
-void inverseDCT(const JPGImage* const image) {
-    for (uint y = 0; y < image->blockHeight; y += image->verticalSamplingFactor) {
-        for (uint x = 0; x < image->blockWidth; x += image->horizontalSamplingFactor) {
-            for (uint i = 0; i < image->numComponents; ++i) {
-                const ColorComponent& component = image->colorComponents[i];
-                for (uint v = 0; v < component.verticalSamplingFactor; ++v) {
-                    for (uint h = 0; h < component.horizontalSamplingFactor; ++h) {
-                        inverseDCTBlockComponent(image->blocks[(y + v) * image->blockWidthReal + (x + h)][i]);
-                    }
-                }
-            }
+// transform that undoes each EXIF orientation, so that the image is
+//   stored upright
+const char* const orientationTransforms[] = {
+    "none", "none", "flip-h", "rotate-180", "flip-v", "transpose", "rotate-90", "transverse", "rotate-270"
+};
+
+// return the orientation tag of IFD0 of an EXIF segment, or 1 if it has none
+uint readEXIFOrientation(const byte* const tiff, const std::size_t size) {
+    if (size < 8 || !((tiff[0] == 'I' && tiff[1] == 'I') || (tiff[0] == 'M' && tiff[1] == 'M'))) {
+        return 1;
+    }
+    const bool bigEndian = tiff[0] == 'M';
+    const std::size_t ifd = getTIFFInt(tiff + 4, bigEndian);
+    if (ifd + 2 > size) {
+        return 1;
+    }
+    const uint numEntries = getTIFFShort(tiff + ifd, bigEndian);
+    for (uint i = 0; i < numEntries && ifd + 2 + (i + 1) * 12 <= size; ++i) {
+        const byte* const entry = tiff + ifd + 2 + i * 12;
+        if (getTIFFShort(entry, bigEndian) == 0x0112) { // Orientation
+            const uint orientation = getTIFFShort(entry + 8, bigEndian);
+            return orientation >= 1 && orientation <= 8 ? orientation : 1;
         }
     }
+    return 1;
 }
 
-// convert all pixels in a block from YCbCr color space to RGB
-void YCbCrToRGBBlock(Block& yBlock, const Block& cbcrBlock, const uint vSamp, const uint hSamp, const uint v, const uint h) {
-    for (uint y = 7; y < 8; --y) {
-        for (uint x = 7; x < 8; --x) {
-            const uint pixel = y * 8 + x;
-            const uint cbcrPixelRow = y / vSamp + 4 * v;
-            const uint cbcrPixelColumn = x / hSamp + 4 * h;
-            const uint cbcrPixel = cbcrPixelRow * 8 + cbcrPixelColumn;
-            int r = yBlock.y[pixel]                                    + 1.402f * cbcrBlock.cr[cbcrPixel] + 128;
-            int g = yBlock.y[pixel] - 0.344f * cbcrBlock.cb[cbcrPixel] - 0.714f * cbcrBlock.cr[cbcrPixel] + 128;
-            int b = yBlock.y[pixel] + 1.772f * cbcrBlock.cb[cbcrPixel]                                    + 128;
-            if (r < 0)   r = 0;
-            if (r > 255) r = 255;
-            if (g < 0)   g = 0;
-            if (g > 255) g = 255;
-            if (b < 0)   b = 0;
-            if (b > 255) b = 255;
-            yBlock.r[pixel] = r;
-            yBlock.g[pixel] = g;
-            yBlock.b[pixel] = b;
+// return the EXIF orientation of a JPG, from the APP segments at its start
+uint findOrientation(const std::vector<byte>& data) {
+    std::size_t pos = 2;
+    while (pos + 4 <= data.size() && data[pos] == 0xFF) {
+        const byte marker = data[pos + 1];
+        // any number of 0xFF in a row is allowed and should be ignored
+        if (marker == 0xFF) {
+            pos += 1;
+            continue;
+        }
+        // the EXIF segment only ever precedes the frame
+        if (!(marker >= APP0 && marker <= APP15) && marker != COM) {
+            break;
+        }
+        const std::size_t length = (data[pos + 2] << 8) | data[pos + 3];
+        if (length < 2 || pos + 2 + length > data.size()) {
+            break;
         }
+        const byte* const segment = data.data() + pos + 4;
+        const std::size_t segmentSize = length - 2;
+        if (marker == APP1 && segmentSize >= 6 && std::equal(segment, segment + 6, "Exif\0")) {
+            return readEXIFOrientation(segment + 6, segmentSize - 6);
+        }
+        pos += 2 + length;
     }
+    return 1;
 }
 
-// convert all pixels from YCbCr color space to RGB
-void YCbCrToRGB(const JPGImage* const image) {
-    const uint vSamp = image->verticalSamplingFactor;
-    const uint hSamp = image->horizontalSamplingFactor;
-    for (uint y = 0; y < image->blockHeight; y += vSamp) {
-        for (uint x = 0; x < image->blockWidth; x += hSamp) {
-            const Block& cbcrBlock = image->blocks[y * image->blockWidthReal + x];
-            for (uint v = vSamp - 1; v < vSamp; --v) {
-                for (uint h = hSamp - 1; h < hSamp; --h) {
-                    Block& yBlock = image->blocks[(y + v) * image->blockWidthReal + (x + h)];
-                    YCbCrToRGBBlock(yBlock, cbcrBlock, vSamp, hSamp, v, h);
+// frame of an image after a transform, whose block components are
+//   transformed from those of the image one at a time as they are written,
+//   so that no second copy of the coefficients is needed
+// mirrored dimensions are trimmed to whole MCUs, like jpegtran -trim does,
+//   as the partial MCU at the right or bottom edge would otherwise end up
+//   at the left or top edge, padding and all
+class TransformedImage {
+private:
+    const JPGImage* const image;
+    const Transform transform;
+    // sampling factors of the image, which are 1x1 for a single component
+    uint vMax = 1;
+    uint hMax = 1;
+    // dimensions of the image after trimming
+    uint height = 0;
+    uint width = 0;
+    // within a block, a transpose swaps the coefficients across the
+    //   diagonal, and a mirror negates the odd frequencies along its axis
+    uint source[64];
+    int sign[64];
+
+public:
+    JPGImage frame;
+
+    TransformedImage(const JPGImage* const i, const Transform& t) :
+    image(i),
+    transform(t)
+    {
+        // the stored components become the components of the frame
+        frame.numComponents = image->storedComponents();
+        if (frame.numComponents > 1) {
+            vMax = image->verticalSamplingFactor;
+            hMax = image->horizontalSamplingFactor;
+        }
+        height = image->height;
+        width = image->width;
+        if (transform.mirrorY) {
+            height -= height % (8 * vMax);
+        }
+        if (transform.mirrorX) {
+            width -= width % (8 * hMax);
+        }
+        if (height == 0 || width == 0) {
+            console() << "Error - Image smaller than one MCU cannot be mirrored\n";
+            frame.valid = false;
+            return;
+        }
+
+        frame.height = transform.transpose ? width : height;
+        frame.width = transform.transpose ? height : width;
+        frame.verticalSamplingFactor = transform.transpose ? hMax : vMax;
+        frame.horizontalSamplingFactor = transform.transpose ? vMax : hMax;
+        frame.blockHeight = (frame.height + 7) / 8;
+        frame.blockWidth = (frame.width + 7) / 8;
+        frame.blockHeightReal = frame.blockHeight + frame.blockHeight % frame.verticalSamplingFactor;
+        frame.blockWidthReal = frame.blockWidth + frame.blockWidth % frame.horizontalSamplingFactor;
+        for (uint j = 0; j < frame.numComponents; ++j) {
+            ColorComponent& component = frame.colorComponents[j];
+            component = image->colorComponents[j];
+            component.verticalSamplingFactor = j == 0 ? frame.verticalSamplingFactor : 1;
+            component.horizontalSamplingFactor = j == 0 ? frame.horizontalSamplingFactor : 1;
+        }
+
+        // a transposed coefficient keeps its quantization step only if the
+        //   tables are transposed along with it
+        for (uint j = 0; j < 4; ++j) {
+            frame.quantizationTables[j] = image->quantizationTables[j];
+            if (transform.transpose) {
+                for (uint k = 0; k < 64; ++k) {
+                    frame.quantizationTables[j].table[k] = image->quantizationTables[j].table[k % 8 * 8 + k / 8];
                 }
             }
         }
+
+        for (uint k = 0; k < 64; ++k) {
+            source[k] = transform.transpose ? k % 8 * 8 + k / 8 : k;
+            const bool oddRow = source[k] / 8 % 2 == 1;
+            const bool oddColumn = source[k] % 2 == 1;
+            sign[k] = (transform.mirrorY && oddRow) != (transform.mirrorX && oddColumn) ? -1 : 1;
+        }
     }
-}
 
-// helper function to write a 4-byte integer in little-endian
-void putInt(byte*& bufferPos, const uint v) {
-    *bufferPos++ = v >>  0;
-    *bufferPos++ = v >>  8;
-    *bufferPos++ = v >> 16;
-    *bufferPos++ = v >> 24;
-}
+    // transform the block component of color component i of the frame that
+    //   covers block row y and column x into scratch
+    const int* blockComponent(const uint y, const uint x, const uint i, int* const scratch) const {
+        // blocks are mapped per component, from and to the blocks of the
+        //   MCUs that contain them
+        const uint v = i == 0 ? vMax : 1;
+        const uint h = i == 0 ? hMax : 1;
+        const uint frameV = frame.colorComponents[i].verticalSamplingFactor;
+        const uint frameH = frame.colorComponents[i].horizontalSamplingFactor;
+        const uint row = y / frame.verticalSamplingFactor * frameV + y % frame.verticalSamplingFactor;
+        const uint column = x / frame.horizontalSamplingFactor * frameH + x % frame.horizontalSamplingFactor;
+        uint sourceRow = transform.transpose ? column : row;
+        uint sourceColumn = transform.transpose ? row : column;
+        if (transform.mirrorY) {
+            sourceRow = height / (8 * vMax) * v - 1 - sourceRow;
+        }
+        if (transform.mirrorX) {
+            sourceColumn = width / (8 * hMax) * h - 1 - sourceColumn;
+        }
+        const uint sourceV = image->colorComponents[i].verticalSamplingFactor;
+        const uint sourceH = image->colorComponents[i].horizontalSamplingFactor;
+        const int* const in = image->blockComponent(
+            sourceRow / sourceV * image->verticalSamplingFactor + sourceRow % sourceV,
+            sourceColumn / sourceH * image->horizontalSamplingFactor + sourceColumn % sourceH,
+            i);
+        if (!transform.transpose && !transform.mirrorX && !transform.mirrorY) {
+            return in;
+        }
+        for (uint k = 0; k < 64; ++k) {
+            scratch[k] = sign[k] * in[source[k]];
+        }
+        return scratch;
+    }
+};
 
-// helper function to write a 2-byte short integer in little-endian
-void putShort(byte*& bufferPos, const uint v) {
-    *bufferPos++ = v >> 0;
-    *bufferPos++ = v >> 8;
-}
+// frame of an image requantized with the IJG tables of a lower quality,
+//   whose block components are requantized from those of the image one at
+//   a time as they are written, without an IDCT or FDCT
+// each coefficient is dequantized with the step of the image and quantized
+//   again with the new step, rounding to the nearest, and coefficients past
+//   zig-zag position maxBand are dropped
+// new steps are never smaller than those of the image, which would only
+//   make the file larger without bringing back what was lost
+class RequantizedImage {
+private:
+    const BlockSource source;
+    const byte maxBand;
+    // for each table, the steps of the image and the new steps
+    uint sourceSteps[4][64];
+    uint steps[4][64];
+    // whether coefficients past maxBand are dropped, in natural order
+    bool dropped[64];
 
-// write all the pixels in the MCUs to a BMP file
-void writeBMP(const JPGImage* const image, const std::string& filename) {
-    // open file
-    std::cout << "Writing " << filename << "...\n";
-    std::ofstream outFile(filename, std::ios::out | std::ios::binary);
-    if (!outFile.is_open()) {
-        std::cout << "Error - Error opening output file\n";
-        return;
+public:
+    JPGImage frame;
+
+    RequantizedImage(const JPGImage* const image, const BlockSource& s, const uint quality, const byte band) :
+    source(s),
+    maxBand(band)
+    {
+        frame = *image;
+        bool chroma[4] = { false };
+        for (uint i = 1; i < frame.numComponents; ++i) {
+            chroma[frame.colorComponents[i].quantizationTableID] = true;
+        }
+        // a table shared by the luminance takes the luminance steps
+        chroma[frame.colorComponents[0].quantizationTableID] = false;
+
+        // a quality of 0 keeps the steps, only dropping coefficients
+        for (uint t = 0; t < 4; ++t) {
+            const QuantizationTable target = quality == 0 ?
+                QuantizationTable() :
+                scaleQuantizationTable(chroma[t] ? qTableCbCr50 : qTableY50, quality);
+            for (uint k = 0; k < 64; ++k) {
+                sourceSteps[t][k] = image->quantizationTables[t].table[k];
+                steps[t][k] = std::max(sourceSteps[t][k], target.table[k]);
+                frame.quantizationTables[t].table[k] = steps[t][k];
+            }
+        }
+        for (uint k = 0; k < 64; ++k) {
+            dropped[zigZagMap[k]] = k > maxBand;
+        }
     }
 
-    const uint paddingSize = image->width % 4;
-    const uint size = 14 + 12 + image->height * image->width * 3 + paddingSize * image->height;
+    const int* blockComponent(const uint y, const uint x, const uint i, int* const scratch) const {
+        const int* const in = source(y, x, i, scratch);
+        const uint t = frame.colorComponents[i].quantizationTableID;
+        for (uint k = 0; k < 64; ++k) {
+            const int value = in[k];
+            if (value == 0 || dropped[k]) {
+                scratch[k] = 0;
+            }
+            else if (steps[t][k] == sourceSteps[t][k]) {
+                scratch[k] = value;
+            }
+            else {
+                const uint magnitude = ((uint)std::abs(value) * sourceSteps[t][k] + steps[t][k] / 2) / steps[t][k];
+                scratch[k] = value < 0 ? -(int)magnitude : magnitude;
+            }
+        }
+        return scratch;
+    }
+};
 
-    byte* buffer = new (std::nothrow) byte[size];
-    if (buffer == nullptr) {
-        std::cout << "Error - Memory error\n";
-        outFile.close();
+// rotate or flip a JPG by permuting and transposing its blocks and negating
+//   their coefficients, and requantize them to a lower quality if asked to,
+//   writing the result as a baseline or progressive JPG to
+//   file.<transform>.jpg, or to file.q<quality>.jpg or
+//   file.<baseline|progressive>.jpg without a transform
+// the auto transform undoes the EXIF orientation, which is not carried
+//   over, so that the result is displayed the same way
+void transformJPG(const std::string& filename, const DecoderOptions& options) {
+    console() << "Reading " << filename << "...\n";
+    std::vector<byte> data;
+    if (!readFile(filename, data, options.inputLimit != 0 ? options.inputLimit + 1 : -1)) {
+        console() << "Error - Error opening input file\n";
+        return;
+    }
+    if (options.inputLimit != 0 && data.size() > options.inputLimit) {
+        console() << "Error - File larger than the input limit of " << options.inputLimit << " bytes\n";
         return;
     }
-    byte* bufferPos = buffer;
 
-    *bufferPos++ = 'B';
-    *bufferPos++ = 'M';
-    putInt(bufferPos, size);
-    putInt(bufferPos, 0);
-    putInt(bufferPos, 0x1A);
-    putInt(bufferPos, 12);
-    putShort(bufferPos, image->width);
-    putShort(bufferPos, image->height);
-    putShort(bufferPos, 1);
-    putShort(bufferPos, 24);
+    std::string name = options.transform.empty() ? "none" : options.transform;
+    if (name == "auto") {
+        const uint orientation = findOrientation(data);
+        name = orientationTransforms[orientation];
+        console() << "EXIF orientation " << orientation << ", transform: " << name << '\n';
+    }
+    Transform transform;
+    parseTransform(name, transform);
 
-    for (uint y = image->height - 1; y < image->height; --y) {
-        const uint blockRow = y / 8;
-        const uint pixelRow = y % 8;
-        for (uint x = 0; x < image->width; ++x) {
-            const uint blockColumn = x / 8;
-            const uint pixelColumn = x % 8;
-            const uint blockIndex = blockRow * image->blockWidthReal + blockColumn;
-            const uint pixelIndex = pixelRow * 8 + pixelColumn;
-            *bufferPos++ = image->blocks[blockIndex].b[pixelIndex];
-            *bufferPos++ = image->blocks[blockIndex].g[pixelIndex];
-            *bufferPos++ = image->blocks[blockIndex].r[pixelIndex];
+    JPGImage* const image = decodeJPG(data, options);
+    if (image == nullptr) {
+        return;
+    }
+    if (image->coefficients == nullptr) {
+        delete image;
+        return;
+    }
+    if (image->valid) {
+        const TransformedImage transformed(image, transform);
+        if (transformed.frame.valid) {
+            const JPGImage* frame = &transformed.frame;
+            BlockSource blockComponent = [&](const uint y, const uint x, const uint i, int* const scratch) {
+                return transformed.blockComponent(y, x, i, scratch);
+            };
+            std::string suffix = options.transform.empty() ? options.transcode : options.transform;
+            const RequantizedImage requantized(frame, blockComponent, options.requantizeQuality, options.requantizeBand);
+            if (options.requantizeQuality != 0 || options.requantizeBand != 63) {
+                frame = &requantized.frame;
+                blockComponent = [&](const uint y, const uint x, const uint i, int* const scratch) {
+                    return requantized.blockComponent(y, x, i, scratch);
+                };
+                if (options.transform.empty()) {
+                    suffix = options.requantizeQuality != 0 ?
+                        "q" + std::to_string(options.requantizeQuality) :
+                        "band" + std::to_string(options.requantizeBand);
+                }
+            }
+            writeJPG(
+                frame,
+                options.outputFilename.empty() ? outputFilename(filename, "." + suffix + ".jpg") : options.outputFilename,
+                options.transcode == "progressive",
+                blockComponent);
+        }
+    }
+    freeImage(image);
+}
+
+// split the command line into options and input filenames
+bool parseArguments(int argc, char** argv, DecoderOptions& options, std::vector<std::string>& filenames) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (arg == "-shm" && i + 1 < argc) {
+            options.sharedMemoryName = argv[++i];
+        }
+        else if (arg == "-fd" && i + 1 < argc) {
+            options.sharedMemoryFD = std::atoi(argv[++i]);
+        }
+        else if (arg == "-stride" && i + 1 < argc) {
+            options.rowStride = std::atoi(argv[++i]);
+        }
+        else if (arg == "-preview" && i + 1 < argc) {
+            options.previewInterval = std::atoi(argv[++i]);
+        }
+        else if (arg == "-preview-dc") {
+            options.previewDCOnly = true;
+            if (options.previewInterval == 0) {
+                options.previewInterval = 1;
+            }
+        }
+        else if (arg == "-max-scans" && i + 1 < argc) {
+            options.maxScans = std::atoi(argv[++i]);
+        }
+        else if (arg == "-max-bytes" && i + 1 < argc) {
+            options.maxBytes = std::atoll(argv[++i]);
+        }
+        else if (arg == "-max-band" && i + 1 < argc) {
+            const int band = std::atoi(argv[++i]);
+            if (band < 0 || band > 63) {
+                console() << "Error - Spectral band must be 0-63: " << argv[i] << '\n';
+                return false;
+            }
+            options.maxSpectralBand = band;
+        }
+        else if (arg == "-dc-only") {
+            options.dcOnly = true;
+        }
+        else if (arg == "-threads" && i + 1 < argc) {
+            const int numThreads = std::atoi(argv[++i]);
+            if (numThreads < 1) {
+                console() << "Error - Number of threads must be at least 1: " << argv[i] << '\n';
+                return false;
+            }
+            options.numThreads = numThreads;
+        }
+        else if (arg == "-simd" && i + 1 < argc) {
+            options.simdLevel = argv[++i];
+        }
+        else if (arg == "-speculative") {
+            options.speculative = true;
+        }
+        else if (arg == "-verify") {
+            options.speculative = true;
+            options.verifySpeculative = true;
+        }
+        else if (arg == "-probe") {
+            options.probe = true;
+        }
+        else if (arg == "-validate") {
+            options.validate = true;
+        }
+        else if (arg == "-thumbnail") {
+            options.thumbnail = true;
+        }
+        else if (arg == "-analyze") {
+            options.analyze = true;
+        }
+        else if (arg == "-limit-pixels" && i + 1 < argc) {
+            options.pixelLimit = std::atoll(argv[++i]);
+        }
+        else if (arg == "-limit-memory" && i + 1 < argc) {
+            options.memoryLimit = (std::size_t)std::atoll(argv[++i]) * 1024 * 1024;
+        }
+        else if (arg == "-limit-scans" && i + 1 < argc) {
+            options.scanLimit = std::atoi(argv[++i]);
+        }
+        else if (arg == "-limit-input" && i + 1 < argc) {
+            options.inputLimit = std::atoll(argv[++i]);
+        }
+        else if (arg == "-limit-time" && i + 1 < argc) {
+            options.timeLimit = std::atof(argv[++i]);
+        }
+        else if (arg == "-cache" && i + 1 < argc) {
+            options.cacheDirectory = argv[++i];
+        }
+        else if (arg == "-cache-memory" && i + 1 < argc) {
+            options.cacheMemory = (std::size_t)std::atoll(argv[++i]) * 1024 * 1024;
         }
-        for (uint i = 0; i < paddingSize; ++i) {
-            *bufferPos++ = 0;
+        else if (arg == "-stream") {
+            options.stream = true;
         }
+        else if (arg == "-mjpeg") {
+            options.mjpeg = true;
+        }
+        else if (arg == "-y4m") {
+            options.mjpeg = true;
+            options.y4m = true;
+        }
+        else if (arg == "-transform" && i + 1 < argc) {
+            options.transform = argv[++i];
+            Transform transform;
+            if (options.transform != "auto" && !parseTransform(options.transform, transform)) {
+                console() << "Error - Unknown transform: " << options.transform << '\n';
+                return false;
+            }
+        }
+        else if (arg == "-transcode" && i + 1 < argc) {
+            options.transcode = argv[++i];
+            if (options.transcode != "baseline" && options.transcode != "progressive") {
+                console() << "Error - Unknown transcode mode: " << options.transcode << '\n';
+                return false;
+            }
+        }
+        else if (arg == "-requantize" && i + 1 < argc) {
+            const int quality = std::atoi(argv[++i]);
+            if (quality < 1 || quality > 100) {
+                console() << "Error - Requantization quality must be 1-100: " << argv[i] << '\n';
+                return false;
+            }
+            options.requantizeQuality = quality;
+        }
+        else if (arg == "-requantize-band" && i + 1 < argc) {
+            const int band = std::atoi(argv[++i]);
+            if (band < 0 || band > 63) {
+                console() << "Error - Requantization band must be 0-63: " << argv[i] << '\n';
+                return false;
+            }
+            options.requantizeBand = band;
+        }
+        else if (arg == "-output" && i + 1 < argc) {
+            options.outputFilename = argv[++i];
+        }
+        else if (arg == "-gray") {
+            options.lumaOnly = true;
+            options.pixelFormat = PIXEL_FORMAT_GRAY;
+        }
+        else if (arg == "-memory-budget" && i + 1 < argc) {
+            options.memoryBudget = (std::size_t)std::atoll(argv[++i]) * 1024 * 1024;
+        }
+        else if (arg == "-format" && i + 1 < argc) {
+            const std::string format(argv[++i]);
+            if (format == "rgb") {
+                options.pixelFormat = PIXEL_FORMAT_RGB;
+            }
+            else if (format == "bgr") {
+                options.pixelFormat = PIXEL_FORMAT_BGR;
+            }
+            else if (format == "rgba") {
+                options.pixelFormat = PIXEL_FORMAT_RGBA;
+            }
+            else if (format == "bgra") {
+                options.pixelFormat = PIXEL_FORMAT_BGRA;
+            }
+            else if (format == "gray") {
+                options.pixelFormat = PIXEL_FORMAT_GRAY;
+            }
+            else {
+                console() << "Error - Unknown pixel format: " << format << '\n';
+                return false;
+            }
+        }
+        else if (arg.size() > 1 && arg[0] == '-') {
+            console() << "Error - Unknown option: " << arg << '\n';
+            return false;
+        }
+        else {
+            filenames.push_back(arg);
+        }
+    }
+    // AC scans are not needed to build the DC image, whatever band was
+    //   asked for
+    if (options.dcOnly || options.analyze) {
+        options.maxSpectralBand = 0;
     }
+    return !filenames.empty();
+}
 
-    outFile.write((char*)buffer, size);
-    outFile.close();
-    delete[] buffer;
+// point every kernel at its variant for the given instruction set level
+void useSIMDLevel(const SIMDLevel level) {
+    console() << "Using " << simdLevelNames[level] << " kernels\n";
+    findMarkerByte = findMarkerByteVariants[level];
+    dequantizeBlockComponent = dequantizeBlockComponentVariants[level];
+    inverseDCTBlockComponent = inverseDCTBlockComponentVariants[level];
+    YCbCrToRGBRow = YCbCrToRGBRowVariants[level];
 }
 
 int main(int argc, char** argv) {
     // validate arguments
-    if (argc < 2) {
-        std::cout << "Error - Invalid arguments\n";
+    DecoderOptions options;
+    options.numThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> filenames;
+    if (!parseArguments(argc, argv, options, filenames)) {
+        console() << "Error - Invalid arguments\n";
         return 1;
     }
 
-    for (int i = 1; i < argc; ++i) {
-        const std::string filename(argv[i]);
+    // print nothing but the JSON lines, without selecting any kernels
+    if (options.probe) {
+        for (const std::string& filename : filenames) {
+            printProbe(filename, probeJPG(filename));
+        }
+        return 0;
+    }
+
+    if (options.validate || options.analyze) {
+        {
+            CapturedOutput messages;
+            useSIMDLevel(selectSIMDLevel(options.simdLevel));
+        }
+        for (const std::string& filename : filenames) {
+            if (options.validate) {
+                printValidation(filename);
+            }
+            else {
+                printAnalysis(filename, options);
+            }
+        }
+        return 0;
+    }
+
+    useSIMDLevel(selectSIMDLevel(options.simdLevel));
+
+    CoefficientCache cache(options.cacheDirectory, options.cacheMemory);
+    if (!options.cacheDirectory.empty() || options.cacheMemory != 0) {
+        options.coefficientCache = &cache;
+    }
+
+    for (const std::string& filename : filenames) {
+        if (options.mjpeg) {
+            decodeMJPEG(filename, options);
+            continue;
+        }
+        if (options.thumbnail) {
+            writeThumbnail(filename, options);
+            continue;
+        }
+        if (!options.transform.empty() || !options.transcode.empty() ||
+            options.requantizeQuality != 0 || options.requantizeBand != 63) {
+            transformJPG(filename, options);
+            continue;
+        }
+
+        // write a preview after every previewInterval scans
+        if (options.previewInterval != 0) {
+            options.scanCallback = [&](const JPGImage* const image, const uint scanNumber) {
+                writePreview(image, filename, scanNumber, options);
+            };
+        }
+
+        const bool sharedMemory = !options.sharedMemoryName.empty() || options.sharedMemoryFD >= 0;
+        if (options.stream && !sharedMemory && !options.dcOnly) {
+            streamBMP(filename, options);
+            continue;
+        }
 
         // read image
-        JPGImage* image = readJPG(filename);
+        JPGImage* image = options.stream ? streamJPG(filename, options) : readJPG(filename, options);
         // validate image
         if (image == nullptr) {
             continue;
         }
-        if (image->blocks == nullptr) {
+        if (image->coefficients == nullptr) {
             delete image;
             continue;
         }
         if (image->valid == false) {
-            delete[] image->blocks;
-            delete image;
+            freeImage(image);
             continue;
         }
 
-        // dequantize DCT coefficients
-        dequantize(image);
-
-        // Inverse Discrete Cosine Transform
-        inverseDCT(image);
-
-        // color conversion
-        YCbCrToRGB(image);
-
-        // write BMP file
-        const std::size_t pos = filename.find_last_of('.');
-        const std::string outFilename = (pos == std::string::npos) ?
-            (filename + ".bmp") :
-            (filename.substr(0, pos) + ".bmp");
-        writeBMP(image, outFilename);
+        // dequantize, IDCT and color convert while writing the pixels
+        if (sharedMemory) {
+            // write pixels to shared memory
+            writeSharedMemory(image, options);
+        }
+        else {
+            // write BMP file
+            writeBMP(image, outputFilename(filename, ".bmp"), options.dcOnly, options.numThreads);
+        }
 
-        delete[] image->blocks;
-        delete image;
+        freeImage(image);
     }
     return 0;
 }
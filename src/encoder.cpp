@@ -2,7 +2,10 @@
 #include <fstream>
 #include <vector>
 
+#include "console.h"
 #include "jpg.h"
+#include "jpgwriter.h"
+#include "simd.h"
 
 // helper function to read a 4-byte integer in little-endian
 uint getInt(std::ifstream& inFile) {
@@ -22,46 +25,61 @@ BMPImage readBMP(const std::string& filename) {
     BMPImage image;
 
     // open file
-    std::cout << "Reading " << filename << "...\n";
+    console() << "Reading " << filename << "...\n";
     std::ifstream inFile(filename, std::ios::in | std::ios::binary);
     if (!inFile.is_open()) {
-        std::cout << "Error - Error opening input file\n";
+        console() << "Error - Error opening input file\n";
         return image;
     }
 
     if (inFile.get() != 'B' || inFile.get() != 'M') {
-        std::cout << "Error - Invalid BMP file\n";
+        console() << "Error - Invalid BMP file\n";
         inFile.close();
         return image;
     }
 
     getInt(inFile); // size
     getInt(inFile); // nothing
-    if (getInt(inFile) != 0x1A) {
-        std::cout << "Error - Invalid offset\n";
+    const uint dataOffset = getInt(inFile);
+    const uint dibSize = getInt(inFile);
+    // BMPs with a BITMAPINFOHEADER, or one of its later versions, store
+    //   the rows top-down when the height is negative
+    bool topDown = false;
+    if (dibSize == 12) {
+        image.width = getShort(inFile);
+        image.height = getShort(inFile);
+    }
+    else if (dibSize >= 40) {
+        const int width = getInt(inFile);
+        const int height = getInt(inFile);
+        image.width = width < 0 ? 0 : width;
+        image.height = height < 0 ? 0u - height : height;
+        topDown = height < 0;
+    }
+    else {
+        console() << "Error - Invalid DIB size\n";
         inFile.close();
         return image;
     }
-    if (getInt(inFile) != 12) {
-        std::cout << "Error - Invalid DIB size\n";
+    if (getShort(inFile) != 1) {
+        console() << "Error - Invalid number of planes\n";
         inFile.close();
         return image;
     }
-    image.width = getShort(inFile);
-    image.height = getShort(inFile);
-    if (getShort(inFile) != 1) {
-        std::cout << "Error - Invalid number of planes\n";
+    if (getShort(inFile) != 24) {
+        console() << "Error - Invalid bit depth\n";
         inFile.close();
         return image;
     }
-    if (getShort(inFile) != 24) {
-        std::cout << "Error - Invalid bit depth\n";
+    if (dibSize >= 40 && getInt(inFile) != 0) {
+        console() << "Error - Compressed BMPs not supported\n";
         inFile.close();
         return image;
     }
 
-    if (image.height == 0 || image.width == 0) {
-        std::cout << "Error - Invalid dimensions\n";
+    // JPG dimensions are 16-bit
+    if (image.height == 0 || image.width == 0 || image.height > 65535 || image.width > 65535) {
+        console() << "Error - Invalid dimensions\n";
         inFile.close();
         return image;
     }
@@ -69,29 +87,31 @@ BMPImage readBMP(const std::string& filename) {
     image.blockHeight = (image.height + 7) / 8;
     image.blockWidth = (image.width + 7) / 8;
 
-    image.blocks = new (std::nothrow) Block[image.blockHeight * image.blockWidth];
+    image.blocks = new (std::nothrow) Block[(std::size_t)image.blockHeight * image.blockWidth];
     if (image.blocks == nullptr) {
-        std::cout << "Error - Memory error\n";
+        console() << "Error - Memory error\n";
         inFile.close();
         return image;
     }
 
+    // read one row, including its padding, at a time
     const uint paddingSize = image.width % 4;
+    std::vector<byte> row(image.width * 3 + paddingSize);
+    inFile.seekg(dataOffset);
 
-    for (uint y = image.height - 1; y < image.height; --y) {
+    for (uint i = 0; i < image.height; ++i) {
+        const uint y = topDown ? i : image.height - 1 - i;
         const uint blockRow = y / 8;
         const uint pixelRow = y % 8;
+        inFile.read((char*)row.data(), row.size());
         for (uint x = 0; x < image.width; ++x) {
             const uint blockColumn = x / 8;
             const uint pixelColumn = x % 8;
-            const uint blockIndex = blockRow * image.blockWidth + blockColumn;
+            const std::size_t blockIndex = (std::size_t)blockRow * image.blockWidth + blockColumn;
             const uint pixelIndex = pixelRow * 8 + pixelColumn;
-            image.blocks[blockIndex].b[pixelIndex] = inFile.get();
-            image.blocks[blockIndex].g[pixelIndex] = inFile.get();
-            image.blocks[blockIndex].r[pixelIndex] = inFile.get();
-        }
-        for (uint i = 0; i < paddingSize; ++i) {
-            inFile.get();
+            image.blocks[blockIndex].b[pixelIndex] = row[x * 3 + 0];
+            image.blocks[blockIndex].g[pixelIndex] = row[x * 3 + 1];
+            image.blocks[blockIndex].r[pixelIndex] = row[x * 3 + 2];
         }
     }
 
@@ -100,7 +120,7 @@ BMPImage readBMP(const std::string& filename) {
 }
 
 // convert all pixels in a block from RGB color space to YCbCr
-void RGBToYCbCrBlock(Block& block) {
+SIMD_INLINE void RGBToYCbCrBlockKernel(Block& block) {
     for (uint y = 0; y < 8; ++y) {
         for (uint x = 0; x < 8; ++x) {
             const uint pixel = y * 8 + x;
@@ -119,19 +139,20 @@ void RGBToYCbCrBlock(Block& block) {
         }
     }
 }
+SIMD_KERNEL(void, RGBToYCbCrBlock, (Block& block), (block))
 
 // convert all pixels from RGB color space to YCbCr
 void RGBToYCbCr(const BMPImage& image) {
     for (uint y = 0; y < image.blockHeight; ++y) {
         for (uint x = 0; x < image.blockWidth; ++x) {
-            RGBToYCbCrBlock(image.blocks[y * image.blockWidth + x]);
+            RGBToYCbCrBlock(image.blocks[(std::size_t)y * image.blockWidth + x]);
         }
     }
 }
 
 // perform 1-D FDCT on all columns and rows of a block component
 //   resulting in 2-D FDCT
-void forwardDCTBlockComponent(int* const component) {
+SIMD_INLINE void forwardDCTBlockComponentKernel(int* const component) {
     for (uint i = 0; i < 8; ++i) {
         const float a0 = component[0 * 8 + i];
         const float a1 = component[1 * 8 + i];
@@ -283,176 +304,38 @@ void forwardDCTBlockComponent(int* const component) {
         component[i * 8 + 3] = g7 * s3;
     }
 }
+SIMD_KERNEL(void, forwardDCTBlockComponent, (int* const component), (component))
 
 // perform FDCT on all MCUs
 void forwardDCT(const BMPImage& image) {
     for (uint y = 0; y < image.blockHeight; ++y) {
         for (uint x = 0; x < image.blockWidth; ++x) {
             for (uint i = 0; i < 3; ++i) {
-                forwardDCTBlockComponent(image.blocks[y * image.blockWidth + x][i]);
+                forwardDCTBlockComponent(image.blocks[(std::size_t)y * image.blockWidth + x][i]);
             }
         }
     }
 }
 
 // quantize a block component based on a quantization table
-void quantizeBlockComponent(const QuantizationTable& qTable, int* const component) {
+// the quotient is truncated like an integer division, which a double
+//   division reproduces exactly while letting the loop vectorize
+SIMD_INLINE void quantizeBlockComponentKernel(const QuantizationTable& qTable, int* const component) {
     for (uint i = 0; i < 64; ++i) {
-        component[i] /= (signed)qTable.table[i];
+        component[i] = (double)component[i] / qTable.table[i];
     }
 }
+SIMD_KERNEL(void, quantizeBlockComponent, (const QuantizationTable& qTable, int* const component), (qTable, component))
 
 // quantize all MCUs
 void quantize(const BMPImage& image) {
     for (uint y = 0; y < image.blockHeight; ++y) {
         for (uint x = 0; x < image.blockWidth; ++x) {
             for (uint i = 0; i < 3; ++i) {
-                quantizeBlockComponent(*qTables100[i], image.blocks[y * image.blockWidth + x][i]);
-            }
-        }
-    }
-}
-
-class BitWriter {
-private:
-    byte nextBit = 0;
-    std::vector<byte>& data;
-
-public:
-    BitWriter(std::vector<byte>& d) :
-    data(d)
-    {}
-
-    void writeBit(uint bit) {
-        if (nextBit == 0) {
-            data.push_back(0);
-        }
-        data.back() |= (bit & 1) << (7 - nextBit);
-        nextBit = (nextBit + 1) % 8;
-        if (nextBit == 0 && data.back() == 0xFF) {
-            data.push_back(0);
-        }
-    }
-
-    void writeBits(uint bits, uint length) {
-        for (uint i = 1; i <= length; ++i) {
-            writeBit(bits >> (length - i));
-        }
-    }
-};
-
-// generate all Huffman codes based on symbols from a Huffman table
-void generateCodes(HuffmanTable& hTable) {
-    uint code = 0;
-    for (uint i = 0; i < 16; ++i) {
-        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
-            hTable.codes[j] = code;
-            code += 1;
-        }
-        code <<= 1;
-    }
-}
-
-uint bitLength(int v) {
-    uint length = 0;
-    while (v > 0) {
-        v >>= 1;
-        length += 1;
-    }
-    return length;
-}
-
-bool getCode(const HuffmanTable& hTable, byte symbol, uint& code, uint& codeLength) {
-    for (uint i = 0; i < 16; ++i) {
-        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
-            if (symbol == hTable.symbols[j]) {
-                code = hTable.codes[j];
-                codeLength = i + 1;
-                return true;
-            }
-        }
-    }
-    return false;
-}
-
-bool encodeBlockComponent(
-    BitWriter& bitWriter,
-    int* const component,
-    int& previousDC,
-    const HuffmanTable& dcTable,
-    const HuffmanTable& acTable
-) {
-    // encode DC value
-    int coeff = component[0] - previousDC;
-    previousDC = component[0];
-
-    uint coeffLength = bitLength(std::abs(coeff));
-    if (coeffLength > 11) {
-        std::cout << "Error - DC coefficient length greater than 11\n";
-        return false;
-    }
-    if (coeff < 0) {
-        coeff += (1 << coeffLength) - 1;
-    }
-
-    uint code = 0;
-    uint codeLength = 0;
-    if (!getCode(dcTable, coeffLength, code, codeLength)) {
-        std::cout << "Error - Invalid DC value\n";
-        return false;
-    }
-    bitWriter.writeBits(code, codeLength);
-    bitWriter.writeBits(coeff, coeffLength);
-
-    // encode AC values
-    for (uint i = 1; i < 64; ++i) {
-        // find zero run length
-        byte numZeroes = 0;
-        while (i < 64 && component[zigZagMap[i]] == 0) {
-            numZeroes += 1;
-            i += 1;
-        }
-
-        if (i == 64) {
-            if (!getCode(acTable, 0x00, code, codeLength)) {
-                std::cout << "Error - Invalid AC value\n";
-                return false;
+                quantizeBlockComponent(*qTables100[i], image.blocks[(std::size_t)y * image.blockWidth + x][i]);
             }
-            bitWriter.writeBits(code, codeLength);
-            return true;
-        }
-
-        while (numZeroes >= 16) {
-            if (!getCode(acTable, 0xF0, code, codeLength)) {
-                std::cout << "Error - Invalid AC value\n";
-                return false;
-            }
-            bitWriter.writeBits(code, codeLength);
-            numZeroes -= 16;
-        }
-
-        // find coeff length
-        coeff = component[zigZagMap[i]];
-        coeffLength = bitLength(std::abs(coeff));
-        if (coeffLength > 10) {
-            std::cout << "Error - AC coefficient length greater than 10\n";
-            return false;
-        }
-        if (coeff < 0) {
-            coeff += (1 << coeffLength) - 1;
-        }
-
-        // find symbol in table
-        byte symbol = numZeroes << 4 | coeffLength;
-        if (!getCode(acTable, symbol, code, codeLength)) {
-            std::cout << "Error - Invalid AC value\n";
-            return false;
         }
-        bitWriter.writeBits(code, codeLength);
-        bitWriter.writeBits(coeff, coeffLength);
     }
-
-    return true;
 }
 
 // encode all the Huffman data from all MCUs
@@ -461,16 +344,11 @@ std::vector<byte> encodeHuffmanData(const BMPImage& image) {
     BitWriter bitWriter(huffmanData);
 
     int previousDCs[3] = { 0 };
-
+    HuffmanCoder dcCoders[3];
+    HuffmanCoder acCoders[3];
     for (uint i = 0; i < 3; ++i) {
-        if (!dcTables[i]->set) {
-            generateCodes(*dcTables[i]);
-            dcTables[i]->set = true;
-        }
-        if (!acTables[i]->set) {
-            generateCodes(*acTables[i]);
-            acTables[i]->set = true;
-        }
+        dcCoders[i].encoding = *dcEncodings[i];
+        acCoders[i].encoding = *acEncodings[i];
     }
 
     for (uint y = 0; y < image.blockHeight; ++y) {
@@ -478,35 +356,20 @@ std::vector<byte> encodeHuffmanData(const BMPImage& image) {
             for (uint i = 0; i < 3; ++i) {
                 if (!encodeBlockComponent(
                         bitWriter,
-                        image.blocks[y * image.blockWidth + x][i],
+                        image.blocks[(std::size_t)y * image.blockWidth + x][i],
                         previousDCs[i],
-                        *dcTables[i],
-                        *acTables[i])) {
+                        dcCoders[i],
+                        acCoders[i])) {
                     return std::vector<byte>();
                 }
             }
         }
     }
+    bitWriter.flush();
 
     return huffmanData;
 }
 
-// helper function to write a 2-byte short integer in big-endian
-void putShort(std::ofstream& outFile, const uint v) {
-    outFile.put((v >> 8) & 0xFF);
-    outFile.put((v >> 0) & 0xFF);
-}
-
-void writeQuantizationTable(std::ofstream& outFile, byte tableID, const QuantizationTable& qTable) {
-    outFile.put(0xFF);
-    outFile.put(DQT);
-    putShort(outFile, 67);
-    outFile.put(tableID);
-    for (uint i = 0; i < 64; ++i) {
-        outFile.put(qTable.table[zigZagMap[i]]);
-    }
-}
-
 void writeStartOfFrame(std::ofstream& outFile, const BMPImage& image) {
     outFile.put(0xFF);
     outFile.put(SOF0);
@@ -522,21 +385,6 @@ void writeStartOfFrame(std::ofstream& outFile, const BMPImage& image) {
     }
 }
 
-void writeHuffmanTable(std::ofstream& outFile, byte acdc, byte tableID, const HuffmanTable& hTable) {
-    outFile.put(0xFF);
-    outFile.put(DHT);
-    putShort(outFile, 19 + hTable.offsets[16]);
-    outFile.put(acdc << 4 | tableID);
-    for (uint i = 0; i < 16; ++i) {
-        outFile.put(hTable.offsets[i + 1] - hTable.offsets[i]);
-    }
-    for (uint i = 0; i < 16; ++i) {
-        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
-            outFile.put(hTable.symbols[j]);
-        }
-    }
-}
-
 void writeStartOfScan(std::ofstream& outFile) {
     outFile.put(0xFF);
     outFile.put(SOS);
@@ -551,24 +399,6 @@ void writeStartOfScan(std::ofstream& outFile) {
     outFile.put(0);
 }
 
-void writeAPP0(std::ofstream& outFile) {
-    outFile.put(0xFF);
-    outFile.put(APP0);
-    putShort(outFile, 16);
-    outFile.put('J');
-    outFile.put('F');
-    outFile.put('I');
-    outFile.put('F');
-    outFile.put(0);
-    outFile.put(1);
-    outFile.put(2);
-    outFile.put(0);
-    putShort(outFile, 100);
-    putShort(outFile, 100);
-    outFile.put(0);
-    outFile.put(0);
-}
-
 void writeJPG(const BMPImage& image, const std::string& filename) {
     std::vector<byte> huffmanData = encodeHuffmanData(image);
     if (huffmanData.size() == 0) {
@@ -576,10 +406,10 @@ void writeJPG(const BMPImage& image, const std::string& filename) {
     }
 
     // open file
-    std::cout << "Writing " << filename << "...\n";
+    console() << "Writing " << filename << "...\n";
     std::ofstream outFile(filename, std::ios::out | std::ios::binary);
     if (!outFile.is_open()) {
-        std::cout << "Error - Error opening output file\n";
+        console() << "Error - Error opening output file\n";
         return;
     }
 
@@ -616,12 +446,21 @@ void writeJPG(const BMPImage& image, const std::string& filename) {
     outFile.close();
 }
 
+// point every kernel at its variant for the given instruction set level
+void useSIMDLevel(const SIMDLevel level) {
+    console() << "Using " << simdLevelNames[level] << " kernels\n";
+    RGBToYCbCrBlock = RGBToYCbCrBlockVariants[level];
+    forwardDCTBlockComponent = forwardDCTBlockComponentVariants[level];
+    quantizeBlockComponent = quantizeBlockComponentVariants[level];
+}
+
 int main(int argc, char** argv) {
     // validate arguments
     if (argc < 2) {
-        std::cout << "Error - Invalid arguments\n";
+        console() << "Error - Invalid arguments\n";
         return 1;
     }
+    useSIMDLevel(selectSIMDLevel());
 
     for (int i = 1; i < argc; ++i) {
         const std::string filename(argv[i]);
@@ -2,7 +2,13 @@
 #define JPG_H
 
 #define _USE_MATH_DEFINES
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
 
 typedef unsigned char byte;
 typedef unsigned int uint;
@@ -113,6 +119,8 @@ struct ColorComponent {
     byte huffmanACTableID = 0;
     bool usedInFrame = false;
     bool usedInScan = false;
+    // coefficients of progressive scans skipped for -max-band, one bit each
+    std::uint64_t skippedCoefficients = 0;
 };
 
 struct Block {
@@ -162,7 +170,16 @@ struct JPGImage {
 
     uint restartInterval = 0;
 
-    Block* blocks = nullptr;
+    // coefficients of all block components, stored MCU by MCU in decode
+    //   order so that the block components of each MCU are contiguous,
+    //   each one starting on a 64-byte cache line
+    int* coefficients = nullptr;
+    uint blocksPerMCU = 0;
+    uint componentOffsets[3] = { 0 };
+
+    // progressive only, one bitmap per block component marking
+    //   which coefficients are nonzero, in zig-zag order
+    std::atomic<std::uint64_t>* nonzero = nullptr;
 
     bool valid = true;
 
@@ -173,6 +190,196 @@ struct JPGImage {
 
     byte horizontalSamplingFactor = 0;
     byte verticalSamplingFactor = 0;
+
+    // when the coefficients were allocated, for the time limit
+    std::chrono::steady_clock::time_point decodeStart;
+
+    // only the luminance is stored when decoding to grayscale, while the
+    //   chroma of interleaved scans is decoded and dropped
+    bool lumaOnly = false;
+
+    // number of color components whose blocks are in coefficients
+    uint storedComponents() const {
+        return lumaOnly ? 1 : numComponents;
+    }
+
+    // number of block components in coefficients
+    // sizes derived from it exceed 32 bits for the largest images
+    std::size_t numBlockComponents() const {
+        return (std::size_t)(blockHeightReal / verticalSamplingFactor) * (blockWidthReal / horizontalSamplingFactor) * blocksPerMCU;
+    }
+
+    // index of the block component of color component i that covers the
+    //   block at row y and column x, in coefficients and nonzero
+    // chroma blocks cover a whole MCU
+    std::size_t blockIndex(const uint y, const uint x, const uint i) const {
+        const ColorComponent& component = colorComponents[i];
+        const std::size_t mcu = (std::size_t)(y / verticalSamplingFactor) * (blockWidthReal / horizontalSamplingFactor) + x / horizontalSamplingFactor;
+        return mcu * blocksPerMCU + componentOffsets[i] +
+            y % component.verticalSamplingFactor * component.horizontalSamplingFactor + x % component.horizontalSamplingFactor;
+    }
+
+    int* blockComponent(const uint y, const uint x, const uint i) const {
+        return coefficients + blockIndex(y, x, i) * 64;
+    }
+};
+
+// location of one scan's entropy-coded data within the file, along with
+//   a snapshot of the scan header and tables in effect for that scan
+struct ScanRecord {
+    JPGImage header;
+    std::size_t start = 0;
+    std::size_t end = 0;
+};
+
+// state of the Huffman decoder at the start of a row of MCUs, from which
+//   a scan can be decoded further once more of its data has arrived
+struct ScanProgress {
+    uint row = 0;
+    uint mcu = 0;
+    int previousDCs[3] = { 0 };
+    uint skips = 0;
+};
+
+// header information of a JPG, read without decoding any of its scans
+struct JPGProbe {
+    JPGImage header;
+    // estimated IJG quality of the luminance and chrominance quantization
+    //   tables, and whether the tables are exactly the IJG ones
+    uint quality = 0;
+    uint chromaQuality = 0;
+    bool exactQuality = false;
+    // the first error found and the offset in the file where it was found
+    std::string error;
+    std::size_t errorOffset = 0;
+};
+
+// statistics of the 1/8 scale image built from the DC coefficients alone
+struct DCAnalysis {
+    uint width = 0;
+    uint height = 0;
+    float averageColor[3] = { 0 };
+    // fraction of pixels in each of 4x4x4 RGB bins, red major
+    float histogram[64] = { 0 };
+    // 64-bit DCT-based perceptual hash, comparable by Hamming distance
+    std::uint64_t perceptualHash = 0;
+};
+
+// layout of pixels written to an output buffer
+enum PixelFormat {
+    PIXEL_FORMAT_RGB,
+    PIXEL_FORMAT_BGR,
+    PIXEL_FORMAT_RGBA,
+    PIXEL_FORMAT_BGRA,
+    PIXEL_FORMAT_GRAY
+};
+
+class CoefficientCache;
+
+struct DecoderOptions {
+    // write pixels into a POSIX shared memory object or an inherited
+    //   file descriptor (e.g. from memfd_create) instead of a BMP file
+    std::string sharedMemoryName;
+    int sharedMemoryFD = -1;
+    uint rowStride = 0;
+    PixelFormat pixelFormat = PIXEL_FORMAT_RGB;
+
+    // called with the partially decoded image after every
+    //   previewInterval completed scans
+    std::function<void(const JPGImage* const, const uint)> scanCallback;
+    uint previewInterval = 0;
+    bool previewDCOnly = false;
+
+    // called by the incremental decoder with each band of block rows, from
+    //   the first up to but excluding the second, whose coefficients are final
+    std::function<void(const JPGImage* const, const uint, const uint)> rowCallback;
+
+    // keep the coefficients of decoded files in an in-memory cache of up to
+    //   cacheMemory bytes and in cacheDirectory, if given, and render files
+    //   found in either from them instead of decoding them again
+    std::string cacheDirectory;
+    std::size_t cacheMemory = 0;
+    CoefficientCache* coefficientCache = nullptr;
+
+    // read each file in chunks through the incremental decoder, decoding
+    //   as the data arrives, with "-" reading standard input
+    bool stream = false;
+
+    // stop decoding a progressive image early and reconstruct it from
+    //   the coefficients received so far (0 means no limit)
+    uint maxScans = 0;
+    std::size_t maxBytes = 0;
+    byte maxSpectralBand = 63;
+
+    // reject files beyond these limits as invalid as soon as they are found
+    //   to exceed them, so that crafted files cannot exhaust memory or keep
+    //   a decoder busy for minutes (0 means no limit)
+    // the time limit is in seconds of elapsed time since the coefficients
+    //   were allocated, and is checked between scans
+    std::uint64_t pixelLimit = 0;
+    std::size_t memoryLimit = 0;
+    uint scanLimit = 0;
+    std::size_t inputLimit = 0;
+    double timeLimit = 0;
+
+    // write a 1/8 scale image from the DC coefficients only
+    bool dcOnly = false;
+
+    // number of threads used to decode independent progressive scans
+    uint numThreads = 1;
+
+    // decode baseline images without restart markers by splitting their
+    //   entropy-coded data into chunks decoded in parallel (experimental),
+    //   and check the result against the serial decoder
+    bool speculative = false;
+    bool verifySpeculative = false;
+
+    // keep coefficients larger than this many bytes in a temporary file
+    //   that the kernel pages to disk, instead of in memory (0 means no limit)
+    std::size_t memoryBudget = 0;
+
+    // only read the headers of each file up to the first scan and print
+    //   what they contain as a line of JSON
+    bool probe = false;
+
+    // decode the Huffman data of each file without storing coefficients or
+    //   writing pixels, and print as a line of JSON whether it is intact
+    bool validate = false;
+
+    // decode the thumbnail embedded in the EXIF or JFIF segments of each
+    //   file instead of the image, reading only those segments
+    bool thumbnail = false;
+
+    // decode only the DC coefficients of each file and print the average
+    //   color, color histogram and perceptual hash of the DC image as JSON
+    bool analyze = false;
+
+    // decode each file as a stream of concatenated JPGs, writing all frames
+    //   as raw pixels, or as a Y4M stream, to outputFilename if given
+    bool mjpeg = false;
+    bool y4m = false;
+    std::string outputFilename;
+
+    // rotate or flip each file losslessly in the coefficient domain and
+    //   write it as a JPG, or undo its EXIF orientation with "auto"
+    std::string transform;
+
+    // write each file, transformed or not, as a "baseline" or "progressive"
+    //   JPG from its coefficients, losslessly
+    std::string transcode;
+
+    // requantize each file in the coefficient domain with the IJG tables of
+    //   this quality (0 keeps the steps of the file), dropping coefficients
+    //   past zig-zag position requantizeBand, and write it as a JPG
+    uint requantizeQuality = 0;
+    byte requantizeBand = 63;
+
+    // decode only the luminance of color images, to 8-bit grayscale
+    bool lumaOnly = false;
+
+    // instruction set level to run the SIMD kernels at, instead of
+    //   the highest one the CPU supports
+    std::string simdLevel;
 };
 
 struct BMPImage {
@@ -185,7 +392,7 @@ struct BMPImage {
     uint blockWidth = 0;
 };
 
-const byte zigZagMap[] = {
+constexpr byte zigZagMap[] = {
     0,   1,  8, 16,  9,  2,  3, 10,
     17, 24, 32, 25, 18, 11,  4,  5,
     12, 19, 26, 33, 40, 48, 41, 34,
@@ -213,9 +420,47 @@ const float s5 = std::cos(5.0 / 16.0 * M_PI) / 2.0;
 const float s6 = std::cos(6.0 / 16.0 * M_PI) / 2.0;
 const float s7 = std::cos(7.0 / 16.0 * M_PI) / 2.0;
 
-// standard tables
+// generate all Huffman codes based on symbols from a Huffman table
+constexpr void generateCodes(HuffmanTable& hTable) {
+    uint code = 0;
+    for (uint i = 0; i < 16; ++i) {
+        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
+            hTable.codes[j] = code;
+            code += 1;
+        }
+        code <<= 1;
+    }
+}
+
+// complete a standard Huffman table with its codes
+constexpr HuffmanTable standardHuffmanTable(const HuffmanTable& base) {
+    HuffmanTable hTable = base;
+    generateCodes(hTable);
+    hTable.set = true;
+    return hTable;
+}
+
+// Huffman code and code length of every symbol, used for encoding
+// a code length of 0 marks a symbol that is not in the table
+struct HuffmanEncoding {
+    uint codes[256] = { 0 };
+    byte codeLengths[256] = { 0 };
+};
+
+constexpr HuffmanEncoding huffmanEncoding(const HuffmanTable& hTable) {
+    HuffmanEncoding encoding;
+    for (uint i = 0; i < 16; ++i) {
+        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
+            encoding.codes[hTable.symbols[j]] = hTable.codes[j];
+            encoding.codeLengths[hTable.symbols[j]] = i + 1;
+        }
+    }
+    return encoding;
+}
+
+// standard tables, generated at compile time
 
-const QuantizationTable qTableY50 = {
+constexpr QuantizationTable qTableY50 = {
     {
         16,  11,  10,  16,  24,  40,  51,  61,
         12,  12,  14,  19,  26,  58,  60,  55,
@@ -229,7 +474,7 @@ const QuantizationTable qTableY50 = {
     true
 };
 
-const QuantizationTable qTableCbCr50 = {
+constexpr QuantizationTable qTableCbCr50 = {
     {
         17, 18, 24, 47, 99, 99, 99, 99,
         18, 21, 26, 66, 99, 99, 99, 99,
@@ -243,81 +488,38 @@ const QuantizationTable qTableCbCr50 = {
     true
 };
 
-const QuantizationTable qTableY75 = {
-    {
-        16/2,  11/2,  10/2,  16/2,  24/2,  40/2,  51/2,  61/2,
-        12/2,  12/2,  14/2,  19/2,  26/2,  58/2,  60/2,  55/2,
-        14/2,  13/2,  16/2,  24/2,  40/2,  57/2,  69/2,  56/2,
-        14/2,  17/2,  22/2,  29/2,  51/2,  87/2,  80/2,  62/2,
-        18/2,  22/2,  37/2,  56/2,  68/2, 109/2, 103/2,  77/2,
-        24/2,  35/2,  55/2,  64/2,  81/2, 104/2, 113/2,  92/2,
-        49/2,  64/2,  78/2,  87/2, 103/2, 121/2, 120/2, 101/2,
-        72/2,  92/2,  95/2,  98/2, 112/2, 100/2, 103/2,  99/2
-    },
-    true
-};
-
-const QuantizationTable qTableCbCr75 = {
-    {
-        17/2, 18/2, 24/2, 47/2, 99/2, 99/2, 99/2, 99/2,
-        18/2, 21/2, 26/2, 66/2, 99/2, 99/2, 99/2, 99/2,
-        24/2, 26/2, 56/2, 99/2, 99/2, 99/2, 99/2, 99/2,
-        47/2, 66/2, 99/2, 99/2, 99/2, 99/2, 99/2, 99/2,
-        99/2, 99/2, 99/2, 99/2, 99/2, 99/2, 99/2, 99/2,
-        99/2, 99/2, 99/2, 99/2, 99/2, 99/2, 99/2, 99/2,
-        99/2, 99/2, 99/2, 99/2, 99/2, 99/2, 99/2, 99/2,
-        99/2, 99/2, 99/2, 99/2, 99/2, 99/2, 99/2, 99/2
-    },
-    true
-};
-
-const QuantizationTable qTableY100 = {
-    {
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1
-    },
-    true
-};
+// scale a quantization table given for quality 50 to a quality between
+//   1 and 100, the way the IJG reference encoder does
+constexpr QuantizationTable scaleQuantizationTable(const QuantizationTable& base, const uint quality) {
+    const uint scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    QuantizationTable qTable = base;
+    for (uint i = 0; i < 64; ++i) {
+        const uint value = (base.table[i] * scale + 50) / 100;
+        qTable.table[i] = value < 1 ? 1 : value > 255 ? 255 : value;
+    }
+    return qTable;
+}
 
-const QuantizationTable qTableCbCr100 = {
-    {
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1
-    },
-    true
-};
+constexpr QuantizationTable qTableY75 = scaleQuantizationTable(qTableY50, 75);
+constexpr QuantizationTable qTableCbCr75 = scaleQuantizationTable(qTableCbCr50, 75);
+constexpr QuantizationTable qTableY100 = scaleQuantizationTable(qTableY50, 100);
+constexpr QuantizationTable qTableCbCr100 = scaleQuantizationTable(qTableCbCr50, 100);
 
 const QuantizationTable* const qTables50[]  = {  &qTableY50,  &qTableCbCr50,  &qTableCbCr50 };
 const QuantizationTable* const qTables75[]  = {  &qTableY75,  &qTableCbCr75,  &qTableCbCr75 };
 const QuantizationTable* const qTables100[] = { &qTableY100, &qTableCbCr100, &qTableCbCr100 };
 
-HuffmanTable hDCTableY = {
+constexpr HuffmanTable hDCTableY = standardHuffmanTable({
     { 0, 0, 1, 6, 7, 8, 9, 10, 11, 12, 12, 12, 12, 12, 12, 12, 12 },
-    { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b },
-    {},
-    false
-};
+    { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b }
+});
 
-HuffmanTable hDCTableCbCr = {
+constexpr HuffmanTable hDCTableCbCr = standardHuffmanTable({
     { 0, 0, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 12, 12, 12, 12, 12 },
-    { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b },
-    {},
-    false
-};
+    { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b }
+});
 
-HuffmanTable hACTableY = {
+constexpr HuffmanTable hACTableY = standardHuffmanTable({
     { 0, 0, 2, 3, 6, 9, 11, 15, 18, 23, 28, 32, 36, 36, 36, 37, 162 },
     {
         0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
@@ -341,12 +543,10 @@ HuffmanTable hACTableY = {
         0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
         0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
         0xf9, 0xfa
-    },
-    {},
-    false
-};
+    }
+});
 
-HuffmanTable hACTableCbCr = {
+constexpr HuffmanTable hACTableCbCr = standardHuffmanTable({
     { 0, 0, 2, 3, 5, 9, 13, 16, 20, 27, 32, 36, 40, 40, 41, 43, 162 },
     {
         0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
@@ -370,12 +570,18 @@ HuffmanTable hACTableCbCr = {
         0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
         0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
         0xf9, 0xfa
-    },
-    {},
-    false
-};
+    }
+});
+
+const HuffmanTable* const dcTables[] = { &hDCTableY, &hDCTableCbCr, &hDCTableCbCr };
+const HuffmanTable* const acTables[] = { &hACTableY, &hACTableCbCr, &hACTableCbCr };
+
+constexpr HuffmanEncoding dcEncodingY = huffmanEncoding(hDCTableY);
+constexpr HuffmanEncoding dcEncodingCbCr = huffmanEncoding(hDCTableCbCr);
+constexpr HuffmanEncoding acEncodingY = huffmanEncoding(hACTableY);
+constexpr HuffmanEncoding acEncodingCbCr = huffmanEncoding(hACTableCbCr);
 
-HuffmanTable* const dcTables[] = { &hDCTableY, &hDCTableCbCr, &hDCTableCbCr };
-HuffmanTable* const acTables[] = { &hACTableY, &hACTableCbCr, &hACTableCbCr };
+const HuffmanEncoding* const dcEncodings[] = { &dcEncodingY, &dcEncodingCbCr, &dcEncodingCbCr };
+const HuffmanEncoding* const acEncodings[] = { &acEncodingY, &acEncodingCbCr, &acEncodingCbCr };
 
 #endif
@@ -0,0 +1,499 @@
+#ifndef JPG_WRITER_H
+#define JPG_WRITER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "console.h"
+#include "jpg.h"
+
+// entropy coding and marker writing shared by the encoder and by the
+//   decoder's lossless transcoding modes
+
+// bits are gathered in a 64-bit buffer and written out a byte at a time,
+//   with a 0x00 stuffed after every 0xFF
+// flush must be called once all bits have been written, which pads the
+//   last byte with 0s
+class BitWriter {
+private:
+    std::uint64_t buffer = 0;
+    uint numBits = 0;
+    std::vector<byte>& data;
+
+public:
+    BitWriter(std::vector<byte>& d) :
+    data(d)
+    {}
+
+    void writeBit(uint bit) {
+        writeBits(bit, 1);
+    }
+
+    // length is at most 32
+    void writeBits(uint bits, uint length) {
+        buffer = buffer << length | (bits & (((std::uint64_t)1 << length) - 1));
+        numBits += length;
+        while (numBits >= 8) {
+            numBits -= 8;
+            const byte b = buffer >> numBits;
+            data.push_back(b);
+            if (b == 0xFF) {
+                data.push_back(0);
+            }
+        }
+    }
+
+    void flush() {
+        if (numBits > 0) {
+            writeBits(0, 8 - numBits);
+        }
+    }
+};
+
+inline uint bitLength(int v) {
+    uint length = 0;
+    while (v > 0) {
+        v >>= 1;
+        length += 1;
+    }
+    return length;
+}
+
+inline bool getCode(const HuffmanEncoding& encoding, byte symbol, uint& code, uint& codeLength) {
+    code = encoding.codes[symbol];
+    codeLength = encoding.codeLengths[symbol];
+    return codeLength != 0;
+}
+
+// Huffman codes of one table, or, while counting, how often each symbol
+//   of the table occurs, from which an optimal table is built
+struct HuffmanCoder {
+    HuffmanEncoding encoding;
+    std::uint64_t frequencies[256] = { 0 };
+    bool counting = false;
+};
+
+// write the code of a symbol together with the bits that follow it, or only
+//   count the symbol
+// return false if the symbol has no code
+inline bool writeSymbol(BitWriter& bitWriter, HuffmanCoder& coder, byte symbol, uint bits, uint length) {
+    if (coder.counting) {
+        coder.frequencies[symbol] += 1;
+        return true;
+    }
+    uint code = 0;
+    uint codeLength = 0;
+    if (!getCode(coder.encoding, symbol, code, codeLength)) {
+        return false;
+    }
+    bitWriter.writeBits(code << length | (bits & ((1 << length) - 1)), codeLength + length);
+    return true;
+}
+
+// encode the difference of a DC value from the previous one
+inline bool encodeDC(BitWriter& bitWriter, const int value, int& previousDC, HuffmanCoder& dcCoder) {
+    int coeff = value - previousDC;
+    previousDC = value;
+
+    uint coeffLength = bitLength(std::abs(coeff));
+    if (coeffLength > 11) {
+        console() << "Error - DC coefficient length greater than 11\n";
+        return false;
+    }
+    if (coeff < 0) {
+        coeff += (1 << coeffLength) - 1;
+    }
+
+    if (!writeSymbol(bitWriter, dcCoder, coeffLength, coeff, coeffLength)) {
+        console() << "Error - Invalid DC value\n";
+        return false;
+    }
+    return true;
+}
+
+inline bool encodeBlockComponent(
+    BitWriter& bitWriter,
+    const int* const component,
+    int& previousDC,
+    HuffmanCoder& dcCoder,
+    HuffmanCoder& acCoder
+) {
+    // encode DC value
+    if (!encodeDC(bitWriter, component[0], previousDC, dcCoder)) {
+        return false;
+    }
+
+    // encode AC values
+    for (uint i = 1; i < 64; ++i) {
+        // find zero run length
+        byte numZeroes = 0;
+        while (i < 64 && component[zigZagMap[i]] == 0) {
+            numZeroes += 1;
+            i += 1;
+        }
+
+        if (i == 64) {
+            if (!writeSymbol(bitWriter, acCoder, 0x00, 0, 0)) {
+                console() << "Error - Invalid AC value\n";
+                return false;
+            }
+            return true;
+        }
+
+        while (numZeroes >= 16) {
+            if (!writeSymbol(bitWriter, acCoder, 0xF0, 0, 0)) {
+                console() << "Error - Invalid AC value\n";
+                return false;
+            }
+            numZeroes -= 16;
+        }
+
+        // find coeff length
+        int coeff = component[zigZagMap[i]];
+        const uint coeffLength = bitLength(std::abs(coeff));
+        if (coeffLength > 10) {
+            console() << "Error - AC coefficient length greater than 10\n";
+            return false;
+        }
+        if (coeff < 0) {
+            coeff += (1 << coeffLength) - 1;
+        }
+
+        // find symbol in table
+        const byte symbol = numZeroes << 4 | coeffLength;
+        if (!writeSymbol(bitWriter, acCoder, symbol, coeff, coeffLength)) {
+            console() << "Error - Invalid AC value\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// state of a progressive AC scan carried from block to block: the number of
+//   blocks in the current run of blocks ending with an EOB, and the
+//   correction bits of the blocks in the run, which follow the EOB run
+struct EOBRun {
+    uint length = 0;
+    std::vector<byte> correctionBits;
+};
+
+// longest run of blocks a single EOB run symbol can code
+const uint maxEOBRun = 0x7FFF;
+// correction bits held back before an EOB run is written early
+const std::size_t maxCorrectionBits = 1000;
+
+// correction bits are not coded, so there is nothing to count
+inline void writeCorrectionBits(BitWriter& bitWriter, const HuffmanCoder& acCoder, const byte* const bits, const std::size_t numBits) {
+    if (!acCoder.counting) {
+        for (std::size_t i = 0; i < numBits; ++i) {
+            bitWriter.writeBit(bits[i]);
+        }
+    }
+}
+
+// write the EOB run, if any, followed by the correction bits of its blocks
+inline bool encodeEOBRun(BitWriter& bitWriter, HuffmanCoder& acCoder, EOBRun& eobRun) {
+    if (eobRun.length == 0) {
+        return true;
+    }
+    // EOBn codes runs of 2^n up to 2^(n+1)-1 blocks, with the low n bits following
+    const uint n = bitLength(eobRun.length) - 1;
+    if (!writeSymbol(bitWriter, acCoder, n << 4, eobRun.length, n)) {
+        console() << "Error - Invalid AC value\n";
+        return false;
+    }
+    eobRun.length = 0;
+    writeCorrectionBits(bitWriter, acCoder, eobRun.correctionBits.data(), eobRun.correctionBits.size());
+    eobRun.correctionBits.clear();
+    return true;
+}
+
+// encode the first scan of a band of the AC coefficients of a block,
+//   with their magnitudes shifted right by successiveApproximationLow
+inline bool encodeACFirst(
+    BitWriter& bitWriter,
+    const int* const component,
+    const byte startOfSelection,
+    const byte endOfSelection,
+    const byte successiveApproximationLow,
+    HuffmanCoder& acCoder,
+    EOBRun& eobRun
+) {
+    // the zeroes after the last nonzero coefficient end up in the EOB run
+    uint end = endOfSelection + 1;
+    while (end > startOfSelection && std::abs(component[zigZagMap[end - 1]]) >> successiveApproximationLow == 0) {
+        end -= 1;
+    }
+    uint numZeroes = 0;
+    for (uint i = startOfSelection; i < end; ++i) {
+        const int value = component[zigZagMap[i]];
+        const int magnitude = std::abs(value) >> successiveApproximationLow;
+        if (magnitude == 0) {
+            numZeroes += 1;
+            continue;
+        }
+        if (!encodeEOBRun(bitWriter, acCoder, eobRun)) {
+            return false;
+        }
+        while (numZeroes >= 16) {
+            if (!writeSymbol(bitWriter, acCoder, 0xF0, 0, 0)) {
+                console() << "Error - Invalid AC value\n";
+                return false;
+            }
+            numZeroes -= 16;
+        }
+        const uint coeffLength = bitLength(magnitude);
+        if (coeffLength > 10) {
+            console() << "Error - AC coefficient length greater than 10\n";
+            return false;
+        }
+        const int coeff = value < 0 ? magnitude ^ ((1 << coeffLength) - 1) : magnitude;
+        if (!writeSymbol(bitWriter, acCoder, numZeroes << 4 | coeffLength, coeff, coeffLength)) {
+            console() << "Error - Invalid AC value\n";
+            return false;
+        }
+        numZeroes = 0;
+    }
+    if (end <= endOfSelection) {
+        eobRun.length += 1;
+        if (eobRun.length == maxEOBRun) {
+            return encodeEOBRun(bitWriter, acCoder, eobRun);
+        }
+    }
+    return true;
+}
+
+// encode a refinement scan of a band of the AC coefficients of a block,
+//   adding bit successiveApproximationLow of their magnitudes
+// coefficients that become nonzero are coded like in a first scan with a
+//   magnitude of 1, while those that already are only get a correction bit,
+//   which follows the next symbol, or the EOB run of the block
+inline bool encodeACRefinement(
+    BitWriter& bitWriter,
+    const int* const component,
+    const byte startOfSelection,
+    const byte endOfSelection,
+    const byte successiveApproximationLow,
+    HuffmanCoder& acCoder,
+    EOBRun& eobRun
+) {
+    int magnitudes[64];
+    // position of the last coefficient that becomes nonzero in this scan,
+    //   and just past the last one that is nonzero at all
+    uint lastNew = 0;
+    uint end = startOfSelection;
+    for (uint i = startOfSelection; i <= endOfSelection; ++i) {
+        magnitudes[i] = std::abs(component[zigZagMap[i]]) >> successiveApproximationLow;
+        if (magnitudes[i] == 1) {
+            lastNew = i;
+        }
+        if (magnitudes[i] != 0) {
+            end = i + 1;
+        }
+    }
+
+    byte correctionBits[64];
+    uint numCorrectionBits = 0;
+    uint numZeroes = 0;
+    for (uint i = startOfSelection; i < end; ++i) {
+        if (magnitudes[i] == 0) {
+            numZeroes += 1;
+            continue;
+        }
+        // a run of zeroes is only broken up before a new nonzero coefficient
+        while (numZeroes >= 16 && i <= lastNew) {
+            if (!encodeEOBRun(bitWriter, acCoder, eobRun)) {
+                return false;
+            }
+            if (!writeSymbol(bitWriter, acCoder, 0xF0, 0, 0)) {
+                console() << "Error - Invalid AC value\n";
+                return false;
+            }
+            numZeroes -= 16;
+            writeCorrectionBits(bitWriter, acCoder, correctionBits, numCorrectionBits);
+            numCorrectionBits = 0;
+        }
+        if (magnitudes[i] > 1) {
+            correctionBits[numCorrectionBits++] = magnitudes[i] & 1;
+            continue;
+        }
+        if (!encodeEOBRun(bitWriter, acCoder, eobRun)) {
+            return false;
+        }
+        if (!writeSymbol(bitWriter, acCoder, numZeroes << 4 | 1, component[zigZagMap[i]] < 0 ? 0 : 1, 1)) {
+            console() << "Error - Invalid AC value\n";
+            return false;
+        }
+        writeCorrectionBits(bitWriter, acCoder, correctionBits, numCorrectionBits);
+        numCorrectionBits = 0;
+        numZeroes = 0;
+    }
+    if (numZeroes > 0 || end <= endOfSelection || numCorrectionBits > 0) {
+        eobRun.length += 1;
+        eobRun.correctionBits.insert(eobRun.correctionBits.end(), correctionBits, correctionBits + numCorrectionBits);
+        if (eobRun.length == maxEOBRun || eobRun.correctionBits.size() > maxCorrectionBits - 64) {
+            return encodeEOBRun(bitWriter, acCoder, eobRun);
+        }
+    }
+    return true;
+}
+
+// build the optimal Huffman table for the frequencies of its symbols, with
+//   codes of at most 16 bits and no code of all 1s, as in Annex K.2
+inline HuffmanTable optimalHuffmanTable(const std::uint64_t* const frequencies) {
+    // a reserved symbol that occurs once takes the code of all 1s
+    std::uint64_t frequency[257];
+    std::copy(frequencies, frequencies + 256, frequency);
+    frequency[256] = 1;
+    uint codeSize[257] = { 0 };
+    int others[257];
+    std::fill(others, others + 257, -1);
+
+    // repeatedly merge the two least frequent trees, preferring the
+    //   highest symbols on ties, adding 1 to the code sizes of both
+    while (true) {
+        int c1 = -1;
+        int c2 = -1;
+        for (int i = 0; i < 257; ++i) {
+            if (frequency[i] != 0 && (c1 < 0 || frequency[i] <= frequency[c1])) {
+                c1 = i;
+            }
+        }
+        for (int i = 0; i < 257; ++i) {
+            if (frequency[i] != 0 && i != c1 && (c2 < 0 || frequency[i] <= frequency[c2])) {
+                c2 = i;
+            }
+        }
+        if (c2 < 0) {
+            break;
+        }
+        frequency[c1] += frequency[c2];
+        frequency[c2] = 0;
+        codeSize[c1] += 1;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codeSize[c1] += 1;
+        }
+        others[c1] = c2;
+        codeSize[c2] += 1;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codeSize[c2] += 1;
+        }
+    }
+
+    uint numCodes[33] = { 0 };
+    for (uint i = 0; i < 257; ++i) {
+        if (codeSize[i] != 0) {
+            numCodes[codeSize[i]] += 1;
+        }
+    }
+    // shorten codes longer than 16 bits two at a time, by moving one of them
+    //   to the length above and lengthening a shorter code to make room
+    for (uint i = 32; i > 16; --i) {
+        while (numCodes[i] > 0) {
+            uint j = i - 2;
+            while (numCodes[j] == 0) {
+                j -= 1;
+            }
+            numCodes[i] -= 2;
+            numCodes[i - 1] += 1;
+            numCodes[j + 1] += 2;
+            numCodes[j] -= 1;
+        }
+    }
+    // drop the reserved symbol, which has one of the longest codes
+    uint longest = 16;
+    while (numCodes[longest] == 0) {
+        longest -= 1;
+    }
+    numCodes[longest] -= 1;
+
+    HuffmanTable hTable;
+    for (uint i = 0; i < 16; ++i) {
+        hTable.offsets[i + 1] = hTable.offsets[i] + numCodes[i + 1];
+    }
+    uint numSymbols = 0;
+    for (uint size = 1; size <= 32; ++size) {
+        for (uint symbol = 0; symbol < 256; ++symbol) {
+            if (codeSize[symbol] == size) {
+                hTable.symbols[numSymbols++] = symbol;
+            }
+        }
+    }
+    generateCodes(hTable);
+    hTable.set = true;
+    return hTable;
+}
+
+// helper function to write a 2-byte short integer in big-endian
+inline void putShort(std::ostream& outFile, const uint v) {
+    outFile.put((v >> 8) & 0xFF);
+    outFile.put((v >> 0) & 0xFF);
+}
+
+// 16-bit precision is only used when a value does not fit in 8 bits,
+//   and makes a sequential frame extended (SOF1) rather than baseline
+inline bool needsPrecision16(const QuantizationTable& qTable) {
+    bool precision16 = false;
+    for (uint i = 0; i < 64; ++i) {
+        precision16 |= qTable.table[i] > 255;
+    }
+    return precision16;
+}
+
+inline void writeQuantizationTable(std::ostream& outFile, byte tableID, const QuantizationTable& qTable) {
+    outFile.put(0xFF);
+    outFile.put(DQT);
+    const bool precision16 = needsPrecision16(qTable);
+    putShort(outFile, precision16 ? 131 : 67);
+    outFile.put(precision16 << 4 | tableID);
+    for (uint i = 0; i < 64; ++i) {
+        if (precision16) {
+            putShort(outFile, qTable.table[zigZagMap[i]]);
+        }
+        else {
+            outFile.put(qTable.table[zigZagMap[i]]);
+        }
+    }
+}
+
+inline void writeHuffmanTable(std::ostream& outFile, byte acdc, byte tableID, const HuffmanTable& hTable) {
+    outFile.put(0xFF);
+    outFile.put(DHT);
+    putShort(outFile, 19 + hTable.offsets[16]);
+    outFile.put(acdc << 4 | tableID);
+    for (uint i = 0; i < 16; ++i) {
+        outFile.put(hTable.offsets[i + 1] - hTable.offsets[i]);
+    }
+    for (uint i = 0; i < 16; ++i) {
+        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
+            outFile.put(hTable.symbols[j]);
+        }
+    }
+}
+
+inline void writeAPP0(std::ostream& outFile) {
+    outFile.put(0xFF);
+    outFile.put(APP0);
+    putShort(outFile, 16);
+    outFile.put('J');
+    outFile.put('F');
+    outFile.put('I');
+    outFile.put('F');
+    outFile.put(0);
+    outFile.put(1);
+    outFile.put(2);
+    outFile.put(0);
+    putShort(outFile, 100);
+    putShort(outFile, 100);
+    outFile.put(0);
+    outFile.put(0);
+}
+
+#endif
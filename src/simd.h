@@ -0,0 +1,99 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "console.h"
+
+// instruction set levels that the hot kernels are compiled for
+// the build itself targets the baseline instruction set, so the binaries
+//   run on any machine; every kernel is additionally compiled for each
+//   higher level and the best one the CPU supports is picked at startup
+enum SIMDLevel {
+    SIMD_DEFAULT, // baseline of the build, e.g. SSE2 on x86-64
+    SIMD_SSE42,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    SIMD_NUM_LEVELS
+};
+
+const char* const simdLevelNames[SIMD_NUM_LEVELS] = { "default", "sse4.2", "avx2", "avx512" };
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_TARGET_SSE42  __attribute__((target("sse4.2")))
+#define SIMD_TARGET_AVX2   __attribute__((target("avx2")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl")))
+#else
+#define SIMD_TARGET_SSE42
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512
+#endif
+
+// kernel bodies are forced inline into one function per level, where the
+//   compiler vectorizes them for that level's instruction set
+// the build disables floating-point contraction, so levels with FMA
+//   still produce results bit-identical to the baseline
+#define SIMD_INLINE inline __attribute__((always_inline))
+
+// define a function pointer name, along with nameVariants holding one
+//   function per level that runs nameKernel
+// name initially points at the baseline variant
+#define SIMD_KERNEL(ret, name, params, args) \
+    ret name##Default params { return name##Kernel args; } \
+    SIMD_TARGET_SSE42 ret name##SSE42 params { return name##Kernel args; } \
+    SIMD_TARGET_AVX2 ret name##AVX2 params { return name##Kernel args; } \
+    SIMD_TARGET_AVX512 ret name##AVX512 params { return name##Kernel args; } \
+    ret (* const name##Variants[SIMD_NUM_LEVELS]) params = { \
+        name##Default, name##SSE42, name##AVX2, name##AVX512 \
+    }; \
+    ret (*name) params = name##Default;
+
+// return the highest level supported by this CPU
+inline SIMDLevel detectSIMDLevel() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return SIMD_SSE42;
+    }
+#endif
+    return SIMD_DEFAULT;
+}
+
+// pick the level to run the kernels at: the highest one supported up to
+//   AVX2, or the level requested on the command line or by the JED_SIMD
+//   environment variable, so that every level can be benchmarked and
+//   tested on one machine
+// AVX-512 is only used on request, as the kernels work on rows of 8 values
+//   and gain nothing from wider vectors
+// a level beyond what the CPU supports is lowered to the supported one
+inline SIMDLevel selectSIMDLevel(std::string requested = std::string()) {
+    const SIMDLevel supported = detectSIMDLevel();
+    const SIMDLevel automatic = supported < SIMD_AVX2 ? supported : SIMD_AVX2;
+    if (requested.empty() && std::getenv("JED_SIMD") != nullptr) {
+        requested = std::getenv("JED_SIMD");
+    }
+    if (requested.empty()) {
+        return automatic;
+    }
+    for (int i = 0; i < SIMD_NUM_LEVELS; ++i) {
+        if (requested == simdLevelNames[i]) {
+            if (i > supported) {
+                console() << "Warning - " << simdLevelNames[i] << " not supported, using " << simdLevelNames[supported] << '\n';
+                return supported;
+            }
+            return (SIMDLevel)i;
+        }
+    }
+    console() << "Warning - Unknown SIMD level: " << requested << ", using " << simdLevelNames[automatic] << '\n';
+    return automatic;
+}
+
+#endif
@@ -0,0 +1,322 @@
+#!/bin/sh
+# regression checks for the decoder, run by make check
+# the JPG files they decode are generated by gen.py
+# usage: tests/check.sh [decoder]
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+decoder=${1:-$root/bin/decoder}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# decode $work/<file>.jpg with the given options, logging to $work/log,
+#   and fail unless it was decoded without errors
+decode() {
+    file=$1
+    shift
+    rm -f "$work/$file.bmp"
+    "$decoder" "$@" "$work/$file.jpg" > "$work/log" 2>&1
+    if grep -q "Error" "$work/log" || [ ! -f "$work/$file.bmp" ]; then
+        fail "$decoder $* $file.jpg"
+        grep "Error" "$work/log" | head -3
+        return 1
+    fi
+    return 0
+}
+
+# decode $work/<file>.jpg with the given options, and fail unless it is
+#   rejected with an error matching the pattern, instead of crashing or
+#   running for more than a minute
+reject() {
+    file=$1
+    pattern=$2
+    shift 2
+    timeout 60 "$decoder" "$@" "$work/$file.jpg" > "$work/log" 2>&1
+    status=$?
+    if [ "$status" -ne 0 ] || ! grep -q "Error - .*$pattern" "$work/log"; then
+        fail "$decoder $* $file.jpg exited with $status instead of reporting \"$pattern\""
+        tail -3 "$work/log"
+    fi
+}
+
+python3 "$root/tests/gen.py" "$work" || exit 1
+
+# print the frame marker of $work/<file>.jpg in hex
+frame_marker() {
+    python3 - "$work/$1.jpg" 2> /dev/null <<'EOF'
+import sys
+data = open(sys.argv[1], 'rb').read()
+pos = 2
+while pos + 4 <= len(data) and data[pos] == 0xFF:
+    marker = data[pos + 1]
+    if 0xC0 <= marker <= 0xCF and marker not in (0xC4, 0xC8, 0xCC):
+        print('%x' % marker)
+        break
+    pos += 2 + (data[pos + 2] << 8 | data[pos + 3])
+EOF
+}
+
+# -max-band skips the refinements of the bands it skipped, in files
+#   following the IJG scan script
+for name in baseline_gray baseline_444 baseline_420; do
+    "$decoder" -transcode progressive -output "$work/$name.progressive.jpg" "$work/$name.jpg" > /dev/null 2>&1
+    for band in 0 1 5 9 62 63; do
+        decode "$name.progressive" -max-band "$band"
+    done
+done
+
+# print the largest difference between the pixels of a BMP transformed with
+#   -transform <op> and those of the untransformed BMP given first, with
+#   the mirrored dimensions of the latter trimmed to whole MCUs of the
+#   given size, or "size" if the dimensions do not match
+transform_difference() {
+    python3 - "$@" <<'EOF'
+import sys
+
+def read_bmp(path):
+    data = open(path, 'rb').read()
+    offset = int.from_bytes(data[10:14], 'little')
+    width = int.from_bytes(data[18:22], 'little', signed=True)
+    height = int.from_bytes(data[22:26], 'little', signed=True)
+    channels = int.from_bytes(data[28:30], 'little') // 8
+    stride = (width * channels + 3) // 4 * 4
+    rows = []
+    for y in range(abs(height)):
+        start = offset + y * stride
+        row = data[start:start + width * channels]
+        rows.append([tuple(row[x * channels:(x + 1) * channels]) for x in range(width)])
+    return rows if height < 0 else rows[::-1]
+
+original, transformed, op, mcuWidth, mcuHeight = sys.argv[1:]
+pixels = read_bmp(original)
+result = read_bmp(transformed)
+# the coordinates each op maps (x, y) to, and whether it mirrors the
+#   columns and rows of the original
+transposed = op in ('transpose', 'transverse', 'rotate-90', 'rotate-270')
+mirrorX = op in ('flip-h', 'rotate-180', 'rotate-270', 'transverse')
+mirrorY = op in ('flip-v', 'rotate-180', 'rotate-90', 'transverse')
+width = len(pixels[0])
+height = len(pixels)
+if mirrorX:
+    width -= width % int(mcuWidth)
+if mirrorY:
+    height -= height % int(mcuHeight)
+expected = [[pixels[height - 1 - y if mirrorY else y][width - 1 - x if mirrorX else x]
+             for x in range(width)] for y in range(height)]
+if transposed:
+    expected = [list(column) for column in zip(*expected)]
+if len(expected) != len(result) or len(expected[0]) != len(result[0]):
+    print('size')
+    sys.exit()
+print(max(abs(a - b) for row, other in zip(expected, result)
+          for p, q in zip(row, other) for a, b in zip(p, q)))
+EOF
+}
+
+# -dc-only skips every AC scan, whatever -max-band is given before or
+#   after it
+for args in "-max-band 5 -dc-only" "-dc-only -max-band 5"; do
+    decode baseline_420.progressive $args &&
+        [ "$(grep -c "Skipping scan" "$work/log")" -eq 8 ] ||
+        fail "$decoder $args did not skip every AC scan"
+done
+
+# -transform rotates and flips the pixels of the image, trimming partial
+#   MCUs from the edges it mirrors; flips decode to exactly the same pixels,
+#   and transpositions to pixels within 2 of them, as the IDCT rounds its
+#   rows before its columns
+for args in baseline_gray:8x8 baseline_444:8x8 baseline_422:16x8 baseline_420:16x16 baseline_440:8x16; do
+    name=${args%:*}
+    mcu=${args#*:}
+    decode "$name" || continue
+    for op in flip-h flip-v rotate-180 rotate-90 rotate-270 transpose transverse; do
+        "$decoder" -transform "$op" "$work/$name.jpg" > /dev/null 2>&1
+        decode "$name.$op" || continue
+        difference=$(transform_difference "$work/$name.bmp" "$work/$name.$op.bmp" "$op" ${mcu%x*} ${mcu#*x})
+        case $op in
+            flip-*|rotate-180) tolerance=0 ;;
+            *) tolerance=2 ;;
+        esac
+        [ "$difference" != size ] && [ "$difference" -le "$tolerance" ] ||
+            fail "$decoder -transform $op $name.jpg is off by $difference"
+    done
+done
+
+# a baseline file transcoded to progressive and back keeps the coefficients
+#   of every block in the image, so it decodes to the same pixels and is
+#   transcoded to the same progressive file again; only the blocks padding
+#   interleaved MCUs past the edges, which progressive AC scans of a single
+#   component leave out, are not kept
+for name in baseline_gray baseline_444 baseline_422 baseline_420 baseline_440; do
+    "$decoder" -transcode progressive -output "$work/$name.round.jpg" "$work/$name.jpg" > /dev/null 2>&1
+    "$decoder" -transcode baseline "$work/$name.round.jpg" > /dev/null 2>&1
+    "$decoder" -transcode progressive "$work/$name.round.baseline.jpg" > /dev/null 2>&1
+    cmp -s "$work/$name.round.jpg" "$work/$name.round.baseline.progressive.jpg" ||
+        fail "$name.jpg changed on its way through baseline"
+    decode "$name" && mv "$work/$name.bmp" "$work/reference.bmp"
+    decode "$name.round.baseline" && cmp -s "$work/reference.bmp" "$work/$name.round.baseline.bmp" ||
+        fail "$name.jpg decoded differently after its way through progressive"
+done
+
+# -y4m decodes concatenated frames in parallel into a stream of all of
+#   them, whose chroma subsampling Y4M consumers accept: 4:4:0 frames are
+#   written as 4:4:4
+for args in baseline_gray:301x199:mono:0 baseline_444:64x48:444:2 baseline_422:257x131:422:2 \
+    baseline_420:333x251:420jpeg:2 baseline_440:99x170:444:2; do
+    name=${args%%:*}
+    size=${args#*:}
+    size=${size%%:*}
+    chroma=${args#*:*:}
+    chroma=${chroma%:*}
+    width=${size%x*}
+    height=${size#*x}
+    case $chroma in
+        420jpeg) chromaSize=$(( (width + 1) / 2 * ((height + 1) / 2) )) ;;
+        422) chromaSize=$(( (width + 1) / 2 * height )) ;;
+        *) chromaSize=$((width * height)) ;;
+    esac
+    frameSize=$((width * height + ${args##*:} * chromaSize))
+    cat "$work/$name.jpg" "$work/$name.jpg" "$work/$name.jpg" "$work/$name.jpg" "$work/$name.jpg" > "$work/stream.jpg"
+    "$decoder" -y4m -threads 4 "$work/stream.jpg" > "$work/log" 2>&1
+    header="YUV4MPEG2 W$width H$height F30:1 Ip A1:1 C$chroma"
+    if grep -q "Error" "$work/log" || ! grep -q "Decoded 5 frames" "$work/log" ||
+        [ "$(head -n 1 "$work/stream.y4m")" != "$header" ] ||
+        [ "$(wc -c < "$work/stream.y4m")" -ne $((${#header} + 1 + 5 * (6 + frameSize))) ]; then
+        fail "$decoder -y4m -threads 4 did not write 5 frames of $name.jpg as $header"
+    fi
+done
+
+# files are rewritten as extended sequential (SOF1) rather than baseline
+#   when a quantization table needs 16 bits, and decoded as they were
+decode extended && mv "$work/extended.bmp" "$work/reference.bmp"
+for args in "-transcode baseline:extended.baseline:c1" "-transcode progressive:extended.progressive:c2" \
+    "-requantize 90:extended.q90:c1" "-transcode baseline:baseline_444.baseline:c0"; do
+    option=${args%%:*}
+    output=${args#*:}
+    marker=${output#*:}
+    output=${output%:*}
+    "$decoder" $option "$work/${output%%.*}.jpg" > /dev/null 2>&1
+    [ "$(frame_marker "$output")" = "$marker" ] ||
+        fail "$decoder $option ${output%%.*}.jpg did not write an SOF marker of 0x$marker"
+done
+for name in extended.baseline extended.progressive; do
+    decode "$name" && cmp -s "$work/reference.bmp" "$work/$name.bmp" ||
+        fail "$name.jpg decoded differently from extended.jpg"
+done
+decode extended.q90
+
+# -stream decodes every file to the same pixels as a decode of the whole
+#   file, whether its MCU rows are written as they arrive or its
+#   progressive scans once they are complete
+for path in "$work"/baseline_*.jpg; do
+    name=$(basename "$path" .jpg)
+    case $name in
+        *.*) continue ;;
+    esac
+    progressive=progressive_${name#baseline_}
+    "$decoder" -transcode progressive -output "$work/$progressive.jpg" "$path" > /dev/null 2>&1
+    for file in "$name" "$progressive"; do
+        decode "$file" && mv "$work/$file.bmp" "$work/reference.bmp" || continue
+        decode "$file" -stream || continue
+        cmp -s "$work/reference.bmp" "$work/$file.bmp" ||
+            fail "$decoder -stream $file.jpg decoded differently"
+    done
+done
+
+# -verify finds the speculative decode of baseline files without restart
+#   markers equal to the serial one; the large files are sure to be split
+#   into chunks
+for path in "$work"/baseline_*.jpg; do
+    name=$(basename "$path" .jpg)
+    decode "$name" -verify -threads 4 || continue
+    case $name in
+        baseline_large_*)
+            grep -q "Speculative decoding matches serial decoding" "$work/log" ||
+                fail "$decoder -verify -threads 4 $name.jpg did not decode speculatively"
+            ;;
+    esac
+done
+
+# a mismatch that -verify finds is reported, and the serial result is
+#   written instead of the speculative one
+decode baseline_large_420 -threads 4 && mv "$work/baseline_large_420.bmp" "$work/serial.bmp"
+JED_SPECULATIVE_FAULT=1000 "$decoder" -verify -threads 4 "$work/baseline_large_420.jpg" > "$work/log" 2>&1
+grep -q "Speculative decoding differs from serial decoding at block component 1000" "$work/log" ||
+    fail "-verify did not find an altered block"
+cmp -s "$work/serial.bmp" "$work/baseline_large_420.bmp" ||
+    fail "-verify wrote the speculative result despite a mismatch"
+
+# -cache renders files from their cached coefficients as they are decoded,
+#   finds them by the SHA-256 digest of the file, uses no entry written for
+#   another file, and caches no coefficients that do not fit in 16 bits
+mkdir "$work/cache"
+for name in baseline_420 baseline_440 wide_dc; do
+    decode "$name" && mv "$work/$name.bmp" "$work/reference.bmp"
+    for pass in 1 2; do
+        decode "$name" -cache "$work/cache" &&
+            cmp -s "$work/reference.bmp" "$work/$name.bmp" ||
+            fail "$decoder -cache rendered $name.jpg differently on pass $pass"
+    done
+done
+grep -q "Using cached coefficients" "$work/log" &&
+    fail "$decoder -cache cached coefficients wider than 16 bits"
+digest() {
+    sha256sum "$work/$1.jpg" | cut -c1-64
+}
+[ -f "$work/cache/$(digest baseline_420).jedc" ] ||
+    fail "$decoder -cache did not name its entry by the SHA-256 digest"
+cp "$work/cache/$(digest baseline_420).jedc" "$work/cache/$(digest baseline_444).jedc"
+decode baseline_444 -cache "$work/cache" && grep -q "Using cached coefficients" "$work/log" &&
+    fail "$decoder -cache used an entry written for another file"
+
+# the limits reject adversarial files before allocating or decoding them,
+#   and truncated files end in an error
+reject huge_frame "pixel limit" -limit-pixels 100000000
+reject huge_frame "memory limit" -limit-memory 256
+reject many_scans "scan limit" -limit-scans 1000
+reject many_scans "time limit" -limit-time 0.000001
+reject baseline_420 "input limit" -limit-input 1000
+decode many_scans
+decode many_chroma_scans
+# scans that are skipped count toward the limits as well
+for args in "-max-band 0" "-gray" "-gray -stream"; do
+    reject many_chroma_scans "scan limit" -limit-scans 1000 $args
+done
+head -c 300000 "$work/baseline_large_420.jpg" > "$work/truncated.jpg"
+reject truncated "ended prematurely"
+reject truncated "ended prematurely" -stream
+"$decoder" -transcode progressive -output "$work/progressive.jpg" "$work/baseline_large_420.jpg" > /dev/null 2>&1
+head -c 200000 "$work/progressive.jpg" > "$work/truncated.jpg"
+reject truncated "ended prematurely"
+reject truncated "ended prematurely" -stream
+
+# -probe skips APPN segments instead of reading them, and gives up on
+#   headers larger than it reads
+"$decoder" -probe "$work/large_app.jpg" | grep -q '"valid":true' ||
+    fail "$decoder -probe large_app.jpg"
+"$decoder" -probe "$work/many_tables.jpg" | grep -q '"error":"Headers exceed the probe limit' ||
+    fail "$decoder -probe many_tables.jpg"
+
+# -thumbnail skips APP segments by their length to reach the thumbnail
+rm -f "$work/large_app_thumbnail.thumb.bmp"
+"$decoder" -thumbnail "$work/large_app_thumbnail.jpg" > "$work/log" 2>&1
+grep -q "Error" "$work/log" || [ ! -f "$work/large_app_thumbnail.thumb.bmp" ] &&
+    fail "$decoder -thumbnail large_app_thumbnail.jpg"
+
+# numeric options out of range are rejected rather than clamped
+for args in "-requantize 0" "-requantize 101" "-requantize-band 64" "-max-band 64" "-max-band -1" "-threads 0"; do
+    if "$decoder" $args "$work/baseline_444.jpg" > "$work/log" 2>&1; then
+        fail "$decoder $args accepted"
+    fi
+done
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures checks failed"
+    exit 1
+fi
+echo "All checks passed"
@@ -0,0 +1,264 @@
+#!/usr/bin/env python3
+# generate the JPG files used by check.sh into the given directory
+# baseline files hold pseudo-random coefficients coded with fixed-length
+#   Huffman tables, so that no image library is needed to make them
+import random
+import struct
+import sys
+
+# fixed-length Huffman tables: every DC category in 4 bits,
+#   every AC run/size symbol in 8 bits
+DC_SYMBOLS = list(range(12))
+AC_SYMBOLS = [0x00, 0xF0] + [(run << 4) | size for run in range(16) for size in range(1, 11)]
+DC_CODES = {symbol: (code, 4) for code, symbol in enumerate(DC_SYMBOLS)}
+AC_CODES = {symbol: (code, 8) for code, symbol in enumerate(AC_SYMBOLS)}
+
+ZIGZAG = [
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+]
+
+
+class BitWriter:
+    def __init__(self):
+        self.data = bytearray()
+        self.buffer = 0
+        self.length = 0
+
+    def write(self, bits, length):
+        self.buffer = (self.buffer << length) | bits
+        self.length += length
+        while self.length >= 8:
+            self.length -= 8
+            byte = (self.buffer >> self.length) & 0xFF
+            self.data.append(byte)
+            if byte == 0xFF:
+                self.data.append(0x00)
+        self.buffer &= (1 << self.length) - 1
+
+    def flush(self):
+        if self.length > 0:
+            self.write((1 << (8 - self.length)) - 1, 8 - self.length)
+        return bytes(self.data)
+
+
+def segment(marker, payload):
+    return struct.pack('>BBH', 0xFF, marker, len(payload) + 2) + payload
+
+
+def huffman_table(table_class, table_id, symbols, length):
+    counts = [0] * 16
+    counts[length - 1] = len(symbols)
+    return bytes([(table_class << 4) | table_id]) + bytes(counts) + bytes(symbols)
+
+
+def frame_header(marker, width, height, sampling):
+    payload = struct.pack('>BHHB', 8, height, width, len(sampling))
+    for i, (h, v) in enumerate(sampling):
+        payload += bytes([i + 1, (h << 4) | v, 0])
+    return segment(marker, payload)
+
+
+def category(value):
+    return abs(value).bit_length()
+
+
+def value_bits(value):
+    size = category(value)
+    return (value if value >= 0 else value + (1 << size) - 1), size
+
+
+def encode_block(writer, coefficients, previous_dc):
+    difference = coefficients[0] - previous_dc
+    code, length = DC_CODES[category(difference)]
+    writer.write(code, length)
+    if difference != 0:
+        writer.write(*value_bits(difference))
+    run = 0
+    for k in range(1, 64):
+        value = coefficients[ZIGZAG[k]]
+        if value == 0:
+            run += 1
+            continue
+        while run > 15:
+            writer.write(*AC_CODES[0xF0])
+            run -= 16
+        writer.write(*AC_CODES[(run << 4) | category(value)])
+        writer.write(*value_bits(value))
+        run = 0
+    if run > 0:
+        writer.write(*AC_CODES[0x00])
+
+
+def random_block(rng, dc):
+    coefficients = [0] * 64
+    coefficients[0] = dc
+    for _ in range(rng.randrange(12)):
+        k = min(63, 1 + int(rng.expovariate(0.15)))
+        magnitude = 1 + int(rng.expovariate(0.3)) if rng.random() < 0.95 else rng.randrange(1, 200)
+        coefficients[ZIGZAG[k]] = magnitude if rng.random() < 0.5 else -magnitude
+    return coefficients
+
+
+# a baseline JPG without restart markers whose components have the
+#   given sampling factors, luminance first
+def baseline_jpg(width, height, sampling, seed):
+    rng = random.Random(seed)
+    maxH = max(h for h, v in sampling)
+    maxV = max(v for h, v in sampling)
+    mcuWidth = (width + 8 * maxH - 1) // (8 * maxH)
+    mcuHeight = (height + 8 * maxV - 1) // (8 * maxV)
+    if len(sampling) == 1:
+        # a single component is not interleaved, so its MCUs are blocks
+        mcuWidth = (width + 7) // 8
+        mcuHeight = (height + 7) // 8
+        sampling = [(1, 1)]
+
+    writer = BitWriter()
+    dcs = [0] * len(sampling)
+    for _ in range(mcuWidth * mcuHeight):
+        for i, (h, v) in enumerate(sampling):
+            # mild chroma keeps the colors within range
+            limit = 100 if i == 0 else 20
+            for _ in range(h * v):
+                dc = max(-limit, min(limit, dcs[i] + rng.randrange(-6, 7)))
+                encode_block(writer, random_block(rng, dc), dcs[i])
+                dcs[i] = dc
+
+    data = b'\xFF\xD8'
+    data += segment(0xDB, bytes([0]) + bytes([4] * 64))
+    data += frame_header(0xC0, width, height, sampling)
+    data += segment(0xC4, huffman_table(0, 0, DC_SYMBOLS, 4) + huffman_table(1, 0, AC_SYMBOLS, 8))
+    scan = bytes([len(sampling)])
+    for i in range(len(sampling)):
+        scan += bytes([i + 1, 0x00])
+    data += segment(0xDA, scan + bytes([0, 63, 0]))
+    data += writer.flush()
+    return data + b'\xFF\xD9'
+
+
+# a frame header of 65535x65535 pixels, to be rejected by the limits
+#   before anything is allocated
+def huge_frame_jpg():
+    data = b'\xFF\xD8'
+    data += segment(0xDB, bytes([0]) + bytes([4] * 64))
+    data += frame_header(0xC0, 65535, 65535, [(2, 2), (1, 1), (1, 1)])
+    data += segment(0xC4, huffman_table(0, 0, DC_SYMBOLS, 4) + huffman_table(1, 0, AC_SYMBOLS, 8))
+    data += segment(0xDA, bytes([3, 1, 0x00, 2, 0x00, 3, 0x00, 0, 63, 0]))
+    return data + bytes(64) + b'\xFF\xD9'
+
+
+# a progressive gray image of 16x16 pixels whose DC scan is repeated
+#   the given number of times
+def many_scans_jpg(count):
+    data = b'\xFF\xD8'
+    data += segment(0xDB, bytes([0]) + bytes([4] * 64))
+    data += frame_header(0xC2, 16, 16, [(1, 1)])
+    data += segment(0xC4, huffman_table(0, 0, DC_SYMBOLS, 4))
+    for _ in range(count):
+        # four blocks with a DC difference of 0
+        data += segment(0xDA, bytes([1, 1, 0x00, 0, 0, 0])) + bytes(2)
+    return data + b'\xFF\xD9'
+
+
+# a progressive color image of 16x16 pixels whose DC scan is followed by
+#   the given number of AC scans of its first chroma component, all of
+#   which -max-band 0 and -gray skip
+def many_chroma_scans_jpg(count):
+    data = b'\xFF\xD8'
+    data += segment(0xDB, bytes([0]) + bytes([4] * 64))
+    data += frame_header(0xC2, 16, 16, [(1, 1), (1, 1), (1, 1)])
+    data += segment(0xC4, huffman_table(0, 0, DC_SYMBOLS, 4) + huffman_table(1, 0, AC_SYMBOLS, 8))
+    # four MCUs of three blocks with a DC difference of 0
+    data += segment(0xDA, bytes([3, 1, 0x00, 2, 0x00, 3, 0x00, 0, 0, 0])) + bytes(6)
+    for _ in range(count):
+        # an EOB for each of the four blocks
+        data += segment(0xDA, bytes([1, 2, 0x00, 1, 63, 0])) + bytes(4)
+    return data + b'\xFF\xD9'
+
+
+# a baseline gray image of 256x8 pixels whose DC differences add up past
+#   the 16 bits of a coefficient
+def wide_dc_jpg():
+    writer = BitWriter()
+    for i in range(32):
+        coefficients = [0] * 64
+        coefficients[0] = 2000 * (i + 1)
+        encode_block(writer, coefficients, 2000 * i)
+    data = b'\xFF\xD8'
+    data += segment(0xDB, bytes([0]) + bytes([4] * 64))
+    data += frame_header(0xC0, 256, 8, [(1, 1)])
+    data += segment(0xC4, huffman_table(0, 0, DC_SYMBOLS, 4) + huffman_table(1, 0, AC_SYMBOLS, 8))
+    data += segment(0xDA, bytes([1, 1, 0x00, 0, 63, 0]))
+    data += writer.flush()
+    return data + b'\xFF\xD9'
+
+
+# an extended sequential (SOF1) color image of 64x48 pixels whose
+#   quantization table has 16-bit steps, of which the last is over 255
+def extended_jpg():
+    data = baseline_jpg(64, 48, [(1, 1), (1, 1), (1, 1)], 1)
+    steps = [4] * 63 + [300]
+    data = data.replace(segment(0xDB, bytes([0]) + bytes([4] * 64)),
+                        segment(0xDB, bytes([0x10]) + struct.pack('>64H', *steps)))
+    return data.replace(frame_header(0xC0, 64, 48, [(1, 1)] * 3), frame_header(0xC1, 64, 48, [(1, 1)] * 3))
+
+
+# an EXIF segment whose IFD1 locates the given JPG thumbnail
+def exif_thumbnail(thumbnail):
+    # an empty IFD0, and an IFD1 of two entries, followed by the thumbnail
+    tiff = b'II*\x00' + struct.pack('<IHI', 8, 0, 14)
+    tiff += struct.pack('<H', 2)
+    tiff += struct.pack('<HHII', 0x0201, 4, 1, 44)
+    tiff += struct.pack('<HHII', 0x0202, 4, 1, len(thumbnail))
+    tiff += struct.pack('<I', 0)
+    return segment(0xE1, b'Exif\x00\x00' + tiff + thumbnail)
+
+
+# a baseline file with segments inserted after its SOI
+def with_segments(data, segments):
+    return data[:2] + segments + data[2:]
+
+
+BASELINE = [
+    ('gray', 301, 199, [(1, 1)]),
+    ('444', 64, 48, [(1, 1), (1, 1), (1, 1)]),
+    ('422', 257, 131, [(2, 1), (1, 1), (1, 1)]),
+    ('420', 333, 251, [(2, 2), (1, 1), (1, 1)]),
+    ('440', 99, 170, [(1, 2), (1, 1), (1, 1)]),
+    ('large_420', 2049, 1537, [(2, 2), (1, 1), (1, 1)]),
+    ('large_gray', 1920, 1080, [(1, 1)]),
+]
+
+
+def main():
+    directory = sys.argv[1]
+    for seed, (name, width, height, sampling) in enumerate(BASELINE):
+        with open('%s/baseline_%s.jpg' % (directory, name), 'wb') as f:
+            f.write(baseline_jpg(width, height, sampling, seed))
+    small = baseline_jpg(64, 48, [(1, 1), (1, 1), (1, 1)], 0)
+    # APP1 segments of 6.5 MB, like an embedded preview, which -probe skips
+    with open('%s/large_app.jpg' % directory, 'wb') as f:
+        f.write(with_segments(small, segment(0xE1, bytes(65533)) * 100))
+    # the same, with an EXIF thumbnail after the APP segments
+    with open('%s/large_app_thumbnail.jpg' % directory, 'wb') as f:
+        f.write(with_segments(small, segment(0xE2, bytes(65533)) * 100 + exif_thumbnail(small)))
+    # quantization tables of 4.7 MB, more than -probe reads
+    with open('%s/many_tables.jpg' % directory, 'wb') as f:
+        f.write(with_segments(small, segment(0xDB, bytes([0]) + bytes([1] * 64)) * 70000))
+    with open('%s/huge_frame.jpg' % directory, 'wb') as f:
+        f.write(huge_frame_jpg())
+    with open('%s/many_scans.jpg' % directory, 'wb') as f:
+        f.write(many_scans_jpg(5000))
+    with open('%s/many_chroma_scans.jpg' % directory, 'wb') as f:
+        f.write(many_chroma_scans_jpg(5000))
+    with open('%s/wide_dc.jpg' % directory, 'wb') as f:
+        f.write(wide_dc_jpg())
+    with open('%s/extended.jpg' % directory, 'wb') as f:
+        f.write(extended_jpg())
+
+
+if __name__ == '__main__':
+    main()